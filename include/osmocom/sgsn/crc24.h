@@ -2,9 +2,16 @@
 #define _CRC24_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 #define INIT_CRC24	0xffffff
 
+/* Uses the fastest of the implementations below the CPU supports */
 uint32_t crc24_calc(uint32_t fcs, uint8_t *cp, unsigned int len);
 
+uint32_t crc24_calc_bytewise(uint32_t fcs, const uint8_t *cp, unsigned int len);
+uint32_t crc24_calc_slice8(uint32_t fcs, const uint8_t *cp, unsigned int len);
+uint32_t crc24_calc_pclmul(uint32_t fcs, const uint8_t *cp, unsigned int len);
+bool crc24_have_pclmul(void);
+
 #endif
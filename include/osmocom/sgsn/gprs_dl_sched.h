@@ -0,0 +1,125 @@
+/* Downlink scheduler between LLC and BSSGP */
+
+/* (C) 2026 by sysmocom s.f.m.c. GmbH <info@sysmocom.de>
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <osmocom/core/linuxlist.h>
+#include <osmocom/core/timer.h>
+#include <osmocom/gsm/protocol/gsm_23_003.h>
+#include <osmocom/gprs/gprs_bssgp.h>
+
+#include <osmocom/sgsn/gprs_sgsn.h>
+#include <osmocom/sgsn/gprs_llc.h>
+
+struct msgb;
+struct gprs_llc_llme;
+
+/* Leaky bucket as in 3GPP TS 48.018 Annex A, in octets and octets/s. A
+ * leak rate of 0 means that no limit is known. */
+struct gprs_dl_bucket {
+	uint32_t size_max;
+	uint32_t leak_rate;
+	uint32_t fill;
+	uint64_t last_us;
+};
+
+/* Scheduler state of one BVC, exists as long as an MS refers to it */
+struct gprs_dl_bvc {
+	/* entry in gprs_dl_bvcs */
+	struct llist_head list;
+	uint16_t nsei;
+	uint16_t bvci;
+	unsigned int num_ms;
+
+	/* MSs with priority frames queued, served one frame each in turn
+	 * before any bulk frame */
+	struct llist_head prio_active;
+	unsigned int num_prio_active;
+
+	/* MSs with bulk frames queued, served by deficit round robin */
+	struct llist_head active;
+	unsigned int num_active;
+	/* the MS at the head of 'active' got its quantum already */
+	bool in_turn;
+
+	/* the BVC bucket is the one of the BSSGP flow control */
+	struct osmo_timer_list timer;
+
+	struct {
+		unsigned int queued_frames;
+		unsigned int queued_bytes;
+		unsigned long long sent_frames;
+		unsigned long long sent_bytes;
+		/* sent after waiting in a queue */
+		unsigned long long deferred;
+		unsigned long long dropped;
+		/* priority frames sent, and bulk frames dropped by CoDel */
+		unsigned long long prio;
+		unsigned long long codel_dropped;
+	} stats;
+};
+
+/* State of CoDel on the bulk queue of an MS, see RFC 8289 */
+struct gprs_dl_codel {
+	uint64_t first_above_us;
+	uint64_t drop_next_us;
+	unsigned int count;
+	unsigned int lastcount;
+	bool dropping;
+};
+
+/* Scheduler state of one MS, allocated on its first downlink frame */
+struct gprs_dl_ms {
+	struct gprs_llc_llme *llme;
+	struct gprs_dl_bvc *bvc;
+	/* entry in bvc->active while bulk frames are queued */
+	struct llist_head list;
+	/* entry in bvc->prio_active while priority frames are queued */
+	struct llist_head prio_list;
+
+	/* queued frames, in both queues together */
+	struct llist_head prio_queue;
+	struct llist_head queue;
+	unsigned int queued_frames;
+	unsigned int queued_bytes;
+	/* bulk frames queued per SAPI, no priority frame of the same LLE
+	 * may overtake them */
+	unsigned int queued_bulk[NUM_SAPIS];
+	unsigned int deficit;
+	struct gprs_dl_codel codel;
+
+	struct gprs_dl_bucket bucket;
+
+	/* BSSGP parameters of the last frame queued, with copies of what
+	 * they point to in the MM context */
+	struct bssgp_dl_ud_par dup;
+	char imsi[GSM23003_IMSI_MAX_DIGITS+1];
+	uint8_t ms_ra_cap[sizeof(((struct sgsn_mm_ctx *)0)->ms_radio_access_capa.buf)];
+
+	unsigned long long dropped;
+};
+
+extern struct llist_head gprs_dl_bvcs;
+
+int gprs_dl_sched_tx(struct gprs_llc_llme *llme, struct msgb *msg,
+		     uint8_t sapi, const struct bssgp_dl_ud_par *dup, bool prio);
+void gprs_dl_sched_ms_free(struct gprs_llc_llme *llme);
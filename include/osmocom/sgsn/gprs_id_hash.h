@@ -0,0 +1,123 @@
+/* Intrusive hash index for 32bit GPRS identities (TLLI, P-TMSI) */
+
+/* (C) 2026 by sysmocom s.f.m.c. GmbH <info@sysmocom.de>
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* The bucket array is meant to be statically allocated, so a zeroed
+ * struct gprs_id_hash is an empty index and no set-up is needed. */
+#define GPRS_ID_HASH_BITS	16
+#define GPRS_ID_HASH_SIZE	(1 << GPRS_ID_HASH_BITS)
+
+/* To be embedded into the object that is to be indexed. An object may
+ * carry several nodes, e.g. one for the current and one for the old
+ * identity, all of them pointing back to the object via 'priv'. */
+struct gprs_id_hnode {
+	struct gprs_id_hnode *next;
+	struct gprs_id_hnode **pprev;
+	uint32_t id;
+	void *priv;
+};
+
+struct gprs_id_hash {
+	struct gprs_id_hnode *buckets[GPRS_ID_HASH_SIZE];
+	unsigned int count;
+};
+
+/* The low bits of TLLIs and P-TMSIs are random, but the MSBs encode the
+ * identity type; a multiplicative hash spreads both over all buckets */
+static inline unsigned int gprs_id_hash_bucket(uint32_t id)
+{
+	return (id * 0x9e3779b1U) >> (32 - GPRS_ID_HASH_BITS);
+}
+
+static inline bool gprs_id_hnode_hashed(const struct gprs_id_hnode *node)
+{
+	return node->pprev != NULL;
+}
+
+static inline void gprs_id_hash_add(struct gprs_id_hash *hash,
+				    struct gprs_id_hnode *node,
+				    uint32_t id, void *priv)
+{
+	struct gprs_id_hnode **head = &hash->buckets[gprs_id_hash_bucket(id)];
+
+	node->id = id;
+	node->priv = priv;
+	node->next = *head;
+	if (*head)
+		(*head)->pprev = &node->next;
+	*head = node;
+	node->pprev = head;
+	hash->count++;
+}
+
+/* Remove a node from the index, it is safe to call this on a node that
+ * is not (or no longer) hashed */
+static inline void gprs_id_hash_del(struct gprs_id_hash *hash,
+				    struct gprs_id_hnode *node)
+{
+	if (!gprs_id_hnode_hashed(node))
+		return;
+
+	*node->pprev = node->next;
+	if (node->next)
+		node->next->pprev = node->pprev;
+	node->next = NULL;
+	node->pprev = NULL;
+	hash->count--;
+}
+
+/* (Re-)index a node under a new identity, 'unused' is the value that
+ * marks the identity as not assigned and just removes the node */
+static inline void gprs_id_hash_update(struct gprs_id_hash *hash,
+				       struct gprs_id_hnode *node,
+				       uint32_t id, uint32_t unused, void *priv)
+{
+	if (gprs_id_hnode_hashed(node) && node->id == id)
+		return;
+
+	gprs_id_hash_del(hash, node);
+	if (id != unused)
+		gprs_id_hash_add(hash, node, id, priv);
+}
+
+static inline struct gprs_id_hnode *gprs_id_hash_next(struct gprs_id_hnode *node,
+						      uint32_t id)
+{
+	for (; node; node = node->next) {
+		if (node->id == id)
+			return node;
+	}
+	return NULL;
+}
+
+static inline struct gprs_id_hnode *gprs_id_hash_first(const struct gprs_id_hash *hash,
+						       uint32_t id)
+{
+	return gprs_id_hash_next(hash->buckets[gprs_id_hash_bucket(id)], id);
+}
+
+/* Iterate over all nodes that are indexed under the given identity */
+#define gprs_id_hash_for_each(node, hash, id_) \
+	for (node = gprs_id_hash_first(hash, id_); node; \
+	     node = gprs_id_hash_next(node->next, id_))
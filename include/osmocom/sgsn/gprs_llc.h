@@ -112,21 +112,14 @@ struct gprs_llc_params {
 
 /* Section 4.7.1: Logical Link Entity: One per DLCI (TLLI + SAPI) */
 struct gprs_llc_lle {
-	struct llist_head list;
+	/* The fields used for each unconfirmed frame by gprs_llc_tx_ui()
+	 * and gprs_llc_rcvmsg() come first to share a cache line */
+	struct gprs_llc_llme *llme;
 
 	uint32_t sapi;
 
-	struct gprs_llc_llme *llme;
-
 	enum gprs_llc_lle_state state;
 
-	struct osmo_timer_list t200;
-	struct osmo_timer_list t201;	/* wait for acknowledgement */
-
-	uint16_t v_sent;
-	uint16_t v_ack;
-	uint16_t v_recv;
-
 	uint16_t vu_send;
 	uint16_t vu_recv;
 
@@ -134,31 +127,45 @@ struct gprs_llc_lle {
 	uint16_t vu_recv_last;
 	uint16_t vu_recv_duplicates;
 
-	/* Overflow Counter for ABM */
-	uint32_t oc_i_send;
-	uint32_t oc_i_recv;
-
 	/* Overflow Counter for unconfirmed transfer */
 	uint32_t oc_ui_send;
 	uint32_t oc_ui_recv;
 
-	unsigned int retrans_ctr;
-
 	struct gprs_llc_params params;
 
+	struct llist_head list;
+
+	struct osmo_timer_list t200;
+	struct osmo_timer_list t201;	/* wait for acknowledgement */
+
+	uint16_t v_sent;
+	uint16_t v_ack;
+	uint16_t v_recv;
+
+	/* Overflow Counter for ABM */
+	uint32_t oc_i_send;
+	uint32_t oc_i_recv;
+
+	unsigned int retrans_ctr;
+
 	/* Copy of the XID fields we have sent with the last
 	 * network originated XID-Request. Since the phone
 	 * may strip the optional fields in the confirmation
 	 * we need to remeber those fields in order to be
 	 * able to create the compression entity. */
 	struct llist_head *xid;
+
+	/* UI frame bursts handed to an offload worker, in order of N(U) */
+	struct llist_head tx_jobs;
 };
 
 #define NUM_SAPIS	16
 
-struct gprs_llc_llme {
-	struct llist_head list;
+struct gprs_sndcp_entity;
+struct gprs_dl_ms;
 
+struct gprs_llc_llme {
+	/* As in the LLE, the fields used for each frame come first */
 	enum gprs_llc_llme_state state;
 
 	uint32_t tlli;
@@ -174,24 +181,51 @@ struct gprs_llc_llme {
 	/* over which BSSGP BTS ctx do we need to transmit */
 	uint16_t bvci;
 	uint16_t nsei;
-	struct gprs_llc_lle lle[NUM_SAPIS];
+
+	/* Most MS only ever use SAPI 1 and one SNDCP SAPI, so the LLEs
+	 * are allocated on first use, see gprs_llme_lle() */
+	struct gprs_llc_lle *lle[NUM_SAPIS];
+
+	struct llist_head list;
+
+	/* entries in the TLLI index of the LLC layer */
+	struct gprs_id_hnode tlli_hnode;
+	struct gprs_id_hnode old_tlli_hnode;
+
+	/* SNDCP entities on top of the LLEs, indexed by NSAPI */
+	struct gprs_sndcp_entity *sne[NUM_NSAPIS];
 
 	/* Compression entities */
 	struct {
 		/* In these two list_heads we will store the
 		 * data and protocol compression entities,
-		 * together with their compression states */
+		 * together with their compression states. They are
+		 * NULL until the first entity is negotiated. */
 		struct llist_head *proto;
 		struct llist_head *data;
+		/* Bit mask of the NSAPIs any of these entities is
+		 * assigned to, all others skip the compression code */
+		uint16_t nsapis;
 	} comp;
 
 	/* Internal management */
 	uint32_t age_timestamp;
+	/* entry in the active or idle list, see gprs_llme_age_update() */
+	struct llist_head age_list;
+
+	/* MM context this LLME belongs to, maintained by
+	 * sgsn_mm_ctx_set_llme() */
+	struct sgsn_mm_ctx *mm;
+
+	/* Downlink scheduler state, NULL until the first UI frame */
+	struct gprs_dl_ms *dl;
 };
 
 #define GPRS_LLME_RESET_AGE (0)
 
 extern struct llist_head gprs_llc_llmes;
+/* LLMEs without activity since age_timestamp, oldest first */
+extern struct llist_head gprs_llc_llmes_idle;
 
 /* LLC low level types */
 
@@ -229,10 +263,21 @@ struct gprs_llc_hdr_parsed {
 /* BSSGP-UL-UNITDATA.ind */
 int gprs_llc_rcvmsg(struct msgb *msg, struct tlv_parsed *tv);
 
+/* Room left in front of a downlink frame for the SNDCP, LLC, BSSGP and NS
+ * headers, and behind it for the LLC FCS, so that no layer has to copy */
+#define GPRS_LLC_DL_HEADROOM	128
+#define GPRS_LLC_DL_TAILROOM	3
+
 /* LL-UNITDATA.req */
 int gprs_llc_tx_ui(struct msgb *msg, uint8_t sapi, int command,
 		   struct sgsn_mm_ctx *mmctx, bool encryptable);
 
+/* The fragments of one N-PDU fit into a burst, see gprs_llc_tx_ui_burst() */
+#define GPRS_LLC_UI_BURST_MAX	16
+int gprs_llc_tx_ui_burst(struct msgb **msgs, unsigned int num, uint8_t sapi,
+			 int command, struct sgsn_mm_ctx *mmctx,
+			 bool encryptable, bool prio);
+
 /* Chapter 7.2.1.2 LLGMM-RESET.req */
 int gprs_llgmm_reset(struct gprs_llc_llme *llme);
 int gprs_llgmm_reset_oldmsg(struct msgb* oldmsg, uint8_t sapi,
@@ -278,6 +323,8 @@ int gprs_llc_fcs(uint8_t *data, unsigned int len);
 
 /* LLME handling routines */
 struct llist_head *gprs_llme_list(void);
+struct gprs_llc_lle *gprs_llme_lle(struct gprs_llc_llme *llme, uint8_t sapi);
+void gprs_llme_age_update(uint32_t now);
 struct gprs_llc_lle *gprs_lle_get_or_create(const uint32_t tlli, uint8_t sapi);
 
 
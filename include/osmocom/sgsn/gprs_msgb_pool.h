@@ -0,0 +1,60 @@
+/* Size-class pools of msgbs for the user data path */
+
+/* (C) 2026 by sysmocom s.f.m.c. GmbH <info@sysmocom.de>
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include <osmocom/core/linuxlist.h>
+
+struct msgb;
+
+/* msgbs of one buffer size. A msgb taken from a pool goes back to it when
+ * it is freed with msgb_free() anywhere, even in a library, as long as
+ * the pool caches less than max_cached msgbs. Pooled msgbs must only be
+ * freed with msgb_free() or along with the context msgb_alloc() uses,
+ * never reparented. Only to be used from the main thread. */
+struct gprs_msgb_pool {
+	const char *name;
+	uint16_t size;
+	unsigned int max_cached;
+
+	/* released msgbs, linked through msg->list */
+	struct llist_head free_list;
+
+	struct {
+		/* msgbs handed out, and how many came from free_list */
+		unsigned long long allocs;
+		unsigned long long hits;
+		unsigned int in_use;
+		unsigned int in_use_peak;
+		unsigned int cached;
+	} stats;
+};
+
+/* Requests larger than the largest size class, served by msgb_alloc() */
+extern unsigned long long gprs_msgb_pool_oversize;
+
+struct msgb *gprs_msgb_alloc(unsigned int size, const char *name);
+struct msgb *gprs_msgb_alloc_headroom(unsigned int size, unsigned int headroom,
+				      const char *name);
+
+unsigned int gprs_msgb_pools_num(void);
+const struct gprs_msgb_pool *gprs_msgb_pool_get(unsigned int idx);
+void gprs_msgb_pools_flush(void);
@@ -0,0 +1,65 @@
+/* Typed object pools for frequently allocated SGSN objects */
+
+/* (C) 2026 by sysmocom s.f.m.c. GmbH <info@sysmocom.de>
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include <osmocom/core/linuxlist.h>
+
+/* A pool keeps up to max_cached released objects of one type on a free
+ * list and hands them out again instead of going through malloc. Pools
+ * are meant to be statically allocated with GPRS_OBJ_POOL_INIT(), they
+ * register themselves on first use. */
+struct gprs_obj_pool {
+	/* entry in the list of all pools, see gprs_obj_pools() */
+	struct llist_head list;
+	bool registered;
+
+	const char *name;
+	size_t obj_size;
+	unsigned int max_cached;
+
+	/* released objects, linked through their first bytes */
+	struct llist_head free_list;
+
+	struct {
+		/* objects handed out, and how many came from free_list */
+		unsigned long long allocs;
+		unsigned long long hits;
+		unsigned int in_use;
+		unsigned int in_use_peak;
+		unsigned int cached;
+	} stats;
+};
+
+#define GPRS_OBJ_POOL_INIT(pool, type, max) { \
+		.name = #type, \
+		.obj_size = sizeof(type), \
+		.max_cached = max, \
+		.free_list = LLIST_HEAD_INIT((pool).free_list), \
+	}
+
+void *gprs_obj_pool_alloc(struct gprs_obj_pool *pool, const void *ctx);
+void gprs_obj_pool_free(struct gprs_obj_pool *pool, void *obj);
+void gprs_obj_pool_flush(struct gprs_obj_pool *pool);
+
+struct llist_head *gprs_obj_pools(void);
+void gprs_obj_pools_flush(void);
@@ -0,0 +1,52 @@
+/* Worker threads for per-frame computations off the main loop */
+
+/* (C) 2026 by sysmocom s.f.m.c. GmbH <info@sysmocom.de>
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#pragma once
+
+#include <stdint.h>
+
+#define GPRS_OFFLOAD_MAX_WORKERS	16
+/* Jobs that may be in flight on one worker */
+#define GPRS_OFFLOAD_QUEUE_LEN		256
+
+struct gprs_offload_job;
+typedef void (*gprs_offload_cb)(struct gprs_offload_job *job);
+
+/* To be embedded into the state of a job */
+struct gprs_offload_job {
+	/* Runs on a worker thread. It may only touch memory owned by the
+	 * job, and must neither allocate from talloc nor log. NULL for a
+	 * job that only keeps its place in the order. */
+	gprs_offload_cb work;
+	/* Runs on the main thread once work() has finished */
+	gprs_offload_cb done;
+};
+
+struct gprs_offload_stats {
+	unsigned long long posted;
+	unsigned long long completed;
+	unsigned long long queue_full;
+};
+
+extern struct gprs_offload_stats gprs_offload_stats;
+
+int gprs_offload_start(void *ctx, unsigned int num_workers);
+void gprs_offload_stop(void);
+unsigned int gprs_offload_workers(void);
+int gprs_offload_post(struct gprs_offload_job *job, uint32_t key);
@@ -2,6 +2,7 @@
 #define _GPRS_SGSN_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <netinet/in.h>
 
 #include <osmocom/core/fsm.h>
@@ -13,9 +14,15 @@
 #include <osmocom/gsm/protocol/gsm_23_003.h>
 #include <osmocom/crypt/auth.h>
 
+#include <osmocom/sgsn/gprs_id_hash.h>
+
 #define GSM_EXTENSION_LENGTH 15
 #define GSM_APN_LENGTH 102
 
+/* NSAPI and TI (including the TI flag) are 4 bit wide */
+#define NUM_NSAPIS 16
+#define NUM_TIS 16
+
 struct gprs_llc_lle;
 struct ctrl_handle;
 struct gprs_subscr;
@@ -60,6 +67,12 @@ enum gprs_pdp_ctx {
 	PDP_CTR_PKTS_UDATA_OUT,
 	PDP_CTR_BYTES_UDATA_IN,
 	PDP_CTR_BYTES_UDATA_OUT,
+	PDP_CTR_DL_QUEUED,
+	PDP_CTR_DL_FLUSHED,
+	PDP_CTR_DL_EXPIRED,
+	PDP_CTR_DL_DROPPED,
+	PDP_CTR_UL_POLICED,
+	PDP_CTR_DL_POLICED,
 };
 
 enum gprs_t3350_mode {
@@ -139,6 +152,9 @@ struct sgsn_mm_ctx {
 	uint32_t 		p_tmsi;
 	uint32_t 		p_tmsi_old;	/* old P-TMSI before new is confirmed */
 	uint32_t 		p_tmsi_sig;
+	/* entries in the P-TMSI index, see sgsn_mm_ctx_set_ptmsi() */
+	struct gprs_id_hnode	p_tmsi_hnode;
+	struct gprs_id_hnode	p_tmsi_old_hnode;
 	char 			imei[GSM23003_IMEISV_NUM_DIGITS+1];
 	/* Opt: Software Version Numbber / TS 23.195 */
 	char 			msisdn[GSM_EXTENSION_LENGTH];
@@ -154,6 +170,9 @@ struct sgsn_mm_ctx {
 		struct gprs_llc_llme	*llme;
 		uint32_t		tlli;
 		uint32_t		tlli_new;
+		/* entries in the TLLI index, see sgsn_mm_ctx_set_tlli() */
+		struct gprs_id_hnode	tlli_hnode;
+		struct gprs_id_hnode	tlli_new_hnode;
 	} gb;
 	struct {
 		int			new_key;
@@ -219,6 +238,10 @@ struct sgsn_mm_ctx {
 	/* APN Subscribed */
 
 	struct llist_head	pdp_list;
+	/* look-up tables for the entries of pdp_list, which must only be
+	 * changed by sgsn_mm_ctx_add_pdp()/sgsn_mm_ctx_remove_pdp() */
+	struct sgsn_pdp_ctx	*pdp_by_nsapi[NUM_NSAPIS];
+	struct sgsn_pdp_ctx	*pdp_by_ti[NUM_TIS];
 
 	struct rate_ctr_group	*ctrg;
 	struct osmo_timer_list	timer;
@@ -278,6 +301,16 @@ struct sgsn_mm_ctx *sgsn_mm_ctx_alloc_iu(void *uectx);
 
 void sgsn_mm_ctx_cleanup_free(struct sgsn_mm_ctx *ctx);
 
+/* Update the (new) TLLI of a Gb MM context, never assign gb.tlli or
+ * gb.tlli_new directly or sgsn_mm_ctx_by_tlli() won't find it */
+void sgsn_mm_ctx_set_tlli(struct sgsn_mm_ctx *ctx, uint32_t tlli);
+void sgsn_mm_ctx_set_tlli_new(struct sgsn_mm_ctx *ctx, uint32_t tlli_new);
+void sgsn_mm_ctx_set_llme(struct sgsn_mm_ctx *ctx, struct gprs_llc_llme *llme);
+
+/* Same for p_tmsi and p_tmsi_old and sgsn_mm_ctx_by_ptmsi() */
+void sgsn_mm_ctx_set_ptmsi(struct sgsn_mm_ctx *ctx, uint32_t p_tmsi);
+void sgsn_mm_ctx_set_ptmsi_old(struct sgsn_mm_ctx *ctx, uint32_t p_tmsi_old);
+
 struct sgsn_ggsn_ctx *sgsn_mm_ctx_find_ggsn_ctx(struct sgsn_mm_ctx *mmctx,
 						struct tlv_parsed *tp,
 						enum gsm48_gsm_cause *gsm_cause,
@@ -300,6 +333,14 @@ enum pdp_type {
 	PDP_TYPE_IANA_IPv6,
 };
 
+/* Token bucket of one direction of a PDP context, filled at the maximum
+ * bitrate of the negotiated QoS profile */
+struct sgsn_pdp_policer {
+	uint32_t		rate;	/* octets/s, 0 if not limited */
+	uint32_t		tokens;	/* octets */
+	uint64_t		last_us;
+};
+
 struct sgsn_pdp_ctx {
 	struct llist_head	list;	/* list_head for mmctx->pdp_list */
 	struct llist_head	g_list;	/* list_head for global list */
@@ -335,6 +376,24 @@ struct sgsn_pdp_ctx {
 	uint64_t		cdr_bytes_in;
 	uint64_t		cdr_bytes_out;
 	uint32_t		cdr_charging_id;
+
+	/* N-PDUs from the GGSN held back while the MS is suspended */
+	struct llist_head	dl_queue;
+	unsigned int		dl_queue_len;
+	unsigned int		dl_queue_bytes;
+
+	struct sgsn_pdp_policer	policer_ul;
+	struct sgsn_pdp_policer	policer_dl;
+
+	/* User data counts not yet added to the rate counters of this PDP
+	 * context and its MM context, see sgsn_pdp_ctx_ctrs_flush() */
+	struct llist_head	ud_pending_list;
+	struct {
+		unsigned int	pkts_in;
+		unsigned int	bytes_in;
+		unsigned int	pkts_out;
+		unsigned int	bytes_out;
+	} ud_pending;
 };
 
 #define LOGPDPCTXP(level, pdp, fmt, args...) \
@@ -351,9 +410,49 @@ struct sgsn_pdp_ctx *sgsn_pdp_ctx_by_tid(const struct sgsn_mm_ctx *mm,
 struct sgsn_pdp_ctx *sgsn_pdp_ctx_alloc(struct sgsn_mm_ctx *mm,
 					struct sgsn_ggsn_ctx *ggsn,
 					uint8_t nsapi);
+void sgsn_pdp_ctx_set_ti(struct sgsn_pdp_ctx *pdp, uint8_t ti);
+void sgsn_mm_ctx_add_pdp(struct sgsn_mm_ctx *mm, struct sgsn_pdp_ctx *pdp);
+void sgsn_mm_ctx_remove_pdp(struct sgsn_mm_ctx *mm, struct sgsn_pdp_ctx *pdp);
 void sgsn_pdp_ctx_terminate(struct sgsn_pdp_ctx *pdp);
 void sgsn_pdp_ctx_free(struct sgsn_pdp_ctx *pdp);
 
+void sgsn_pdp_policer_set(struct sgsn_pdp_ctx *pdp, const uint8_t *qos,
+			  unsigned int qos_len);
+bool sgsn_pdp_policer_conform(struct sgsn_pdp_policer *pol, unsigned int len);
+
+int sgsn_pdp_dl_queue_add(struct sgsn_pdp_ctx *pdp, const uint8_t *data,
+			  unsigned int len);
+int sgsn_pdp_dl_queue_flush(struct sgsn_pdp_ctx *pdp);
+void sgsn_pdp_dl_queue_purge(struct sgsn_pdp_ctx *pdp);
+void sgsn_mm_ctx_dl_queue_flush(struct sgsn_mm_ctx *mm);
+
+/* Longest time user data counts are held back from the rate counters */
+#define SGSN_PDP_CTRS_FLUSH_MS 100
+
+void sgsn_pdp_ctx_ctrs_pending(struct sgsn_pdp_ctx *pdp);
+void sgsn_pdp_ctx_ctrs_flush(struct sgsn_pdp_ctx *pdp);
+void sgsn_pdp_ctxs_ctrs_flush(void);
+
+/* Count user data on the packet path without touching the rate counters,
+ * the counts are added to them at most SGSN_PDP_CTRS_FLUSH_MS later */
+static inline void sgsn_pdp_ctx_count_ud_in(struct sgsn_pdp_ctx *pdp,
+					    unsigned int len)
+{
+	if (llist_empty(&pdp->ud_pending_list))
+		sgsn_pdp_ctx_ctrs_pending(pdp);
+	pdp->ud_pending.pkts_in++;
+	pdp->ud_pending.bytes_in += len;
+}
+
+static inline void sgsn_pdp_ctx_count_ud_out(struct sgsn_pdp_ctx *pdp,
+					     unsigned int len)
+{
+	if (llist_empty(&pdp->ud_pending_list))
+		sgsn_pdp_ctx_ctrs_pending(pdp);
+	pdp->ud_pending.pkts_out++;
+	pdp->ud_pending.bytes_out += len;
+}
+
 
 struct sgsn_ggsn_ctx {
 	struct llist_head list;
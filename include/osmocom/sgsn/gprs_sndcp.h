@@ -40,9 +40,8 @@ enum sndcp_rx_state {
 	SNDCP_RX_S_DISCARD,
 };
 
+/* Kept in the sne[] table of the LLME, see gprs_llc.h */
 struct gprs_sndcp_entity {
-	struct llist_head list;
-
 	/* FIXME: move this RA_ID up to the LLME or even higher */
 	struct gprs_ra_id ra_id;
 	/* reference to the LLC Entity below this SNDCP entity */
@@ -58,7 +57,19 @@ struct gprs_sndcp_entity {
 	struct defrag_state defrag;
 };
 
-extern struct llist_head gprs_sndcp_entities;
+/* Buffer handling on the downlink path, copies done by the compressors
+ * are not included */
+struct sndcp_dl_stats {
+	unsigned long long npdus;
+	unsigned long long msgb_allocs;
+	unsigned long long bytes_copied;
+};
+extern struct sndcp_dl_stats sndcp_dl_stats;
+
+bool sndcp_dl_prio(const uint8_t *data, unsigned int len);
+
+/* Release an entity after removing it from the LLME's sne[] table */
+void gprs_sndcp_entity_free(struct gprs_sndcp_entity *sne);
 
 /* Set of SNDCP-XID negotiation (See also: TS 144 065,
  * Section 6.8 XID parameter negotiation) */
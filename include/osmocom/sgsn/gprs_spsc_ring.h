@@ -0,0 +1,92 @@
+/* Lock-free ring to pass pointers from one thread to another */
+
+/* (C) 2026 by sysmocom s.f.m.c. GmbH <info@sysmocom.de>
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <osmocom/core/utils.h>
+
+/* Exactly one thread may push and exactly one thread may pop. The producer
+ * only writes 'head' and the consumer only writes 'tail', each of them on
+ * its own cache line, so neither side ever waits for the other. The
+ * counters run freely and are masked on access. Padding rather than
+ * alignment keeps them apart, so the ring can be embedded in talloc'ed
+ * objects. */
+#define GPRS_SPSC_RING_PAD	64
+
+struct gprs_spsc_ring {
+	unsigned int head;
+	char pad_head[GPRS_SPSC_RING_PAD - sizeof(unsigned int)];
+	unsigned int tail;
+	char pad_tail[GPRS_SPSC_RING_PAD - sizeof(unsigned int)];
+	unsigned int mask;
+	void **slots;
+};
+
+/* 'slots' has to hold 'size' pointers, size being a power of two */
+static inline void gprs_spsc_ring_init(struct gprs_spsc_ring *ring,
+				       void **slots, unsigned int size)
+{
+	OSMO_ASSERT(size && !(size & (size - 1)));
+	ring->head = 0;
+	ring->tail = 0;
+	ring->mask = size - 1;
+	ring->slots = slots;
+}
+
+/* Producer side, returns false if the ring is full */
+static inline bool gprs_spsc_ring_push(struct gprs_spsc_ring *ring, void *obj)
+{
+	unsigned int head = ring->head;
+	unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	if (head - tail > ring->mask)
+		return false;
+
+	ring->slots[head & ring->mask] = obj;
+	/* publish the slot before the new head */
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/* Consumer side, returns NULL if the ring is empty */
+static inline void *gprs_spsc_ring_pop(struct gprs_spsc_ring *ring)
+{
+	unsigned int tail = ring->tail;
+	unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	void *obj;
+
+	if (head == tail)
+		return NULL;
+
+	obj = ring->slots[tail & ring->mask];
+	/* the slot may be reused once the new tail is visible */
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+	return obj;
+}
+
+/* Safe to call from either side, the result may be stale by the time it
+ * is used */
+static inline unsigned int gprs_spsc_ring_count(const struct gprs_spsc_ring *ring)
+{
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) -
+	       __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
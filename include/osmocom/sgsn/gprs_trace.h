@@ -0,0 +1,112 @@
+/* Binary ring of per-packet trace records */
+
+/* (C) 2026 by sysmocom s.f.m.c. GmbH <info@sysmocom.de>
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <osmocom/core/utils.h>
+
+/* Where in the SGSN a packet was seen */
+enum gprs_trace_point {
+	GPRS_TRACE_LLC_UL,
+	GPRS_TRACE_LLC_DL,
+	GPRS_TRACE_SNDCP_UL,
+	GPRS_TRACE_SNDCP_DL,
+};
+
+/* What became of it */
+enum gprs_trace_verdict {
+	GPRS_TRACE_V_OK,
+	GPRS_TRACE_V_INVALID,
+	GPRS_TRACE_V_NO_CTX,
+	GPRS_TRACE_V_CIPHER,
+	GPRS_TRACE_V_FCS,
+	GPRS_TRACE_V_DUP,
+	GPRS_TRACE_V_POLICED,
+	GPRS_TRACE_V_QUEUED,
+	GPRS_TRACE_V_DROPPED,
+};
+
+extern const struct value_string gprs_trace_point_names[];
+extern const struct value_string gprs_trace_verdict_names[];
+
+#define GPRS_TRACE_NO_NU	0xffff
+#define GPRS_TRACE_NO_ID	0xff
+
+/* One packet, in host byte order. Records are numbered from 1 on, a
+ * record with seq 0 is being written. */
+struct gprs_trace_rec {
+	uint32_t seq;
+	uint32_t tlli;
+	/* CLOCK_REALTIME in microseconds */
+	uint64_t time_us;
+	uint16_t len;
+	uint16_t nu;
+	uint8_t point;
+	uint8_t verdict;
+	uint8_t sapi;
+	uint8_t nsapi;
+};
+
+/* A snapshot file is this header followed by 'num' records */
+#define GPRS_TRACE_FILE_MAGIC	0x4f535452	/* "OSTR" */
+#define GPRS_TRACE_FILE_VERSION	1
+
+struct gprs_trace_file_hdr {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t rec_size;
+	uint32_t num;
+	uint32_t reserved;
+};
+
+/* The ring, recs is NULL if tracing is off. Any thread may add records
+ * without taking a lock: a writer claims a slot by incrementing 'head',
+ * and the seq of a record tells a reader whether it was overwritten
+ * meanwhile. Only gprs_trace_init() must not run concurrently with
+ * writers. */
+struct gprs_trace_ring {
+	struct gprs_trace_rec *recs;
+	unsigned int mask;
+	uint32_t head;
+};
+
+extern struct gprs_trace_ring gprs_trace_ring;
+
+int gprs_trace_init(void *ctx, unsigned int num_recs);
+void _gprs_trace_pkt(uint8_t point, uint8_t verdict, uint32_t tlli,
+		     uint8_t sapi, uint8_t nsapi, uint16_t nu, unsigned int len);
+
+/* Cheap enough to be called for every packet, a test and a branch if
+ * tracing is off */
+static inline void gprs_trace_pkt(enum gprs_trace_point point,
+				  enum gprs_trace_verdict verdict,
+				  uint32_t tlli, uint8_t sapi, uint8_t nsapi,
+				  uint16_t nu, unsigned int len)
+{
+	if (gprs_trace_ring.recs)
+		_gprs_trace_pkt(point, verdict, tlli, sapi, nsapi, nu, len);
+}
+
+unsigned int gprs_trace_snapshot(struct gprs_trace_rec *out, unsigned int max);
+int gprs_trace_write(const char *path);
+int gprs_trace_rec_str(char *buf, size_t buf_len,
+		       const struct gprs_trace_rec *rec);
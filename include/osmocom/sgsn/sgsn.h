@@ -119,6 +119,37 @@ struct sgsn_config {
 		int p2;
 	} dcomp_v42bis;
 
+	/* Downlink N-PDUs buffered per PDP context while the MS is suspended */
+	struct {
+		unsigned int max_pkts;
+		unsigned int max_bytes;
+		unsigned int max_age;
+	} dl_queue;
+
+	/* Policing of user data by the maximum bitrates of the negotiated
+	 * QoS profile, the bucket holds 'burst' ms worth of data */
+	struct {
+		bool enable;
+		unsigned int burst;
+	} qos_policing;
+
+	/* Threads that generate GEA keystreams, 0 does it in the main loop */
+	unsigned int offload_workers;
+
+	/* Records in the packet trace ring, 0 switches tracing off */
+	unsigned int trace_records;
+
+	/* Downlink UI frames waiting for BSSGP flow control, per MS */
+	struct {
+		unsigned int quantum;
+		unsigned int max_bytes;
+		/* N-PDUs up to this length go to the priority queue */
+		unsigned int prio_max_len;
+		/* CoDel on the bulk queue in ms, a target of 0 disables it */
+		unsigned int codel_target;
+		unsigned int codel_interval;
+	} dl_sched;
+
 #if BUILD_IU
 	struct {
 		enum ranap_nsap_addr_enc rab_assign_addr_enc;
@@ -190,6 +221,10 @@ int sgsn_rx_sndcp_ud_ind(struct gprs_ra_id *ra_id, int32_t tlli, uint8_t nsapi,
 			 struct msgb *msg, uint32_t npdu_len, uint8_t *npdu);
 int sndcp_unitdata_req(struct msgb *msg, struct gprs_llc_lle *lle, uint8_t nsapi,
 			void *mmcontext);
+int sndcp_unitdata_req_data(const uint8_t *data, unsigned int len,
+			    struct gprs_llc_lle *lle, uint8_t nsapi,
+			    void *mmcontext, uint32_t tlli, uint16_t nsei,
+			    uint16_t bvci);
 int sndcp_llunitdata_ind(struct msgb *msg, struct gprs_llc_lle *lle,
 			 uint8_t *hdr, uint16_t len);
 
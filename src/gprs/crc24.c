@@ -19,8 +19,16 @@
  *
  */
 
+#include <stdbool.h>
+
 #include <osmocom/sgsn/crc24.h>
 
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define CRC24_PCLMUL 1
+#include <wmmintrin.h>
+#include <smmintrin.h>
+#endif
+
 /* CRC24 table - FCS */
 static const uint32_t tbl_crc24[256] = {
 	0x00000000, 0x00d6a776, 0x00f64557, 0x0020e221, 0x00b78115, 0x00612663, 0x0041c442, 0x00976334,
@@ -59,9 +67,200 @@ static const uint32_t tbl_crc24[256] = {
 
 #define INIT_CRC24	0xffffff
 
-uint32_t crc24_calc(uint32_t fcs, uint8_t *cp, unsigned int len)
+/* tbl_crc24_slice[n][i] is the CRC of byte i followed by n zero bytes, so
+ * eight bytes can be folded into the CRC with eight independent lookups */
+static uint32_t tbl_crc24_slice[8][256];
+
+static uint32_t (*crc24_impl)(uint32_t fcs, const uint8_t *cp, unsigned int len);
+
+uint32_t crc24_calc_bytewise(uint32_t fcs, const uint8_t *cp, unsigned int len)
 {
 	while (len--)
 		fcs = (fcs >> 8) ^ tbl_crc24[(fcs ^ *cp++) & 0xff];
 	return fcs;
 }
+
+static inline uint32_t load_le32(const uint8_t *cp)
+{
+	return cp[0] | (cp[1] << 8) | (cp[2] << 16) | ((uint32_t)cp[3] << 24);
+}
+
+/* The CRC-24 is kept in the low 24 bits like a reflected CRC-32 with the
+ * generator polynomial multiplied by x^8, so the usual slicing-by-8 scheme
+ * applies unchanged */
+uint32_t crc24_calc_slice8(uint32_t fcs, const uint8_t *cp, unsigned int len)
+{
+	uint32_t lo, hi;
+
+	while (len >= 8) {
+		lo = fcs ^ load_le32(cp);
+		hi = load_le32(cp + 4);
+		fcs = tbl_crc24_slice[7][lo & 0xff] ^
+		      tbl_crc24_slice[6][(lo >> 8) & 0xff] ^
+		      tbl_crc24_slice[5][(lo >> 16) & 0xff] ^
+		      tbl_crc24_slice[4][lo >> 24] ^
+		      tbl_crc24_slice[3][hi & 0xff] ^
+		      tbl_crc24_slice[2][(hi >> 8) & 0xff] ^
+		      tbl_crc24_slice[1][(hi >> 16) & 0xff] ^
+		      tbl_crc24_slice[0][hi >> 24];
+		cp += 8;
+		len -= 8;
+	}
+
+	return crc24_calc_bytewise(fcs, cp, len);
+}
+
+#ifdef CRC24_PCLMUL
+/* Folding with carry-less multiplication, see "Fast CRC Computation for
+ * Generic Polynomials Using PCLMULQDQ Instruction" (Intel, 2009). The
+ * constants are the bit reflected x^n mod P(x) for the 32 bit polynomial
+ * P(x) = G(x) * x^8, where G(x) is the LLC CRC-24 generator polynomial. */
+static const uint64_t crc24_k1k2[2] __attribute__((aligned(16))) =
+	{ 0x01a04c88, 0x00693f3c };	/* x^(4*128+32), x^(4*128-32) */
+static const uint64_t crc24_k3k4[2] __attribute__((aligned(16))) =
+	{ 0x016380ce, 0x009c73a8 };	/* x^(128+32), x^(128-32) */
+static const uint64_t crc24_k5k0[2] __attribute__((aligned(16))) =
+	{ 0x002a2fce, 0x00000000 };	/* x^64 */
+static const uint64_t crc24_poly[2] __attribute__((aligned(16))) =
+	{ 0x015b0bbb, 0x211002e7 };	/* P(x), x^64 / P(x) */
+
+/* Requires len >= 64, only whole 16 byte blocks are consumed */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc24_fold_pclmul(uint32_t fcs, const uint8_t *cp,
+				  unsigned int len)
+{
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+	x1 = _mm_loadu_si128((const __m128i *)(cp + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(cp + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(cp + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(cp + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(fcs));
+	cp += 64;
+	len -= 64;
+
+	/* fold four blocks of 16 bytes in parallel */
+	x0 = _mm_load_si128((const __m128i *)crc24_k1k2);
+	while (len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+			_mm_loadu_si128((const __m128i *)(cp + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+			_mm_loadu_si128((const __m128i *)(cp + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+			_mm_loadu_si128((const __m128i *)(cp + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+			_mm_loadu_si128((const __m128i *)(cp + 0x30)));
+		cp += 64;
+		len -= 64;
+	}
+
+	/* fold the four blocks into one */
+	x0 = _mm_load_si128((const __m128i *)crc24_k3k4);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	/* fold the remaining blocks of 16 bytes */
+	while (len >= 16) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+			_mm_loadu_si128((const __m128i *)cp));
+		cp += 16;
+		len -= 16;
+	}
+
+	/* fold 128 to 64 bits */
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+	x0 = _mm_loadl_epi64((const __m128i *)crc24_k5k0);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bits, the top 8 of which are zero */
+	x0 = _mm_load_si128((const __m128i *)crc24_poly);
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc24_calc_pclmul_impl(uint32_t fcs, const uint8_t *cp,
+				       unsigned int len)
+{
+	unsigned int folded;
+
+	if (len < 64)
+		return crc24_calc_slice8(fcs, cp, len);
+
+	folded = len & ~15U;
+	fcs = crc24_fold_pclmul(fcs, cp, folded);
+	return crc24_calc_slice8(fcs, cp + folded, len - folded);
+}
+#endif
+
+bool crc24_have_pclmul(void)
+{
+#ifdef CRC24_PCLMUL
+	/* may run from the constructor, before libgcc initialized it */
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("pclmul") &&
+	       __builtin_cpu_supports("sse4.1");
+#else
+	return false;
+#endif
+}
+
+/* Falls back to the slicing-by-8 variant without CPU support */
+uint32_t crc24_calc_pclmul(uint32_t fcs, const uint8_t *cp, unsigned int len)
+{
+#ifdef CRC24_PCLMUL
+	if (crc24_have_pclmul())
+		return crc24_calc_pclmul_impl(fcs, cp, len);
+#endif
+	return crc24_calc_slice8(fcs, cp, len);
+}
+
+static __attribute__((constructor)) void crc24_init(void)
+{
+	unsigned int i, n;
+
+	for (i = 0; i < 256; i++) {
+		tbl_crc24_slice[0][i] = tbl_crc24[i];
+		for (n = 1; n < 8; n++) {
+			uint32_t prev = tbl_crc24_slice[n - 1][i];
+			tbl_crc24_slice[n][i] = (prev >> 8) ^ tbl_crc24[prev & 0xff];
+		}
+	}
+
+	crc24_impl = crc24_calc_slice8;
+#ifdef CRC24_PCLMUL
+	if (crc24_have_pclmul())
+		crc24_impl = crc24_calc_pclmul_impl;
+#endif
+}
+
+uint32_t crc24_calc(uint32_t fcs, uint8_t *cp, unsigned int len)
+{
+	return crc24_impl(fcs, cp, len);
+}
@@ -0,0 +1,629 @@
+/* Downlink scheduler between LLC and BSSGP */
+
+/* (C) 2026 by sysmocom s.f.m.c. GmbH <info@sysmocom.de>
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Downlink UI frames of each MS are paced by the BVC bucket and the MS
+ * bucket that the BSS announces in FLOW-CONTROL-BVC.
+ *
+ * The BVC bucket is the one of the BSSGP flow control in libosmogb. A
+ * frame is only handed down while nothing of the BVC waits in its queue,
+ * so at most one frame per BVC is held back there. Everything else is
+ * still queued here, where it can be ordered and dropped.
+ *
+ * The per-MS flow control of libosmogb (bssgp_fc_ms_init()) is not used
+ * for the MS bucket. Frames in its queue could not be dropped any more
+ * when the MS leaves the cell, and it would keep the default MS bucket
+ * of the time it was set up instead of following FLOW-CONTROL-BVC.
+ *
+ * As long as the MS bucket has room and nothing is queued on the BVC, a
+ * frame is passed down right away. Otherwise it is queued per MS, and the
+ * MSs of a BVC are served by deficit round robin from a timer that fires
+ * when the buckets have leaked enough.
+ *
+ * Each MS has two queues: priority frames (signalling, TCP ACKs, DNS and
+ * other small packets, as SNDCP classifies them) are sent before the bulk
+ * frames of the BVC, so they do not wait behind a download. They never
+ * overtake a bulk frame of their own LLE though: the frames of an LLE are
+ * numbered and ciphered in the order they come in, and the receive window
+ * of the MS as well as the OC of the cipher depend on N(U) being in order.
+ * Such a priority frame goes to the bulk queue instead. The bulk queue is
+ * kept short by CoDel (RFC 8289), which drops from its head once frames
+ * have been waiting longer than the target for a whole interval. */
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include <osmocom/core/msgb.h>
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/timer.h>
+#include <osmocom/core/utils.h>
+#include <osmocom/gprs/gprs_bssgp.h>
+
+#include <osmocom/sgsn/debug.h>
+#include <osmocom/sgsn/sgsn.h>
+#include <osmocom/sgsn/gprs_llc.h>
+#include <osmocom/sgsn/gprs_dl_sched.h>
+
+extern void *tall_sgsn_ctx;
+
+LLIST_HEAD(gprs_dl_bvcs);
+
+/* A frame waiting in one of the queues of an MS, allocated as talloc
+ * child of the msgb holding the frame */
+struct dl_frame {
+	struct llist_head list;
+	struct msgb *msg;
+	uint64_t enqueued_us;
+	uint8_t sapi;
+};
+
+static uint64_t dl_now_us(void)
+{
+	struct timespec now;
+
+	osmo_clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void dl_bucket_set(struct gprs_dl_bucket *b, uint32_t size_max,
+			  uint32_t leak_rate)
+{
+	b->size_max = size_max;
+	b->leak_rate = leak_rate;
+	if (b->fill > size_max)
+		b->fill = size_max;
+}
+
+static void dl_bucket_leak(struct gprs_dl_bucket *b, uint64_t now)
+{
+	uint64_t leaked;
+
+	if (!b->leak_rate || !b->fill) {
+		b->last_us = now;
+		return;
+	}
+
+	leaked = (now - b->last_us) * b->leak_rate / 1000000;
+	if (leaked >= b->fill) {
+		b->fill = 0;
+		b->last_us = now;
+	} else if (leaked) {
+		b->fill -= leaked;
+		/* keep the fraction of an octet that has not leaked yet */
+		b->last_us += leaked * 1000000 / b->leak_rate;
+	}
+}
+
+/* Microseconds until a frame of len octets fits into the bucket, 0 if it
+ * fits now. A frame larger than the bucket fits into an empty one. */
+static uint64_t dl_bucket_wait(const struct gprs_dl_bucket *b,
+			       unsigned int len)
+{
+	uint64_t excess;
+
+	if (!b->leak_rate || !b->fill)
+		return 0;
+	if (b->fill + len <= b->size_max)
+		return 0;
+
+	if (len > b->size_max)
+		excess = b->fill;
+	else
+		excess = b->fill + len - b->size_max;
+	return (excess * 1000000 + b->leak_rate - 1) / b->leak_rate;
+}
+
+static void dl_bucket_add(struct gprs_dl_bucket *b, unsigned int len)
+{
+	if (b->leak_rate)
+		b->fill += len;
+}
+
+/* Whether BSSGP holds back a frame of the BVC until its bucket has leaked
+ * enough. Nothing more is handed down until it has sent that frame. */
+static bool dl_bvc_blocked(const struct bssgp_bvc_ctx *bctx)
+{
+	return bctx && bctx->fc && bctx->fc->queue_depth > 0;
+}
+
+/* Run the BVC again once the flow control timer of BSSGP has sent the
+ * frame it holds back */
+static void dl_bvc_wait_fc(struct gprs_dl_bvc *bvc,
+			   const struct bssgp_bvc_ctx *bctx)
+{
+	struct timeval remaining;
+
+	/* with a leak rate of 0, BSSGP does not even start its timer */
+	if (!osmo_timer_pending(&bctx->fc->timer)) {
+		osmo_timer_schedule(&bvc->timer, 1, 0);
+		return;
+	}
+	if (osmo_timer_remaining(&bctx->fc->timer, NULL, &remaining) < 0)
+		remaining = (struct timeval){ 0, 0 };
+	osmo_timer_schedule(&bvc->timer, remaining.tv_sec, remaining.tv_usec);
+}
+
+/* The MS bucket is the default one that the BSS announced last in
+ * FLOW-CONTROL-BVC */
+static void dl_ms_params(struct gprs_dl_ms *ms, const struct bssgp_bvc_ctx *bctx)
+{
+	if (bctx)
+		dl_bucket_set(&ms->bucket, bctx->bmax_default_ms,
+			      bctx->r_default_ms);
+}
+
+static void dl_bvc_timer_cb(void *data);
+
+static struct gprs_dl_bvc *dl_bvc_get(uint16_t nsei, uint16_t bvci)
+{
+	struct gprs_dl_bvc *bvc;
+
+	llist_for_each_entry(bvc, &gprs_dl_bvcs, list) {
+		if (bvc->nsei == nsei && bvc->bvci == bvci)
+			return bvc;
+	}
+
+	if (!btsctx_by_bvci_nsei(bvci, nsei))
+		return NULL;
+
+	bvc = talloc_zero(tall_sgsn_ctx, struct gprs_dl_bvc);
+	if (!bvc)
+		return NULL;
+	bvc->nsei = nsei;
+	bvc->bvci = bvci;
+	INIT_LLIST_HEAD(&bvc->prio_active);
+	INIT_LLIST_HEAD(&bvc->active);
+	osmo_timer_setup(&bvc->timer, dl_bvc_timer_cb, bvc);
+	llist_add_tail(&bvc->list, &gprs_dl_bvcs);
+	return bvc;
+}
+
+static void dl_bvc_put(struct gprs_dl_bvc *bvc)
+{
+	OSMO_ASSERT(bvc->num_ms > 0);
+	if (--bvc->num_ms > 0)
+		return;
+
+	OSMO_ASSERT(llist_empty(&bvc->prio_active));
+	OSMO_ASSERT(llist_empty(&bvc->active));
+	osmo_timer_del(&bvc->timer);
+	llist_del(&bvc->list);
+	talloc_free(bvc);
+}
+
+/* Take a frame off the priority or the bulk queue, returns its msgb */
+static struct msgb *dl_ms_dequeue(struct gprs_dl_ms *ms, struct dl_frame *fr,
+				  bool prio)
+{
+	struct gprs_dl_bvc *bvc = ms->bvc;
+	struct msgb *msg = fr->msg;
+	unsigned int len = msgb_length(msg);
+	uint8_t sapi = fr->sapi;
+
+	llist_del(&fr->list);
+	talloc_free(fr);
+	ms->queued_frames--;
+	ms->queued_bytes -= len;
+	bvc->stats.queued_frames--;
+	bvc->stats.queued_bytes -= len;
+
+	if (prio) {
+		if (llist_empty(&ms->prio_queue)) {
+			llist_del_init(&ms->prio_list);
+			bvc->num_prio_active--;
+		}
+		return msg;
+	}
+
+	ms->queued_bulk[sapi]--;
+	if (llist_empty(&ms->queue)) {
+		if (bvc->active.next == &ms->list)
+			bvc->in_turn = false;
+		llist_del_init(&ms->list);
+		bvc->num_active--;
+		ms->deficit = 0;
+	}
+	return msg;
+}
+
+static void dl_ms_drop(struct gprs_dl_ms *ms, struct dl_frame *fr, bool prio)
+{
+	msgb_free(dl_ms_dequeue(ms, fr, prio));
+	ms->dropped++;
+	ms->bvc->stats.dropped++;
+}
+
+static void dl_ms_purge(struct gprs_dl_ms *ms)
+{
+	struct dl_frame *fr, *fr2;
+
+	llist_for_each_entry_safe(fr, fr2, &ms->prio_queue, list)
+		dl_ms_drop(ms, fr, true);
+	llist_for_each_entry_safe(fr, fr2, &ms->queue, list)
+		dl_ms_drop(ms, fr, false);
+	memset(&ms->codel, 0, sizeof(ms->codel));
+}
+
+/* Move the MS to the BVC its frames go to now. What is still queued for
+ * the old cell is dropped, the MS has left it. That also happens if BSSGP
+ * does not know the new BVC, then the MS is left without one. */
+static int dl_ms_attach(struct gprs_dl_ms *ms, uint16_t nsei, uint16_t bvci)
+{
+	struct gprs_dl_bvc *bvc = dl_bvc_get(nsei, bvci);
+
+	if (bvc)
+		bvc->num_ms++;
+	if (ms->bvc) {
+		dl_ms_purge(ms);
+		dl_bvc_put(ms->bvc);
+	}
+	ms->bvc = bvc;
+	memset(&ms->bucket, 0, sizeof(ms->bucket));
+	return bvc ? 0 : -ENODEV;
+}
+
+static void dl_ms_send(struct gprs_dl_ms *ms, struct msgb *msg,
+		       const struct bssgp_dl_ud_par *dup, bool prio)
+{
+	struct bssgp_dl_ud_par dup_tx = *dup;
+	unsigned int len = msgb_length(msg);
+
+	dl_bucket_add(&ms->bucket, len);
+	ms->bvc->stats.sent_frames++;
+	ms->bvc->stats.sent_bytes += len;
+	if (prio)
+		ms->bvc->stats.prio++;
+	bssgp_tx_dl_ud(msg, 1000, &dup_tx);
+}
+
+static uint64_t dl_isqrt(uint64_t x)
+{
+	uint64_t r = x, y = (x + 1) / 2;
+
+	while (y < r) {
+		r = y;
+		y = (r + x / r) / 2;
+	}
+	return r;
+}
+
+/* Time of the next drop, interval/sqrt(count) after t */
+static uint64_t dl_codel_control_law(uint64_t t, unsigned int count)
+{
+	uint64_t interval = sgsn->cfg.dl_sched.codel_interval * 1000ULL;
+
+	return t + interval * 1000 / dl_isqrt(count * 1000000ULL);
+}
+
+/* Whether the head of the bulk queue has been above the target for an
+ * interval. A single frame is not a standing queue and never dropped. */
+static bool dl_codel_ok_to_drop(struct gprs_dl_ms *ms,
+				const struct dl_frame *fr, uint64_t now)
+{
+	struct gprs_dl_codel *c = &ms->codel;
+	uint64_t target = sgsn->cfg.dl_sched.codel_target * 1000ULL;
+	uint64_t interval = sgsn->cfg.dl_sched.codel_interval * 1000ULL;
+
+	if (now - fr->enqueued_us < target || ms->queue.next->next == &ms->queue) {
+		c->first_above_us = 0;
+		return false;
+	}
+	if (!c->first_above_us) {
+		c->first_above_us = now + interval;
+		return false;
+	}
+	return now >= c->first_above_us;
+}
+
+static void dl_codel_drop(struct gprs_dl_ms *ms, struct dl_frame *fr)
+{
+	LOGP(DLLC, LOGL_DEBUG, "TLLI=0x%08x: CoDel drops %u bytes after "
+	     "%llu ms in the downlink queue\n", ms->llme->tlli,
+	     msgb_length(fr->msg),
+	     (unsigned long long)(dl_now_us() - fr->enqueued_us) / 1000);
+	ms->bvc->stats.codel_dropped++;
+	dl_ms_drop(ms, fr, false);
+}
+
+/* Head of the bulk queue, after CoDel dropped what it had to drop by now.
+ * As CoDel leaves the last frame alone, there always is a head. */
+static struct dl_frame *dl_codel_head(struct gprs_dl_ms *ms, uint64_t now)
+{
+	struct gprs_dl_codel *c = &ms->codel;
+	uint64_t interval = sgsn->cfg.dl_sched.codel_interval * 1000ULL;
+	struct dl_frame *fr;
+	unsigned int delta;
+
+	fr = llist_entry(ms->queue.next, struct dl_frame, list);
+	if (!sgsn->cfg.dl_sched.codel_target)
+		return fr;
+
+	if (c->dropping) {
+		if (!dl_codel_ok_to_drop(ms, fr, now)) {
+			c->dropping = false;
+			return fr;
+		}
+		while (now >= c->drop_next_us) {
+			dl_codel_drop(ms, fr);
+			c->count++;
+			fr = llist_entry(ms->queue.next, struct dl_frame, list);
+			if (!dl_codel_ok_to_drop(ms, fr, now)) {
+				c->dropping = false;
+				break;
+			}
+			c->drop_next_us = dl_codel_control_law(c->drop_next_us,
+							       c->count);
+		}
+	} else if (dl_codel_ok_to_drop(ms, fr, now)) {
+		dl_codel_drop(ms, fr);
+		fr = llist_entry(ms->queue.next, struct dl_frame, list);
+		c->dropping = true;
+		/* start where the last dropping state left off if it
+		 * ended only recently */
+		delta = c->count - c->lastcount;
+		if (delta > 1 && (now < c->drop_next_us
+				  || now - c->drop_next_us < 16 * interval))
+			c->count = delta;
+		else
+			c->count = 1;
+		c->lastcount = c->count;
+		c->drop_next_us = dl_codel_control_law(now, c->count);
+	}
+	return fr;
+}
+
+/* Serve the queued MSs of a BVC for as long as the buckets allow, and arm
+ * the timer for when they will allow more: first the priority frames, one
+ * per MS in turn, then the bulk frames by deficit round robin. An MS whose
+ * own bucket is full is skipped without getting a quantum. Once BSSGP
+ * holds back a frame, the rest waits for its flow control timer. */
+static void dl_bvc_run(struct gprs_dl_bvc *bvc)
+{
+	const unsigned int quantum = sgsn->cfg.dl_sched.quantum;
+	uint64_t now = dl_now_us();
+	uint64_t wait, ms_wait = UINT64_MAX;
+	struct bssgp_bvc_ctx *bctx;
+	struct gprs_dl_ms *ms;
+	struct dl_frame *fr;
+	unsigned int len, skipped = 0;
+
+	bctx = btsctx_by_bvci_nsei(bvc->bvci, bvc->nsei);
+
+	while (!llist_empty(&bvc->prio_active)
+	       && skipped < bvc->num_prio_active) {
+		if (dl_bvc_blocked(bctx)) {
+			dl_bvc_wait_fc(bvc, bctx);
+			return;
+		}
+
+		ms = llist_entry(bvc->prio_active.next, struct gprs_dl_ms,
+				 prio_list);
+		fr = llist_entry(ms->prio_queue.next, struct dl_frame, list);
+		len = msgb_length(fr->msg);
+
+		dl_ms_params(ms, bctx);
+		dl_bucket_leak(&ms->bucket, now);
+		wait = dl_bucket_wait(&ms->bucket, len);
+		llist_move_tail(&ms->prio_list, &bvc->prio_active);
+		if (wait) {
+			ms_wait = OSMO_MIN(ms_wait, wait);
+			skipped++;
+			continue;
+		}
+
+		bvc->stats.deferred++;
+		skipped = 0;
+		dl_ms_send(ms, dl_ms_dequeue(ms, fr, true), &ms->dup, true);
+	}
+
+	skipped = 0;
+	while (!llist_empty(&bvc->active) && skipped < bvc->num_active) {
+		if (dl_bvc_blocked(bctx)) {
+			dl_bvc_wait_fc(bvc, bctx);
+			return;
+		}
+
+		ms = llist_entry(bvc->active.next, struct gprs_dl_ms, list);
+		fr = dl_codel_head(ms, now);
+		len = msgb_length(fr->msg);
+
+		/* nor do bulk frames overtake the priority frames of their
+		 * MS, which only wait for its bucket */
+		if (!llist_empty(&ms->prio_queue)) {
+			llist_move_tail(&ms->list, &bvc->active);
+			bvc->in_turn = false;
+			skipped++;
+			continue;
+		}
+
+		if (!bvc->in_turn) {
+			dl_ms_params(ms, bctx);
+			dl_bucket_leak(&ms->bucket, now);
+			wait = dl_bucket_wait(&ms->bucket, len);
+			if (wait) {
+				ms_wait = OSMO_MIN(ms_wait, wait);
+				llist_move_tail(&ms->list, &bvc->active);
+				skipped++;
+				continue;
+			}
+			ms->deficit += quantum;
+			bvc->in_turn = true;
+		}
+
+		if (len > ms->deficit || dl_bucket_wait(&ms->bucket, len)) {
+			/* end of the turn */
+			llist_move_tail(&ms->list, &bvc->active);
+			bvc->in_turn = false;
+			continue;
+		}
+
+		ms->deficit -= len;
+		bvc->stats.deferred++;
+		skipped = 0;
+		dl_ms_send(ms, dl_ms_dequeue(ms, fr, false), &ms->dup, false);
+	}
+
+	if (!llist_empty(&bvc->prio_active) || !llist_empty(&bvc->active))
+		osmo_timer_schedule(&bvc->timer, ms_wait / 1000000,
+				    ms_wait % 1000000);
+}
+
+static void dl_bvc_timer_cb(void *data)
+{
+	dl_bvc_run(data);
+}
+
+static void dl_ms_set_dup(struct gprs_dl_ms *ms,
+			  const struct bssgp_dl_ud_par *dup)
+{
+	ms->dup = *dup;
+	if (dup->imsi) {
+		osmo_strlcpy(ms->imsi, dup->imsi, sizeof(ms->imsi));
+		ms->dup.imsi = ms->imsi;
+	}
+	if (dup->ms_ra_cap.v) {
+		ms->dup.ms_ra_cap.len = OSMO_MIN(dup->ms_ra_cap.len,
+						 sizeof(ms->ms_ra_cap));
+		memcpy(ms->ms_ra_cap, dup->ms_ra_cap.v, ms->dup.ms_ra_cap.len);
+		ms->dup.ms_ra_cap.v = ms->ms_ra_cap;
+	}
+}
+
+/* Pass a downlink UI frame of the given LLME and SAPI down to BSSGP, now
+ * or when the flow control allows. Priority frames only wait for other
+ * priority frames and for the bulk frames of their own LLE. The msgb is
+ * consumed. */
+int gprs_dl_sched_tx(struct gprs_llc_llme *llme, struct msgb *msg,
+		     uint8_t sapi, const struct bssgp_dl_ud_par *dup, bool prio)
+{
+	const unsigned int max_bytes = sgsn->cfg.dl_sched.max_bytes;
+	struct gprs_dl_ms *ms = llme->dl;
+	unsigned int len = msgb_length(msg);
+	uint64_t now = dl_now_us();
+	struct bssgp_dl_ud_par dup_tx;
+	struct bssgp_bvc_ctx *bctx;
+	struct gprs_dl_bvc *bvc;
+	struct dl_frame *fr;
+
+	if (!ms) {
+		ms = talloc_zero(llme, struct gprs_dl_ms);
+		if (!ms)
+			goto direct;
+		ms->llme = llme;
+		INIT_LLIST_HEAD(&ms->list);
+		INIT_LLIST_HEAD(&ms->prio_list);
+		INIT_LLIST_HEAD(&ms->prio_queue);
+		INIT_LLIST_HEAD(&ms->queue);
+		llme->dl = ms;
+	}
+
+	if (!ms->bvc || ms->bvc->nsei != msgb_nsei(msg)
+	    || ms->bvc->bvci != msgb_bvci(msg)) {
+		/* BSSGP does not know the BVC and rejects the frame itself,
+		 * nothing is left queued for the MS that it would overtake */
+		if (dl_ms_attach(ms, msgb_nsei(msg), msgb_bvci(msg)) < 0)
+			goto direct;
+	}
+	bvc = ms->bvc;
+
+	/* keep the order of N(U) within the LLE */
+	if (prio && ms->queued_bulk[sapi])
+		prio = false;
+
+	/* Nothing is waiting ahead, send right away if the MS bucket allows */
+	bctx = btsctx_by_bvci_nsei(bvc->bvci, bvc->nsei);
+	if (llist_empty(&bvc->prio_active)
+	    && (prio || llist_empty(&bvc->active)) && !dl_bvc_blocked(bctx)) {
+		dl_ms_params(ms, bctx);
+		dl_bucket_leak(&ms->bucket, now);
+		if (!dl_bucket_wait(&ms->bucket, len)) {
+			dl_ms_send(ms, msg, dup, prio);
+			return 0;
+		}
+	}
+
+	/* a priority frame pushes bulk frames out of a full queue */
+	while (prio && ms->queued_bytes + len > max_bytes
+	       && !llist_empty(&ms->queue))
+		dl_ms_drop(ms, llist_entry(ms->queue.next, struct dl_frame, list),
+			   false);
+
+	if (ms->queued_bytes + len > max_bytes) {
+		LOGP(DLLC, LOGL_INFO, "TLLI=0x%08x: downlink queue full, "
+		     "dropping %u bytes\n", llme->tlli, len);
+		ms->dropped++;
+		bvc->stats.dropped++;
+		msgb_free(msg);
+		return -ENOSPC;
+	}
+
+	fr = talloc_zero(msg, struct dl_frame);
+	if (!fr) {
+		msgb_free(msg);
+		return -ENOMEM;
+	}
+	fr->msg = msg;
+	fr->enqueued_us = now;
+	fr->sapi = sapi;
+
+	dl_ms_set_dup(ms, dup);
+	if (prio) {
+		llist_add_tail(&fr->list, &ms->prio_queue);
+		if (ms->prio_queue.next == &fr->list) {
+			llist_add_tail(&ms->prio_list, &bvc->prio_active);
+			bvc->num_prio_active++;
+		}
+	} else {
+		llist_add_tail(&fr->list, &ms->queue);
+		ms->queued_bulk[sapi]++;
+		if (ms->queue.next == &fr->list) {
+			llist_add_tail(&ms->list, &bvc->active);
+			bvc->num_active++;
+		}
+	}
+	ms->queued_frames++;
+	ms->queued_bytes += len;
+	bvc->stats.queued_frames++;
+	bvc->stats.queued_bytes += len;
+
+	if (!osmo_timer_pending(&bvc->timer))
+		dl_bvc_run(bvc);
+	return 0;
+
+direct:
+	dup_tx = *dup;
+	return bssgp_tx_dl_ud(msg, 1000, &dup_tx);
+}
+
+/* Drop what is queued for the LLME and release its scheduler state */
+void gprs_dl_sched_ms_free(struct gprs_llc_llme *llme)
+{
+	struct gprs_dl_ms *ms = llme->dl;
+
+	if (!ms)
+		return;
+
+	if (ms->bvc) {
+		dl_ms_purge(ms);
+		dl_bvc_put(ms->bvc);
+	}
+	talloc_free(ms);
+	llme->dl = NULL;
+}
@@ -1257,8 +1257,8 @@ static inline void ptmsi_update(struct sgsn_mm_ctx *ctx)
 	if (ctx->gmm_state != GMM_COMMON_PROC_INIT) {
 		ptmsi = sgsn_alloc_ptmsi();
 		if (ptmsi != GSM_RESERVED_TMSI) {
-			ctx->p_tmsi_old = ctx->p_tmsi;
-			ctx->p_tmsi = ptmsi;
+			sgsn_mm_ctx_set_ptmsi_old(ctx, ctx->p_tmsi);
+			sgsn_mm_ctx_set_ptmsi(ctx, ptmsi);
 		} else
 			LOGMMCTXP(LOGL_ERROR, ctx, "P-TMSI allocation failure: using old one.\n");
 	}
@@ -1362,8 +1362,8 @@ static int gsm48_rx_gmm_att_req(struct sgsn_mm_ctx *ctx, struct msgb *msg,
 			osmo_strlcpy(ctx->imsi, mi_string, sizeof(ctx->imsi));
 		}
 		if (ctx->ran_type == MM_CTX_T_GERAN_Gb) {
-			ctx->gb.tlli = msgb_tlli(msg);
-			ctx->gb.llme = llme;
+			sgsn_mm_ctx_set_tlli(ctx, msgb_tlli(msg));
+			sgsn_mm_ctx_set_llme(ctx, llme);
 		}
 		msgid2mmctx(ctx, msg);
 		break;
@@ -1384,11 +1384,11 @@ static int gsm48_rx_gmm_att_req(struct sgsn_mm_ctx *ctx, struct msgb *msg,
 				reject_cause = GMM_CAUSE_NET_FAIL;
 				goto rejected;
 			}
-			ctx->p_tmsi = tmsi;
+			sgsn_mm_ctx_set_ptmsi(ctx, tmsi);
 		}
 		if (ctx->ran_type == MM_CTX_T_GERAN_Gb) {
-			ctx->gb.tlli = msgb_tlli(msg);
-			ctx->gb.llme = llme;
+			sgsn_mm_ctx_set_tlli(ctx, msgb_tlli(msg));
+			sgsn_mm_ctx_set_llme(ctx, llme);
 		}
 		msgid2mmctx(ctx, msg);
 		break;
@@ -1427,7 +1427,8 @@ static int gsm48_rx_gmm_att_req(struct sgsn_mm_ctx *ctx, struct msgb *msg,
 	if (ctx->ran_type == MM_CTX_T_GERAN_Gb) {
 		/* Even if there is no P-TMSI allocated, the MS will
 		 * switch from foreign TLLI to local TLLI */
-		ctx->gb.tlli_new = gprs_tmsi2tlli(ctx->p_tmsi, TLLI_LOCAL);
+		sgsn_mm_ctx_set_tlli_new(ctx, gprs_tmsi2tlli(ctx->p_tmsi,
+							      TLLI_LOCAL));
 
 		/* Inform LLC layer about new TLLI but keep old active */
 		if (sgsn_mm_ctx_is_authenticated(ctx))
@@ -1754,7 +1755,7 @@ static int gsm48_rx_gmm_ra_upd_req(struct sgsn_mm_ctx *mmctx, struct msgb *msg,
 	if (mmctx->ran_type == MM_CTX_T_GERAN_Gb) {
 		bssgp_parse_cell_id(&mmctx->ra, msgb_bcid(msg));
 		/* Update the MM context with the new (i.e. foreign) TLLI */
-		mmctx->gb.tlli = msgb_tlli(msg);
+		sgsn_mm_ctx_set_tlli(mmctx, msgb_tlli(msg));
 	}
 	/* FIXME: Update the MM context with the MS radio acc capabilities */
 	/* FIXME: Update the MM context with the MS network capabilities */
@@ -1778,7 +1779,8 @@ static int gsm48_rx_gmm_ra_upd_req(struct sgsn_mm_ctx *mmctx, struct msgb *msg,
 	if (mmctx->ran_type == MM_CTX_T_GERAN_Gb) {
 		/* Even if there is no P-TMSI allocated, the MS will switch from
 	 	* foreign TLLI to local TLLI */
-		mmctx->gb.tlli_new = gprs_tmsi2tlli(mmctx->p_tmsi, TLLI_LOCAL);
+		sgsn_mm_ctx_set_tlli_new(mmctx, gprs_tmsi2tlli(mmctx->p_tmsi,
+								TLLI_LOCAL));
 
 		/* Inform LLC layer about new TLLI but keep old active */
 		gprs_llgmm_assign(mmctx->gb.llme, mmctx->gb.tlli,
@@ -2049,11 +2051,11 @@ static int gsm0408_rcv_gmm(struct sgsn_mm_ctx *mmctx, struct msgb *msg,
 
 		mmctx_timer_stop(mmctx, 3350);
 		mmctx->t3350_mode = GMM_T3350_MODE_NONE;
-		mmctx->p_tmsi_old = 0;
+		sgsn_mm_ctx_set_ptmsi_old(mmctx, 0);
 		mmctx->pending_req = 0;
 		if (mmctx->ran_type == MM_CTX_T_GERAN_Gb) {
 			/* Unassign the old TLLI */
-			mmctx->gb.tlli = mmctx->gb.tlli_new;
+			sgsn_mm_ctx_set_tlli(mmctx, mmctx->gb.tlli_new);
 			gprs_llme_copy_key(mmctx, mmctx->gb.llme);
 			gprs_llgmm_assign(mmctx->gb.llme, 0xffffffff,
 					  mmctx->gb.tlli_new);
@@ -2075,11 +2077,11 @@ static int gsm0408_rcv_gmm(struct sgsn_mm_ctx *mmctx, struct msgb *msg,
 		LOGMMCTXP(LOGL_INFO, mmctx, "-> ROUTING AREA UPDATE COMPLETE\n");
 		mmctx_timer_stop(mmctx, 3350);
 		mmctx->t3350_mode = GMM_T3350_MODE_NONE;
-		mmctx->p_tmsi_old = 0;
+		sgsn_mm_ctx_set_ptmsi_old(mmctx, 0);
 		mmctx->pending_req = 0;
 		if (mmctx->ran_type == MM_CTX_T_GERAN_Gb) {
 			/* Unassign the old TLLI */
-			mmctx->gb.tlli = mmctx->gb.tlli_new;
+			sgsn_mm_ctx_set_tlli(mmctx, mmctx->gb.tlli_new);
 			gprs_llgmm_assign(mmctx->gb.llme, 0xffffffff,
 					  mmctx->gb.tlli_new);
 		}
@@ -2091,6 +2093,10 @@ static int gsm0408_rcv_gmm(struct sgsn_mm_ctx *mmctx, struct msgb *msg,
 		memset(&sig_data, 0, sizeof(sig_data));
 		sig_data.mm = mmctx;
 		osmo_signal_dispatch(SS_SGSN, S_SGSN_UPDATE, &sig_data);
+
+		/* A suspended MS may resume by a RA update, send what was
+		 * buffered for it meanwhile */
+		sgsn_mm_ctx_dl_queue_flush(mmctx);
 		break;
 	case GSM48_MT_GMM_PTMSI_REALL_COMPL:
 		if (!mmctx)
@@ -2098,11 +2104,11 @@ static int gsm0408_rcv_gmm(struct sgsn_mm_ctx *mmctx, struct msgb *msg,
 		LOGMMCTXP(LOGL_INFO, mmctx, "-> PTMSI REALLLICATION COMPLETE\n");
 		mmctx_timer_stop(mmctx, 3350);
 		mmctx->t3350_mode = GMM_T3350_MODE_NONE;
-		mmctx->p_tmsi_old = 0;
+		sgsn_mm_ctx_set_ptmsi_old(mmctx, 0);
 		mmctx->pending_req = 0;
 		if (mmctx->ran_type == MM_CTX_T_GERAN_Gb) {
 			/* Unassign the old TLLI */
-			mmctx->gb.tlli = mmctx->gb.tlli_new;
+			sgsn_mm_ctx_set_tlli(mmctx, mmctx->gb.tlli_new);
 			//gprs_llgmm_assign(mmctx->gb.llme, 0xffffffff, mmctx->gb.tlli_new, GPRS_ALGO_GEA0, NULL);
 		}
 		rc = 0;
@@ -2244,7 +2250,7 @@ static void pdpctx_timer_stop(struct sgsn_pdp_ctx *pdp, unsigned int T)
 void pdp_ctx_detach_mm_ctx(struct sgsn_pdp_ctx *pdp)
 {
 	/* Detach from MM context */
-	llist_del(&pdp->list);
+	sgsn_mm_ctx_remove_pdp(pdp->mm, pdp);
 	pdp->mm = NULL;
 
 	/* stop timer 3395 */
@@ -2410,7 +2416,7 @@ static int activate_ggsn(struct sgsn_mm_ctx *mmctx,
 
 	/* Store SAPI and Transaction Identifier */
 	pdp->sapi = req_llc_sapi;
-	pdp->ti = transaction_id;
+	sgsn_pdp_ctx_set_ti(pdp, transaction_id);
 	pdp->destroy_ggsn = destroy_ggsn;
 
 	return 0;
@@ -2594,7 +2600,9 @@ static int do_act_pdp_req(struct sgsn_mm_ctx *mmctx, struct msgb *msg, bool *del
 
 			if (pdp->mm->ran_type == MM_CTX_T_GERAN_Gb) {
 				/* Also re-transmit the SNDCP XID message */
-				lle = &pdp->mm->gb.llme->lle[pdp->sapi];
+				lle = gprs_llme_lle(pdp->mm->gb.llme, pdp->sapi);
+				if (!lle)
+					return -ENOMEM;
 				rc = sndcp_sn_xid_req(lle,pdp->nsapi);
 				if (rc < 0)
 					return rc;
@@ -2922,7 +2930,7 @@ int gsm0408_gprs_rcvmsg_gb(struct msgb *msg, struct gprs_llc_llme *llme,
 	if (mmctx) {
 		msgid2mmctx(mmctx, msg);
 		rate_ctr_inc(&mmctx->ctrg->ctr[GMM_CTR_PKTS_SIG_IN]);
-		mmctx->gb.llme = llme;
+		sgsn_mm_ctx_set_llme(mmctx, llme);
 	}
 
 	/* MMCTX can be NULL */
@@ -2994,6 +3002,9 @@ int gprs_gmm_rx_resume(struct gprs_ra_id *raid, uint32_t tlli,
 
 	/* Transition from SUSPENDED to NORMAL */
 	mmctx->gmm_state = GMM_REGISTERED_NORMAL;
+
+	/* Send the N-PDUs that arrived while the MS was suspended */
+	sgsn_mm_ctx_dl_queue_flush(mmctx);
 	return 0;
 }
 
@@ -40,6 +40,11 @@
 #include <osmocom/sgsn/gprs_llc_xid.h>
 #include <osmocom/sgsn/gprs_sndcp_comp.h>
 #include <osmocom/sgsn/gprs_sndcp.h>
+#include <osmocom/sgsn/gprs_obj_pool.h>
+#include <osmocom/sgsn/gprs_msgb_pool.h>
+#include <osmocom/sgsn/gprs_offload.h>
+#include <osmocom/sgsn/gprs_dl_sched.h>
+#include <osmocom/sgsn/gprs_trace.h>
 
 static struct gprs_llc_llme *llme_alloc(uint32_t tlli);
 static int gprs_llc_tx_xid(struct gprs_llc_lle *lle, struct msgb *msg,
@@ -48,6 +53,15 @@ static int gprs_llc_tx_dm(struct gprs_llc_lle *lle);
 static int gprs_llc_tx_u(struct msgb *msg, uint8_t sapi,
 			 int command, enum gprs_llc_u_cmd u_cmd, int pf_bit);
 
+/* Allocate a msgb for an U frame with an information field of len bytes.
+ * Most of them are a few dozen bytes and fit into the smallest pool. */
+static struct msgb *llc_ctrl_msgb_alloc(unsigned int len, const char *name)
+{
+	return gprs_msgb_alloc_headroom(GPRS_LLC_DL_HEADROOM + len +
+					GPRS_LLC_DL_TAILROOM,
+					GPRS_LLC_DL_HEADROOM, name);
+}
+
 /* BEGIN XID RELATED */
 
 /* Generate XID message */
@@ -288,7 +302,6 @@ static void rx_llc_xid(struct gprs_llc_lle *lle,
 
 		struct msgb *resp;
 		uint8_t *xid;
-		resp = msgb_alloc_headroom(4096, 1024, "LLC_XID");
 
 		response_len =
 		    gprs_llc_process_xid_ind(gph->data, gph->data_len,
@@ -297,10 +310,13 @@ static void rx_llc_xid(struct gprs_llc_lle *lle,
 		if (response_len < 0) {
 			LOGP(DLLC, LOGL_ERROR,
 			     "invalid XID indication received!\n");
-		} else {
-			xid = msgb_put(resp, response_len);
-			memcpy(xid, response, response_len);
+			response_len = 0;
 		}
+		resp = llc_ctrl_msgb_alloc(response_len, "LLC_XID");
+		if (!resp)
+			return;
+		xid = msgb_put(resp, response_len);
+		memcpy(xid, response, response_len);
 		gprs_llc_tx_xid(lle, resp, 0);
 	} else {
 		LOGP(DLLC, LOGL_NOTICE,
@@ -330,7 +346,9 @@ int gprs_ll_xid_req(struct gprs_llc_lle *lle,
 	/* Only perform XID sending if the XID message contains something */
 	if (xid_bytes_len > 0) {
 		/* Transmit XID bytes */
-		msg = msgb_alloc_headroom(4096, 1024, "LLC_XID");
+		msg = llc_ctrl_msgb_alloc(xid_bytes_len, "LLC_XID");
+		if (!msg)
+			return -ENOMEM;
 		xid = msgb_put(msg, xid_bytes_len);
 		memcpy(xid, xid_bytes, xid_bytes_len);
 		if (l3_xid_field)
@@ -354,37 +372,51 @@ int gprs_ll_xid_req(struct gprs_llc_lle *lle,
 
 
 
-/* Entry function from upper level (LLC), asking us to transmit a BSSGP PDU
- * to a remote MS (identified by TLLI) at a BTS identified by its BVCI and NSEI */
-static int _bssgp_tx_dl_ud(struct msgb *msg, struct sgsn_mm_ctx *mmctx)
+/* Fill in what BSSGP needs to know about the MS that a DL-UNITDATA with
+ * the given TLLI is meant for. Fails if the TLLI does not belong to the
+ * LLME of the MM context. */
+static int llc_dl_ud_par(struct bssgp_dl_ud_par *dup, uint32_t tlli,
+			 struct sgsn_mm_ctx *mmctx)
 {
-	struct bssgp_dl_ud_par dup;
 	const uint8_t qos_profile_default[3] = { 0x00, 0x00, 0x20 };
 
-	memset(&dup, 0, sizeof(dup));
+	memset(dup, 0, sizeof(*dup));
 	/* before we have received some identity from the MS, we might
 	 * not yet have a MMC context (e.g. XID negotiation of primarly
 	 * LLC connection from GMM sapi). */
 	if (mmctx) {
-		dup.imsi = mmctx->imsi;
-		dup.drx_parms = mmctx->drx_parms;
-		dup.ms_ra_cap.len = mmctx->ms_radio_access_capa.len;
-		dup.ms_ra_cap.v = mmctx->ms_radio_access_capa.buf;
+		dup->imsi = mmctx->imsi;
+		dup->drx_parms = mmctx->drx_parms;
+		dup->ms_ra_cap.len = mmctx->ms_radio_access_capa.len;
+		dup->ms_ra_cap.v = mmctx->ms_radio_access_capa.buf;
 
 		/* make sure we only send it to the right llme */
-		if (!(msgb_tlli(msg) == mmctx->gb.llme->tlli
-		      || msgb_tlli(msg) == mmctx->gb.llme->old_tlli)) {
+		if (!(tlli == mmctx->gb.llme->tlli
+		      || tlli == mmctx->gb.llme->old_tlli)) {
 			LOGP(DLLC, LOGL_ERROR,
 			     "_bssgp_tx_dl_ud(): Attempt to send Downlink Unitdata to wrong LLME:"
 			     " msgb_tlli=0x%x mmctx->gb.llme->tlli=0x%x ->old_tlli=0x%x\n",
-			     msgb_tlli(msg), mmctx->gb.llme->tlli, mmctx->gb.llme->old_tlli);
-			msgb_free(msg);
+			     tlli, mmctx->gb.llme->tlli, mmctx->gb.llme->old_tlli);
 			return -EINVAL;
 		}
 	}
-	memcpy(&dup.qos_profile, qos_profile_default,
+	memcpy(&dup->qos_profile, qos_profile_default,
 		sizeof(qos_profile_default));
 
+	return 0;
+}
+
+/* Entry function from upper level (LLC), asking us to transmit a BSSGP PDU
+ * to a remote MS (identified by TLLI) at a BTS identified by its BVCI and NSEI */
+static int _bssgp_tx_dl_ud(struct msgb *msg, struct sgsn_mm_ctx *mmctx)
+{
+	struct bssgp_dl_ud_par dup;
+
+	if (llc_dl_ud_par(&dup, msgb_tlli(msg), mmctx) < 0) {
+		msgb_free(msg);
+		return -EINVAL;
+	}
+
 	return bssgp_tx_dl_ud(msg, 1000, &dup);
 }
 
@@ -458,34 +490,59 @@ static const struct gprs_llc_params llc_default_params[NUM_SAPIS] = {
 };
 
 LLIST_HEAD(gprs_llc_llmes);
+LLIST_HEAD(gprs_llc_llmes_idle);
+/* LLMEs that have seen activity since the last gprs_llme_age_update() */
+static LLIST_HEAD(llme_active_list);
 void *llc_tall_ctx;
 
-/* lookup LLC Entity based on DLCI (TLLI+SAPI tuple) */
-static struct gprs_llc_lle *lle_by_tlli_sapi(const uint32_t tlli, uint8_t sapi)
+/* Number of released LLMEs kept for reuse */
+#define LLME_POOL_MAX 1024
+
+static struct gprs_obj_pool llme_pool =
+	GPRS_OBJ_POOL_INIT(llme_pool, struct gprs_llc_llme, LLME_POOL_MAX);
+
+/* LLMEs indexed by tlli and old_tlli */
+static struct gprs_id_hash llme_tlli_hash;
+
+/* Update the TLLIs of an LLME and keep the index current, 0xffffffff
+ * marks an unassigned TLLI */
+static void llme_set_tlli(struct gprs_llc_llme *llme, uint32_t tlli,
+			  uint32_t old_tlli)
 {
-	struct gprs_llc_llme *llme;
+	llme->tlli = tlli;
+	llme->old_tlli = old_tlli;
+	gprs_id_hash_update(&llme_tlli_hash, &llme->tlli_hnode,
+			    tlli, 0xffffffff, llme);
+	gprs_id_hash_update(&llme_tlli_hash, &llme->old_tlli_hnode,
+			    old_tlli, 0xffffffff, llme);
+}
 
-	llist_for_each_entry(llme, &gprs_llc_llmes, list) {
-		if (llme->tlli == tlli || llme->old_tlli == tlli)
-			return &llme->lle[sapi];
-	}
-	return NULL;
+/* lookup LLC Management Entity based on either of its TLLIs */
+static struct gprs_llc_llme *llme_by_tlli(const uint32_t tlli)
+{
+	struct gprs_id_hnode *node;
+
+	node = gprs_id_hash_first(&llme_tlli_hash, tlli);
+	if (!node)
+		return NULL;
+
+	return node->priv;
 }
 
 struct gprs_llc_lle *gprs_lle_get_or_create(const uint32_t tlli, uint8_t sapi)
 {
 	struct gprs_llc_llme *llme;
-	struct gprs_llc_lle *lle;
 
-	lle = lle_by_tlli_sapi(tlli, sapi);
-	if (lle)
-		return lle;
+	llme = llme_by_tlli(tlli);
+	if (!llme) {
+		LOGP(DLLC, LOGL_NOTICE, "LLC: unknown TLLI 0x%08x, "
+			"creating LLME on the fly\n", tlli);
+		llme = llme_alloc(tlli);
+		if (!llme)
+			return NULL;
+	}
 
-	LOGP(DLLC, LOGL_NOTICE, "LLC: unknown TLLI 0x%08x, "
-		"creating LLME on the fly\n", tlli);
-	llme = llme_alloc(tlli);
-	lle = &llme->lle[sapi];
-	return lle;
+	return gprs_llme_lle(llme, sapi);
 }
 
 struct llist_head *gprs_llme_list(void)
@@ -493,39 +550,53 @@ struct llist_head *gprs_llme_list(void)
 	return &gprs_llc_llmes;
 }
 
+/* Restart the age computation of an LLME that has seen some activity */
+static void llme_touch(struct gprs_llc_llme *llme)
+{
+	if (llme->age_timestamp == GPRS_LLME_RESET_AGE)
+		return;
+
+	llme->age_timestamp = GPRS_LLME_RESET_AGE;
+	llist_move_tail(&llme->age_list, &llme_active_list);
+}
+
+/* Stamp all LLMEs that were active since the last call with the current
+ * time and move them to the end of gprs_llc_llmes_idle, which thereby
+ * stays ordered by age_timestamp. LLMEs that remained idle are not
+ * touched at all. */
+void gprs_llme_age_update(uint32_t now)
+{
+	struct gprs_llc_llme *llme, *llme_tmp;
+
+	llist_for_each_entry_safe(llme, llme_tmp, &llme_active_list, age_list) {
+		llme->age_timestamp = now;
+		llist_move_tail(&llme->age_list, &gprs_llc_llmes_idle);
+	}
+}
+
 /* lookup LLC Entity for RX based on DLCI (TLLI+SAPI tuple) */
 static struct gprs_llc_lle *lle_for_rx_by_tlli_sapi(const uint32_t tlli,
 					uint8_t sapi, enum gprs_llc_cmd cmd)
 {
-	struct gprs_llc_lle *lle;
-
-	/* We already know about this TLLI */
-	lle = lle_by_tlli_sapi(tlli, sapi);
-	if (lle)
-		return lle;
+	struct gprs_llc_llme *llme;
 
-	/* Maybe it is a routing area update but we already know this sapi? */
-	if (gprs_tlli_type(tlli) == TLLI_FOREIGN) {
-		lle = lle_by_tlli_sapi(tlli, sapi);
-		if (lle) {
-			LOGP(DLLC, LOGL_NOTICE,
-				"LLC RX: Found a local entry for TLLI 0x%08x\n",
-				tlli);
-			return lle;
-		}
-	}
+	/* We already know about this TLLI. This includes a foreign TLLI
+	 * of a routing area update, as both TLLIs of an LLME are indexed */
+	llme = llme_by_tlli(tlli);
+	if (llme)
+		return gprs_llme_lle(llme, sapi);
 
 	/* 7.2.1.1 LLC belonging to unassigned TLLI+SAPI shall be discarded,
 	 * except UID and XID frames with SAPI=1 */
 	if (sapi == GPRS_SAPI_GMM &&
 		    (cmd == GPRS_LLC_XID || cmd == GPRS_LLC_UI)) {
-		struct gprs_llc_llme *llme;
 		/* FIXME: don't use the TLLI but the 0xFFFF unassigned? */
 		llme = llme_alloc(tlli);
+		if (!llme)
+			return NULL;
 		LOGP(DLLC, LOGL_NOTICE, "LLC RX: unknown TLLI 0x%08x, "
 			"creating LLME on the fly\n", tlli);
-		lle = &llme->lle[sapi];
-		return lle;
+		return gprs_llme_lle(llme, sapi);
 	}
 	
 	LOGP(DLLC, LOGL_NOTICE,
@@ -534,50 +605,86 @@ static struct gprs_llc_lle *lle_for_rx_by_tlli_sapi(const uint32_t tlli,
 	return NULL;
 }
 
-static void lle_init(struct gprs_llc_llme *llme, uint8_t sapi)
+/* Return the LLE for the SAPI, creating it on first use. The LLE is
+ * allocated below the LLME and freed with it. */
+struct gprs_llc_lle *gprs_llme_lle(struct gprs_llc_llme *llme, uint8_t sapi)
 {
-	struct gprs_llc_lle *lle = &llme->lle[sapi];
+	struct gprs_llc_lle *lle;
+
+	OSMO_ASSERT(sapi < ARRAY_SIZE(llme->lle));
+
+	lle = llme->lle[sapi];
+	if (lle)
+		return lle;
+
+	lle = talloc_zero(llme, struct gprs_llc_lle);
+	if (!lle)
+		return NULL;
 
 	lle->llme = llme;
 	lle->sapi = sapi;
-	lle->state = GPRS_LLES_UNASSIGNED;
+	INIT_LLIST_HEAD(&lle->tx_jobs);
+	/* 8.5.3.1 applies to LLEs created after the TLLI assignment too */
+	if (llme->state == GPRS_LLMS_ASSIGNED)
+		lle->state = GPRS_LLES_ASSIGNED_ADM;
+	else
+		lle->state = GPRS_LLES_UNASSIGNED;
 
 	/* Initialize according to parameters */
 	memcpy(&lle->params, &llc_default_params[sapi], sizeof(lle->params));
+
+	llme->lle[sapi] = lle;
+	return lle;
 }
 
 static struct gprs_llc_llme *llme_alloc(uint32_t tlli)
 {
 	struct gprs_llc_llme *llme;
-	uint32_t i;
 
-	llme = talloc_zero(llc_tall_ctx, struct gprs_llc_llme);
+	llme = gprs_obj_pool_alloc(&llme_pool, llc_tall_ctx);
 	if (!llme)
 		return NULL;
 
-	llme->tlli = tlli;
-	llme->old_tlli = 0xffffffff;
+	llme_set_tlli(llme, tlli, 0xffffffff);
 	llme->state = GPRS_LLMS_UNASSIGNED;
 	llme->age_timestamp = GPRS_LLME_RESET_AGE;
 	llme->cksn = GSM_KEY_SEQ_INVAL;
 
-	for (i = 0; i < ARRAY_SIZE(llme->lle); i++)
-		lle_init(llme, i);
-
 	llist_add(&llme->list, &gprs_llc_llmes);
-
-	llme->comp.proto = gprs_sndcp_comp_alloc(llme);
-	llme->comp.data = gprs_sndcp_comp_alloc(llme);
+	llist_add_tail(&llme->age_list, &llme_active_list);
 
 	return llme;
 }
 
+static void llc_ui_burst_jobs_cancel(struct gprs_llc_lle *lle);
+
 static void llme_free(struct gprs_llc_llme *llme)
 {
-	gprs_sndcp_comp_free(llme->comp.proto);
-	gprs_sndcp_comp_free(llme->comp.data);
+	unsigned int i;
+
+	/* Bursts still on an offload worker are dropped when they return */
+	for (i = 0; i < ARRAY_SIZE(llme->lle); i++) {
+		if (llme->lle[i])
+			llc_ui_burst_jobs_cancel(llme->lle[i]);
+	}
+	gprs_dl_sched_ms_free(llme);
+
+	/* Normally all SNDCP entities have been deactivated by now, but
+	 * nobody else would find the remaining ones any more */
+	for (i = 0; i < ARRAY_SIZE(llme->sne); i++)
+		gprs_sndcp_entity_free(llme->sne[i]);
+
+	if (llme->comp.proto)
+		gprs_sndcp_comp_free(llme->comp.proto);
+	if (llme->comp.data)
+		gprs_sndcp_comp_free(llme->comp.data);
 	llist_del(&llme->list);
-	talloc_free(llme);
+	llist_del(&llme->age_list);
+	if (llme->mm && llme->mm->gb.llme == llme)
+		llme->mm->gb.llme = NULL;
+	gprs_id_hash_del(&llme_tlli_hash, &llme->tlli_hnode);
+	gprs_id_hash_del(&llme_tlli_hash, &llme->old_tlli_hnode);
+	gprs_obj_pool_free(&llme_pool, llme);
 }
 
 #if 0
@@ -659,6 +766,9 @@ int gprs_llc_tx_u(struct msgb *msg, uint8_t sapi, int command,
 	rate_ctr_inc(&sgsn->rate_ctrs->ctr[CTR_LLC_DL_PACKETS]);
 	rate_ctr_add(&sgsn->rate_ctrs->ctr[CTR_LLC_DL_BYTES], msg->len);
 
+	gprs_trace_pkt(GPRS_TRACE_LLC_DL, GPRS_TRACE_V_OK, msgb_tlli(msg), sapi,
+		       GPRS_TRACE_NO_ID, GPRS_TRACE_NO_NU, msg->len);
+
 	/* Send BSSGP-DL-UNITDATA.req */
 	return _bssgp_tx_dl_ud(msg, NULL);
 }
@@ -677,7 +787,10 @@ static int gprs_llc_tx_xid(struct gprs_llc_lle *lle, struct msgb *msg,
 
 static int gprs_llc_tx_dm(struct gprs_llc_lle *lle)
 {
-	struct msgb *msg = msgb_alloc_headroom(4096, 1024, "LLC_DM");
+	struct msgb *msg = llc_ctrl_msgb_alloc(0, "LLC_DM");
+
+	if (!msg)
+		return -ENOMEM;
 
 	/* copy identifiers from LLE to ensure lower layers can route */
 	msgb_tlli(msg) = lle->llme->tlli;
@@ -687,81 +800,175 @@ static int gprs_llc_tx_dm(struct gprs_llc_lle *lle)
 	return gprs_llc_tx_u(msg, lle->sapi, 0, GPRS_LLC_U_DM_RESP, 1);
 }
 
-/* encrypt information field + FCS, if needed! */
-static int apply_gea(struct gprs_llc_lle *lle, uint16_t crypt_len, uint16_t nu,
-		     uint32_t oc, uint8_t sapi, uint8_t *fcs, uint8_t *data)
+/* The CRC is folded in and the keystream applied block by block, so every
+ * block is still in the cache for the second step */
+#define GEA_FUSE_BLOCK	256
+
+/* A UI frame on its way down, between header and FCS computation */
+struct llc_ui_frame {
+	uint8_t *llch;
+	uint8_t *fcs;
+	/* length of information field + FCS, the part that is encrypted */
+	uint16_t crypt_len;
+	uint16_t nu;
+	uint32_t oc;
+	/* keystream for information field + FCS, if encrypted */
+	uint8_t *ks;
+};
+
+/* Keystreams of the burst that is sent on the main thread, a slot of the
+ * maximum size per frame. Bursts on an offload worker bring their own. */
+static uint8_t llc_ui_burst_ks[GPRS_LLC_UI_BURST_MAX][GSM0464_CIPH_MAX_BLOCK];
+
+/* What the keystream generator needs, copied from the LLME so that it can
+ * also be used on an offload worker */
+struct gea_params {
+	enum gprs_ciph_algo algo;
+	uint8_t kc[16];
+	uint32_t iov_ui;
+	uint8_t sapi;
+};
+
+static void gea_params_get(struct gea_params *gp,
+			   const struct gprs_llc_llme *llme, uint8_t sapi)
 {
-	uint8_t cipher_out[GSM0464_CIPH_MAX_BLOCK];
+	gp->algo = llme->algo;
+	memcpy(gp->kc, llme->kc, sizeof(gp->kc));
+	gp->iov_ui = llme->iov_ui;
+	gp->sapi = sapi;
+}
 
-	if (lle->llme->algo == GPRS_ALGO_GEA0)
-		return -EINVAL;
+/* Generate the keystream for the information field + FCS of a UI frame.
+ * This may run on an offload worker, so errors are logged by the caller
+ * with gea_error(). */
+static int gea_keystream(const struct gea_params *gp, uint8_t *ks,
+			 uint16_t crypt_len, uint16_t nu, uint32_t oc,
+			 enum gprs_cipher_direction dir)
+{
+	uint32_t iv;
 
 	/* Compute the 'Input' Paraemeter */
-	uint32_t fcs_calc, iv = gprs_cipher_gen_input_ui(lle->llme->iov_ui, sapi,
-							 nu, oc);
+	iv = gprs_cipher_gen_input_ui(gp->iov_ui, gp->sapi, nu, oc);
 	/* Compute gamma that we need to XOR with the data */
-	int r = gprs_cipher_run(cipher_out, crypt_len, lle->llme->algo,
-				lle->llme->kc, iv,
-				fcs ? GPRS_CIPH_SGSN2MS : GPRS_CIPH_MS2SGSN);
-	if (r < 0) {
-		LOGP(DLLC, LOGL_ERROR, "Error producing %s gamma for UI "
-		     "frame: %d\n", get_value_string(gprs_cipher_names,
-						     lle->llme->algo), r);
-		return -ENOMSG;
-	}
+	return gprs_cipher_run(ks, crypt_len, gp->algo, (uint8_t *)gp->kc,
+			       iv, dir);
+}
 
-	if (fcs) {
-		/* Mark frame as encrypted and update FCS */
-		data[2] |= 0x02;
-		fcs_calc = gprs_llc_fcs(data, fcs - data);
-		fcs[0] = fcs_calc & 0xff;
-		fcs[1] = (fcs_calc >> 8) & 0xff;
-		fcs[2] = (fcs_calc >> 16) & 0xff;
-		data += 3;
+static int gea_error(enum gprs_ciph_algo algo, int rc)
+{
+	LOGP(DLLC, LOGL_ERROR, "Error producing %s gamma for UI "
+	     "frame: %d\n", get_value_string(gprs_cipher_names, algo), rc);
+	return -ENOMSG;
+}
+
+static void gea_xor(uint8_t *data, const uint8_t *ks, unsigned int len)
+{
+	uint64_t d, k;
+
+	for (; len >= sizeof(d); len -= sizeof(d)) {
+		memcpy(&d, data, sizeof(d));
+		memcpy(&k, ks, sizeof(k));
+		d ^= k;
+		memcpy(data, &d, sizeof(d));
+		data += sizeof(d);
+		ks += sizeof(k);
 	}
+	while (len--)
+		*data++ ^= *ks++;
+}
 
-	/* XOR the cipher output with the data */
-	for (r = 0; r < crypt_len; r++)
-		*(data + r) ^= cipher_out[r];
+/* Generate the keystreams for a burst of UI frames of one LLE. Only the
+ * input parameter differs between the frames, this is the one place where
+ * a cipher implementation that handles several inputs at once fits in. */
+static int gea_keystream_burst(const struct gea_params *gp,
+			       const struct llc_ui_frame *frames,
+			       unsigned int num)
+{
+	unsigned int i;
+	int rc;
 
+	for (i = 0; i < num; i++) {
+		rc = gea_keystream(gp, frames[i].ks, frames[i].crypt_len,
+				   frames[i].nu, frames[i].oc,
+				   GPRS_CIPH_SGSN2MS);
+		if (rc < 0)
+			return rc;
+	}
 	return 0;
 }
 
-/* Transmit a UI frame over the given SAPI:
-   'encryptable' indicates whether particular message can be encrypted according
-   to 3GPP TS 24.008 § 4.7.1.2
- */
-int gprs_llc_tx_ui(struct msgb *msg, uint8_t sapi, int command,
-		   struct sgsn_mm_ctx *mmctx, bool encryptable)
+/* Compute the FCS of a UI frame with the E bit already set and encrypt the
+ * information field + FCS with the given keystream, in a single pass over
+ * the frame */
+static void gea_encrypt_ui(uint8_t *llch, unsigned int hdr_len, uint8_t *fcs,
+			   const uint8_t *ks)
 {
-	struct gprs_llc_lle *lle;
-	uint8_t *fcs, *llch;
-	uint8_t addr, ctrl[2];
-	uint32_t fcs_calc;
-	uint16_t nu = 0;
-	uint32_t oc;
-
-	/* Identifiers from UP: (TLLI, SAPI) + (BVCI, NSEI) */
+	uint8_t *info = llch + hdr_len;
+	unsigned int info_len = fcs - info;
+	unsigned int off, n;
+	uint32_t crc;
+
+	crc = crc24_calc(INIT_CRC24, llch, hdr_len);
+	for (off = 0; off < info_len; off += n) {
+		n = OSMO_MIN(info_len - off, GEA_FUSE_BLOCK);
+		crc = crc24_calc(crc, info + off, n);
+		gea_xor(info + off, ks + off, n);
+	}
 
-	/* look-up or create the LL Entity for this (TLLI, SAPI) tuple */
-	lle = gprs_lle_get_or_create(msgb_tlli(msg), sapi);
+	crc = ~crc & 0xffffff;
+	fcs[0] = (crc & 0xff) ^ ks[info_len];
+	fcs[1] = ((crc >> 8) & 0xff) ^ ks[info_len + 1];
+	fcs[2] = ((crc >> 16) & 0xff) ^ ks[info_len + 2];
+}
 
-	if (msg->len > lle->params.n201_u) {
-		LOGP(DLLC, LOGL_ERROR, "Cannot Tx %u bytes (N201-U=%u)\n",
-			msg->len, lle->params.n201_u);
-		msgb_free(msg);
-		return -EFBIG;
+/* Decrypt the information field + FCS of a received UI frame and compute
+ * the FCS over the first crc_len bytes of the decrypted frame on the way.
+ * Returns the FCS or a negative error. */
+static int gea_decrypt_ui(struct gprs_llc_lle *lle, uint8_t *llch,
+			  unsigned int hdr_len, unsigned int info_len,
+			  unsigned int crc_len, uint16_t nu, uint32_t oc,
+			  uint8_t sapi)
+{
+	uint8_t ks[GSM0464_CIPH_MAX_BLOCK];
+	uint8_t *info = llch + hdr_len;
+	unsigned int crc_info_len = crc_len - hdr_len;
+	struct gea_params gp;
+	unsigned int off, n;
+	uint32_t crc;
+	int rc;
+
+	gea_params_get(&gp, lle->llme, sapi);
+	rc = gea_keystream(&gp, ks, info_len + 3, nu, oc, GPRS_CIPH_MS2SGSN);
+	if (rc < 0)
+		return gea_error(gp.algo, rc);
+
+	crc = crc24_calc(INIT_CRC24, llch, hdr_len);
+	for (off = 0; off < info_len + 3; off += n) {
+		n = OSMO_MIN(info_len + 3 - off, GEA_FUSE_BLOCK);
+		gea_xor(info + off, ks + off, n);
+		if (off < crc_info_len)
+			crc = crc24_calc(crc, info + off,
+					 OSMO_MIN(n, crc_info_len - off));
 	}
 
-	gprs_llme_copy_key(mmctx, lle->llme);
+	return ~crc & 0xffffff;
+}
 
-	/* Update LLE's (BVCI, NSEI) tuple */
-	lle->llme->bvci = msgb_bvci(msg);
-	lle->llme->nsei = msgb_nsei(msg);
+/* Prepend the UI frame header to msg and append room for the FCS */
+static void llc_ui_frame_prepare(struct gprs_llc_lle *lle, struct msgb *msg,
+				 uint8_t sapi, int command, bool encrypt,
+				 struct llc_ui_frame *frame)
+{
+	uint8_t addr, ctrl[2];
+	uint16_t nu;
+
+	/* information field + FCS */
+	frame->crypt_len = msgb_length(msg) + 3;
 
 	/* Obtain current values for N(u) and OC */
 	nu = lle->vu_send;
-	oc = lle->oc_ui_send;
+	frame->nu = nu;
+	frame->oc = lle->oc_ui_send;
 	/* Increment V(U) */
 	lle->vu_send = (lle->vu_send + 1) % 512;
 	/* Increment Overflow Counter, if needed */
@@ -778,35 +985,294 @@ int gprs_llc_tx_ui(struct msgb *msg, uint8_t sapi, int command,
 	ctrl[0] |= nu >> 6;
 	ctrl[1] = (nu << 2) & 0xfc;
 	ctrl[1] |= 0x01; /* Protected Mode */
+	if (encrypt)
+		ctrl[1] |= 0x02; /* Encrypted */
 
 	/* prepend LLC UI header */
-	llch = msgb_push(msg, 3);
-	llch[0] = addr;
-	llch[1] = ctrl[0];
-	llch[2] = ctrl[1];
+	frame->llch = msgb_push(msg, 3);
+	frame->llch[0] = addr;
+	frame->llch[1] = ctrl[0];
+	frame->llch[2] = ctrl[1];
 
 	/* append FCS to end of frame */
-	fcs = msgb_put(msg, 3);
-	fcs_calc = gprs_llc_fcs(llch, fcs - llch);
-	fcs[0] = fcs_calc & 0xff;
-	fcs[1] = (fcs_calc >> 8) & 0xff;
-	fcs[2] = (fcs_calc >> 16) & 0xff;
+	frame->fcs = msgb_put(msg, 3);
+}
 
-	if (lle->llme->algo != GPRS_ALGO_GEA0 && encryptable) {
-		int rc = apply_gea(lle, fcs - llch, nu, oc, sapi, fcs, llch);
-		if (rc < 0) {
-			msgb_free(msg);
-			return rc;
+/* Compute the FCS of the prepared UI frames, encrypt information field +
+ * FCS with the keystreams if needed, and pass them to the downlink
+ * scheduler. All frames are done before the first one is passed on, so
+ * the keystreams are not needed any more by then. The frames are numbered
+ * already, so keep going if one of them can't be sent. */
+static int llc_ui_burst_send(struct gprs_llc_llme *llme, struct msgb **msgs,
+			     struct llc_ui_frame *frames, unsigned int num,
+			     bool encrypt, bool prio,
+			     const struct bssgp_dl_ud_par *dup)
+{
+	uint32_t fcs_calc;
+	unsigned int i;
+	int rc = 0;
+
+	for (i = 0; i < num; i++) {
+		if (encrypt) {
+			gea_encrypt_ui(frames[i].llch, 3, frames[i].fcs,
+				       frames[i].ks);
+		} else {
+			fcs_calc = gprs_llc_fcs(frames[i].llch,
+						frames[i].fcs - frames[i].llch);
+			frames[i].fcs[0] = fcs_calc & 0xff;
+			frames[i].fcs[1] = (fcs_calc >> 8) & 0xff;
+			frames[i].fcs[2] = (fcs_calc >> 16) & 0xff;
 		}
 	}
 
-	rate_ctr_inc(&sgsn->rate_ctrs->ctr[CTR_LLC_DL_PACKETS]);
-	rate_ctr_add(&sgsn->rate_ctrs->ctr[CTR_LLC_DL_BYTES], msg->len);
+	for (i = 0; i < num; i++) {
+		uint32_t tlli = msgb_tlli(msgs[i]);
+		uint8_t sapi = frames[i].llch[0] & 0xf;
+		unsigned int len;
+		int tx_rc;
+
+		/* Identifiers passed down: (BVCI, NSEI) */
+		rate_ctr_inc(&sgsn->rate_ctrs->ctr[CTR_LLC_DL_PACKETS]);
+		rate_ctr_add(&sgsn->rate_ctrs->ctr[CTR_LLC_DL_BYTES],
+			     msgs[i]->len);
+		len = msgs[i]->len;
+		tx_rc = gprs_dl_sched_tx(llme, msgs[i], sapi, dup, prio);
+		if (tx_rc < 0 && rc == 0)
+			rc = tx_rc;
+		gprs_trace_pkt(GPRS_TRACE_LLC_DL,
+			       tx_rc < 0 ? GPRS_TRACE_V_DROPPED : GPRS_TRACE_V_OK,
+			       tlli, sapi, GPRS_TRACE_NO_ID,
+			       frames[i].nu, len);
+	}
+	return rc;
+}
 
-	/* Identifiers passed down: (BVCI, NSEI) */
+/* A burst of UI frames whose keystreams are generated on an offload
+ * worker. Everything the worker and the completion need is copied in,
+ * the MM context may be gone by the time the burst returns. */
+struct llc_ui_burst_job {
+	struct gprs_offload_job job;
+	/* entry in lle->tx_jobs */
+	struct llist_head list;
+	/* NULL once the LLE has been freed */
+	struct gprs_llc_lle *lle;
+	struct gea_params gp;
+	bool encrypt;
+	bool prio;
+	int rc;
 
-	/* Send BSSGP-DL-UNITDATA.req */
-	return _bssgp_tx_dl_ud(msg, mmctx);
+	struct bssgp_dl_ud_par dup;
+	char imsi[GSM23003_IMSI_MAX_DIGITS+1];
+	uint8_t ms_ra_cap[sizeof(((struct sgsn_mm_ctx *)0)->ms_radio_access_capa.buf)];
+
+	unsigned int num;
+	struct msgb *msgs[GPRS_LLC_UI_BURST_MAX];
+	struct llc_ui_frame frames[GPRS_LLC_UI_BURST_MAX];
+	uint8_t ks[0];
+};
+
+static void llc_ui_burst_work(struct gprs_offload_job *job)
+{
+	struct llc_ui_burst_job *bj = container_of(job, struct llc_ui_burst_job, job);
+
+	bj->rc = gea_keystream_burst(&bj->gp, bj->frames, bj->num);
+}
+
+static void llc_ui_burst_done(struct gprs_offload_job *job)
+{
+	struct llc_ui_burst_job *bj = container_of(job, struct llc_ui_burst_job, job);
+	unsigned int i;
+
+	if (!bj->lle) {
+		for (i = 0; i < bj->num; i++)
+			msgb_free(bj->msgs[i]);
+	} else if (bj->rc < 0) {
+		llist_del(&bj->list);
+		gea_error(bj->gp.algo, bj->rc);
+		for (i = 0; i < bj->num; i++)
+			msgb_free(bj->msgs[i]);
+	} else {
+		llist_del(&bj->list);
+		llc_ui_burst_send(bj->lle->llme, bj->msgs, bj->frames, bj->num,
+				  bj->encrypt, bj->prio, &bj->dup);
+	}
+	talloc_free(bj);
+}
+
+static void llc_ui_burst_jobs_cancel(struct gprs_llc_lle *lle)
+{
+	struct llc_ui_burst_job *bj, *bj2;
+
+	llist_for_each_entry_safe(bj, bj2, &lle->tx_jobs, list) {
+		llist_del(&bj->list);
+		bj->lle = NULL;
+	}
+}
+
+/* Hand the prepared frames to an offload worker. The msgbs are only
+ * consumed on success. Jobs of one LLME go to the same worker, which
+ * keeps them in the order of N(U). */
+static int llc_ui_burst_offload(struct gprs_llc_lle *lle, struct msgb **msgs,
+				const struct llc_ui_frame *frames,
+				unsigned int num, bool encrypt, bool prio,
+				const struct bssgp_dl_ud_par *dup)
+{
+	struct llc_ui_burst_job *bj;
+	size_t ks_len = 0;
+	unsigned int i;
+	int rc;
+
+	if (encrypt) {
+		for (i = 0; i < num; i++)
+			ks_len += frames[i].crypt_len;
+	}
+
+	bj = talloc_size(llc_tall_ctx, sizeof(*bj) + ks_len);
+	if (!bj)
+		return -ENOMEM;
+	talloc_set_name_const(bj, "struct llc_ui_burst_job");
+
+	bj->job.work = encrypt ? llc_ui_burst_work : NULL;
+	bj->job.done = llc_ui_burst_done;
+	bj->lle = lle;
+	gea_params_get(&bj->gp, lle->llme, lle->sapi);
+	bj->encrypt = encrypt;
+	bj->prio = prio;
+	bj->rc = 0;
+
+	bj->dup = *dup;
+	if (dup->imsi) {
+		osmo_strlcpy(bj->imsi, dup->imsi, sizeof(bj->imsi));
+		bj->dup.imsi = bj->imsi;
+	}
+	if (dup->ms_ra_cap.v) {
+		memcpy(bj->ms_ra_cap, dup->ms_ra_cap.v,
+		       OSMO_MIN(dup->ms_ra_cap.len, sizeof(bj->ms_ra_cap)));
+		bj->dup.ms_ra_cap.v = bj->ms_ra_cap;
+	}
+
+	bj->num = num;
+	ks_len = 0;
+	for (i = 0; i < num; i++) {
+		bj->msgs[i] = msgs[i];
+		bj->frames[i] = frames[i];
+		if (encrypt) {
+			bj->frames[i].ks = bj->ks + ks_len;
+			ks_len += frames[i].crypt_len;
+		}
+	}
+
+	rc = gprs_offload_post(&bj->job, (uintptr_t)lle->llme >> 4);
+	if (rc < 0) {
+		talloc_free(bj);
+		return rc;
+	}
+	llist_add_tail(&bj->list, &lle->tx_jobs);
+	return 0;
+}
+
+/* Transmit a UI frame over the given SAPI:
+   'encryptable' indicates whether particular message can be encrypted according
+   to 3GPP TS 24.008 § 4.7.1.2
+   Signalling is sent ahead of the bulk data queued for the cell, except
+   for that of the same LLE.
+ */
+int gprs_llc_tx_ui(struct msgb *msg, uint8_t sapi, int command,
+		   struct sgsn_mm_ctx *mmctx, bool encryptable)
+{
+	return gprs_llc_tx_ui_burst(&msg, 1, sapi, command, mmctx, encryptable,
+				    true);
+}
+
+/* Transmit a burst of UI frames for the same TLLI over the given SAPI, like
+ * the fragments of one N-PDU. The frames are numbered in order and their
+ * keystreams are generated together, on an offload worker if there are
+ * any. With 'prio', the frames go to the priority queue of the downlink
+ * scheduler, unless bulk frames of the LLE are still queued. All msgbs are
+ * consumed, also on error. */
+int gprs_llc_tx_ui_burst(struct msgb **msgs, unsigned int num, uint8_t sapi,
+			 int command, struct sgsn_mm_ctx *mmctx,
+			 bool encryptable, bool prio)
+{
+	struct llc_ui_frame frames[GPRS_LLC_UI_BURST_MAX];
+	struct bssgp_dl_ud_par dup;
+	struct gea_params gp;
+	struct gprs_llc_lle *lle;
+	unsigned int i;
+	bool encrypt;
+	int rc = 0;
+
+	OSMO_ASSERT(num > 0 && num <= GPRS_LLC_UI_BURST_MAX);
+
+	/* Identifiers from UP: (TLLI, SAPI) + (BVCI, NSEI) */
+
+	/* look-up or create the LL Entity for this (TLLI, SAPI) tuple */
+	lle = gprs_lle_get_or_create(msgb_tlli(msgs[0]), sapi);
+	if (!lle) {
+		rc = -ENOMEM;
+		goto free_all;
+	}
+
+	for (i = 0; i < num; i++) {
+		/* the largest N201-U also bounds the keystream slots */
+		if (msgs[i]->len > lle->params.n201_u
+		    || msgs[i]->len + 3 > GSM0464_CIPH_MAX_BLOCK) {
+			LOGP(DLLC, LOGL_ERROR, "Cannot Tx %u bytes (N201-U=%u)\n",
+				msgs[i]->len, lle->params.n201_u);
+			rc = -EFBIG;
+			goto free_all;
+		}
+	}
+
+	rc = llc_dl_ud_par(&dup, msgb_tlli(msgs[0]), mmctx);
+	if (rc < 0)
+		goto free_all;
+
+	gprs_llme_copy_key(mmctx, lle->llme);
+	encrypt = lle->llme->algo != GPRS_ALGO_GEA0 && encryptable;
+
+	/* Update LLE's (BVCI, NSEI) tuple */
+	lle->llme->bvci = msgb_bvci(msgs[num - 1]);
+	lle->llme->nsei = msgb_nsei(msgs[num - 1]);
+
+	for (i = 0; i < num; i++) {
+		llc_ui_frame_prepare(lle, msgs[i], sapi, command, encrypt,
+				     &frames[i]);
+		frames[i].ks = NULL;
+	}
+
+	/* Unencrypted frames only take the detour to stay behind the ones
+	 * that are still on a worker */
+	if (gprs_offload_workers() > 0
+	    && (encrypt || !llist_empty(&lle->tx_jobs))) {
+		rc = llc_ui_burst_offload(lle, msgs, frames, num, encrypt,
+					  prio, &dup);
+		if (rc == 0)
+			return 0;
+		/* Can't overtake the frames on the worker */
+		if (!llist_empty(&lle->tx_jobs))
+			goto free_all;
+	}
+
+	if (encrypt) {
+		for (i = 0; i < num; i++)
+			frames[i].ks = llc_ui_burst_ks[i];
+
+		gea_params_get(&gp, lle->llme, sapi);
+		rc = gea_keystream_burst(&gp, frames, num);
+		if (rc < 0) {
+			rc = gea_error(gp.algo, rc);
+			goto free_all;
+		}
+	}
+
+	return llc_ui_burst_send(lle->llme, msgs, frames, num, encrypt, prio,
+				 &dup);
+
+free_all:
+	for (i = 0; i < num; i++)
+		msgb_free(msgs[i]);
+	return rc;
 }
 
 static int gprs_llc_hdr_rx(struct gprs_llc_hdr_parsed *gph,
@@ -891,10 +1357,21 @@ static int gprs_llc_hdr_rx(struct gprs_llc_hdr_parsed *gph,
 	return 0;
 }
 
+static void llc_trace_ul(const struct msgb *msg,
+			 const struct gprs_llc_hdr_parsed *gph,
+			 unsigned int len, enum gprs_trace_verdict verdict)
+{
+	gprs_trace_pkt(GPRS_TRACE_LLC_UL, verdict, msgb_tlli(msg), gph->sapi,
+		       GPRS_TRACE_NO_ID,
+		       gph->cmd == GPRS_LLC_UI ? gph->seq_tx : GPRS_TRACE_NO_NU,
+		       len);
+}
+
 /* receive an incoming LLC PDU (BSSGP-UL-UNITDATA-IND, 7.2.4.2) */
 int gprs_llc_rcvmsg(struct msgb *msg, struct tlv_parsed *tv)
 {
 	struct gprs_llc_hdr *lh = (struct gprs_llc_hdr *) msgb_llch(msg);
+	unsigned int len = TLVP_LEN(tv, BSSGP_IE_LLC_PDU);
 	struct gprs_llc_hdr_parsed llhp;
 	struct gprs_llc_lle *lle = NULL;
 	bool drop_cipherable = false;
@@ -903,9 +1380,11 @@ int gprs_llc_rcvmsg(struct msgb *msg, struct tlv_parsed *tv)
 	/* Identifiers from DOWN: NSEI, BVCI, TLLI */
 
 	memset(&llhp, 0, sizeof(llhp));
-	rc = gprs_llc_hdr_parse(&llhp, (uint8_t *) lh, TLVP_LEN(tv, BSSGP_IE_LLC_PDU));
+	rc = gprs_llc_hdr_parse(&llhp, (uint8_t *) lh, len);
 	if (rc < 0) {
 		LOGP(DLLC, LOGL_NOTICE, "Error during LLC header parsing\n");
+		llhp.sapi = GPRS_TRACE_NO_ID;
+		llc_trace_ul(msg, &llhp, len, GPRS_TRACE_V_INVALID);
 		return rc;
 	}
 
@@ -924,6 +1403,7 @@ int gprs_llc_rcvmsg(struct msgb *msg, struct tlv_parsed *tv)
 	/* find the LLC Entity for this TLLI+SAPI tuple */
 	lle = lle_for_rx_by_tlli_sapi(msgb_tlli(msg), llhp.sapi, llhp.cmd);
 	if (!lle) {
+		llc_trace_ul(msg, &llhp, len, GPRS_TRACE_V_NO_CTX);
 		switch (llhp.sapi) {
 		case GPRS_SAPI_SNDCP3:
 		case GPRS_SAPI_SNDCP5:
@@ -938,34 +1418,41 @@ int gprs_llc_rcvmsg(struct msgb *msg, struct tlv_parsed *tv)
 	}
 	gprs_llc_hdr_dump(&llhp, lle);
 	/* reset age computation */
-	lle->llme->age_timestamp = GPRS_LLME_RESET_AGE;
+	llme_touch(lle->llme);
 
-	/* decrypt information field + FCS, if needed! */
+	/* decrypt information field + FCS, if needed! We have to do the FCS
+	 * check _after_ decryption, both happen in the same pass. */
 	if (llhp.is_encrypted) {
 		if (lle->llme->algo != GPRS_ALGO_GEA0) {
-			rc = apply_gea(lle, llhp.data_len + 3, llhp.seq_tx,
-				       lle->oc_ui_recv, lle->sapi, NULL,
-				       llhp.data);
-			if (rc < 0)
+			rc = gea_decrypt_ui(lle, (uint8_t *)lh,
+					    llhp.data - (uint8_t *)lh,
+					    llhp.data_len, llhp.crc_length,
+					    llhp.seq_tx, lle->oc_ui_recv,
+					    lle->sapi);
+			if (rc < 0) {
+				llc_trace_ul(msg, &llhp, len, GPRS_TRACE_V_CIPHER);
 				return rc;
-		llhp.fcs = *(llhp.data + llhp.data_len);
-		llhp.fcs |= *(llhp.data + llhp.data_len + 1) << 8;
-		llhp.fcs |= *(llhp.data + llhp.data_len + 2) << 16;
+			}
+			llhp.fcs_calc = rc;
+			llhp.fcs = *(llhp.data + llhp.data_len);
+			llhp.fcs |= *(llhp.data + llhp.data_len + 1) << 8;
+			llhp.fcs |= *(llhp.data + llhp.data_len + 2) << 16;
 		} else {
 			LOGP(DLLC, LOGL_NOTICE, "encrypted frame for LLC that "
 				"has no KC/Algo! Dropping.\n");
+			llc_trace_ul(msg, &llhp, len, GPRS_TRACE_V_CIPHER);
 			return 0;
 		}
 	} else {
 		if (lle->llme->algo != GPRS_ALGO_GEA0 &&
 		    lle->llme->cksn != GSM_KEY_SEQ_INVAL)
 			drop_cipherable = true;
+		llhp.fcs_calc = gprs_llc_fcs((uint8_t *)lh, llhp.crc_length);
 	}
 
-	/* We have to do the FCS check _after_ decryption */
-	llhp.fcs_calc = gprs_llc_fcs((uint8_t *)lh, llhp.crc_length);
 	if (llhp.fcs != llhp.fcs_calc) {
 		LOGP(DLLC, LOGL_INFO, "Dropping frame with invalid FCS\n");
+		llc_trace_ul(msg, &llhp, len, GPRS_TRACE_V_FCS);
 		return -EIO;
 	}
 
@@ -975,8 +1462,11 @@ int gprs_llc_rcvmsg(struct msgb *msg, struct tlv_parsed *tv)
 
 	/* Receive and Process the actual LLC frame */
 	rc = gprs_llc_hdr_rx(&llhp, lle);
-	if (rc < 0)
+	if (rc < 0) {
+		llc_trace_ul(msg, &llhp, len, GPRS_TRACE_V_DUP);
 		return rc;
+	}
+	llc_trace_ul(msg, &llhp, len, GPRS_TRACE_V_OK);
 
 	/* there are many frame types that don't carry user information
 	 * and which hence have llhp.data = NULL */
@@ -1049,17 +1539,17 @@ int gprs_llgmm_assign(struct gprs_llc_llme *llme,
 		 * old is unassigned.  Only TLLI new shall be accepted when
 		 * received from peer. */
 		if (llme->old_tlli != 0xffffffff) {
-			llme->old_tlli = 0xffffffff;
-			llme->tlli = new_tlli;
+			llme_set_tlli(llme, new_tlli, 0xffffffff);
 		} else {
 			/* If TLLI old == 0xffffffff was assigned to LLME, then this is
 			 * TLLI assignmemt according to 8.3.1 */
-			llme->old_tlli = 0xffffffff;
-			llme->tlli = new_tlli;
+			llme_set_tlli(llme, new_tlli, 0xffffffff);
 			llme->state = GPRS_LLMS_ASSIGNED;
 			/* 8.5.3.1 For all LLE's */
 			for (i = 0; i < ARRAY_SIZE(llme->lle); i++) {
-				struct gprs_llc_lle *l = &llme->lle[i];
+				struct gprs_llc_lle *l = llme->lle[i];
+				if (!l)
+					continue;
 				l->vu_send = l->vu_recv = 0;
 				l->retrans_ctr = 0;
 				l->state = GPRS_LLES_ASSIGNED_ADM;
@@ -1070,16 +1560,16 @@ int gprs_llgmm_assign(struct gprs_llc_llme *llme,
 		/* TLLI Change 8.3.2 */
 		/* Both TLLI Old and TLLI New are assigned; use New when
 		 * (re)transmitting.  Accept both Old and New on Rx */
-		llme->old_tlli = old_tlli;
-		llme->tlli = new_tlli;
+		llme_set_tlli(llme, new_tlli, old_tlli);
 		llme->state = GPRS_LLMS_ASSIGNED;
 	} else if (old_tlli != 0xffffffff && new_tlli == 0xffffffff) {
 		/* TLLI Unassignment 8.3.3) */
 		llme->tlli = llme->old_tlli = 0;
 		llme->state = GPRS_LLMS_UNASSIGNED;
 		for (i = 0; i < ARRAY_SIZE(llme->lle); i++) {
-			struct gprs_llc_lle *l = &llme->lle[i];
-			l->state = GPRS_LLES_UNASSIGNED;
+			struct gprs_llc_lle *l = llme->lle[i];
+			if (l)
+				l->state = GPRS_LLES_UNASSIGNED;
 		}
 		llme_free(llme);
 	} else
@@ -1097,12 +1587,15 @@ int gprs_llgmm_unassign(struct gprs_llc_llme *llme)
 /* Chapter 7.2.1.2 LLGMM-RESET.req */
 int gprs_llgmm_reset(struct gprs_llc_llme *llme)
 {
-	struct msgb *msg = msgb_alloc_headroom(4096, 1024, "LLC_XID");
-	struct gprs_llc_lle *lle = &llme->lle[1];
+	struct gprs_llc_lle *lle = gprs_llme_lle(llme, 1);
 	uint8_t xid_bytes[1024];
 	int xid_bytes_len, rc;
+	struct msgb *msg;
 	uint8_t *xid;
 
+	if (!lle)
+		return -ENOMEM;
+
 	LOGP(DLLC, LOGL_NOTICE, "LLGM Reset\n");
 
 	rc = osmo_get_rand_id((uint8_t *) &llme->iov_ui, 4);
@@ -1116,6 +1609,9 @@ int gprs_llgmm_reset(struct gprs_llc_llme *llme)
 							    llme->iov_ui, lle);
 	if (xid_bytes_len < 0)
 		return -EINVAL;
+	msg = llc_ctrl_msgb_alloc(xid_bytes_len, "LLC_XID");
+	if (!msg)
+		return -ENOMEM;
 	xid = msgb_put(msg, xid_bytes_len);
 	memcpy(xid, xid_bytes, xid_bytes_len);
 
@@ -1132,12 +1628,15 @@ int gprs_llgmm_reset(struct gprs_llc_llme *llme)
 int gprs_llgmm_reset_oldmsg(struct msgb* oldmsg, uint8_t sapi,
 			    struct gprs_llc_llme *llme)
 {
-	struct msgb *msg = msgb_alloc_headroom(4096, 1024, "LLC_XID");
-	struct gprs_llc_lle *lle = &llme->lle[sapi];
+	struct gprs_llc_lle *lle = gprs_llme_lle(llme, sapi);
 	uint8_t xid_bytes[1024];
 	int xid_bytes_len, rc;
+	struct msgb *msg;
 	uint8_t *xid;
 
+	if (!lle)
+		return -ENOMEM;
+
 	LOGP(DLLC, LOGL_NOTICE, "LLGM Reset\n");
 
 	rc = osmo_get_rand_id((uint8_t *) &llme->iov_ui, 4);
@@ -1151,6 +1650,9 @@ int gprs_llgmm_reset_oldmsg(struct msgb* oldmsg, uint8_t sapi,
 							    llme->iov_ui, lle);
 	if (xid_bytes_len < 0)
 		return -EINVAL;
+	msg = llc_ctrl_msgb_alloc(xid_bytes_len, "LLC_XID");
+	if (!msg)
+		return -ENOMEM;
 	xid = msgb_put(msg, xid_bytes_len);
 	memcpy(xid, xid_bytes, xid_bytes_len);
 
@@ -88,7 +88,9 @@ static void vty_dump_llme(struct vty *vty, struct gprs_llc_llme *llme)
 		if (sapi >= ARRAY_SIZE(llme->lle))
 			continue;
 
-		lle = &llme->lle[sapi];
+		lle = llme->lle[sapi];
+		if (!lle)
+			continue;
 		vty_dump_lle(vty, lle);
 	}
 }
@@ -107,9 +109,39 @@ DEFUN(show_llc, show_llc_cmd,
 	return CMD_SUCCESS;
 }
 
+DEFUN(show_llc_memory, show_llc_memory_cmd,
+	"show llc memory",
+	SHOW_STR "Display information about the LLC protocol\n"
+	"Display the memory used by LLMEs and LLEs\n")
+{
+	struct gprs_llc_llme *llme;
+	unsigned int num_llme = 0, num_lle = 0, i;
+	size_t total;
+
+	llist_for_each_entry(llme, &gprs_llc_llmes, list) {
+		num_llme++;
+		for (i = 0; i < ARRAY_SIZE(llme->lle); i++) {
+			if (llme->lle[i])
+				num_lle++;
+		}
+	}
+
+	total = num_llme * sizeof(struct gprs_llc_llme) +
+		num_lle * sizeof(struct gprs_llc_lle);
+
+	vty_out(vty, "LLMEs: %u of %zu bytes%s", num_llme,
+		sizeof(struct gprs_llc_llme), VTY_NEWLINE);
+	vty_out(vty, "LLEs: %u of %zu bytes, %u possible%s", num_lle,
+		sizeof(struct gprs_llc_lle), num_llme * NUM_SAPIS, VTY_NEWLINE);
+	vty_out(vty, "Total: %zu bytes, %zu bytes per LLME%s", total,
+		num_llme ? total / num_llme : 0, VTY_NEWLINE);
+	return CMD_SUCCESS;
+}
+
 int gprs_llc_vty_init(void)
 {
 	install_element_ve(&show_llc_cmd);
+	install_element_ve(&show_llc_memory_cmd);
 
 	return 0;
 }
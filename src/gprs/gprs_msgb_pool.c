@@ -0,0 +1,209 @@
+/* Size-class pools of msgbs for the user data path */
+
+/* (C) 2026 by sysmocom s.f.m.c. GmbH <info@sysmocom.de>
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Every N-PDU and every SN-PDU fragment on the downlink, and every N-PDU
+ * reassembled on the uplink, lives in a msgb of its own. Most of them are
+ * freed in libosmogb once NS has sent them, so the pools can not rely on
+ * a free function of their own: a talloc destructor on the pooled msgbs
+ * puts them back on the free list of their size class and keeps talloc
+ * from releasing the memory.
+ *
+ * That only works for msgbs that are freed on their own. All pooled msgbs
+ * are children of one context, whose destructor switches the pools off
+ * before talloc goes on to free them. So freeing a parent, like the msgb
+ * context at shutdown, releases them instead of making talloc fail. */
+
+#include <string.h>
+
+#include <osmocom/core/msgb.h>
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/utils.h>
+
+#include <osmocom/sgsn/gprs_msgb_pool.h>
+
+#define MSGB_POOL(idx, sz, max) [idx] = { \
+		.name = "msgb " #sz, \
+		.size = sz, \
+		.max_cached = max, \
+		.free_list = LLIST_HEAD_INIT(msgb_pools[idx].free_list), \
+	}
+
+/* in ascending order of size */
+static struct gprs_msgb_pool msgb_pools[] = {
+	MSGB_POOL(0, 256, 1024),
+	MSGB_POOL(1, 2048, 512),
+	MSGB_POOL(2, 4096, 128),
+};
+
+unsigned long long gprs_msgb_pool_oversize;
+
+/* parent of all pooled msgbs, in use or cached */
+static void *msgb_pool_ctx;
+
+static struct gprs_msgb_pool *msgb_pool_by_size(unsigned int size)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(msgb_pools); i++) {
+		if (size <= msgb_pools[i].size)
+			return &msgb_pools[i];
+	}
+	return NULL;
+}
+
+static int msgb_pool_destructor(struct msgb *msg)
+{
+	struct gprs_msgb_pool *pool = msgb_pool_by_size(msg->data_len);
+
+	OSMO_ASSERT(pool && pool->size == msg->data_len);
+	OSMO_ASSERT(pool->stats.in_use > 0);
+	pool->stats.in_use--;
+
+	/* the pool context is going away with all its msgbs */
+	if (!msgb_pool_ctx || pool->stats.cached >= pool->max_cached)
+		return 0;
+
+	talloc_free_children(msg);
+	llist_add(&msg->list, &pool->free_list);
+	pool->stats.cached++;
+	/* keep talloc from freeing it */
+	return -1;
+}
+
+static void msgb_pools_free_cached(void)
+{
+	struct gprs_msgb_pool *pool;
+	struct msgb *msg, *msg2;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(msgb_pools); i++) {
+		pool = &msgb_pools[i];
+		llist_for_each_entry_safe(msg, msg2, &pool->free_list, list) {
+			llist_del(&msg->list);
+			talloc_set_destructor(msg, NULL);
+			talloc_free(msg);
+		}
+		pool->stats.cached = 0;
+	}
+}
+
+/* Runs before talloc frees the pooled msgbs along with the context */
+static int msgb_pool_ctx_destructor(void *ctx)
+{
+	msgb_pools_free_cached();
+	msgb_pool_ctx = NULL;
+	return 0;
+}
+
+/* Return an empty msgb with room for at least size bytes, or NULL if no
+ * msgb can be that large. It is freed with msgb_free() like any other
+ * msgb. */
+struct msgb *gprs_msgb_alloc(unsigned int size, const char *name)
+{
+	struct gprs_msgb_pool *pool;
+	struct msgb *msg;
+
+	if (size > UINT16_MAX)
+		return NULL;
+
+	pool = msgb_pool_by_size(size);
+	if (!pool) {
+		gprs_msgb_pool_oversize++;
+		return msgb_alloc(size, name);
+	}
+
+	if (!llist_empty(&pool->free_list)) {
+		msg = llist_entry(pool->free_list.next, struct msgb, list);
+		llist_del(&msg->list);
+		pool->stats.cached--;
+		pool->stats.hits++;
+
+		/* the same as msgb_alloc() does */
+		memset(msg, 0, sizeof(*msg));
+		msg->data_len = pool->size;
+		msg->head = msg->_data;
+		msg->data = msg->_data;
+		msg->tail = msg->_data;
+		talloc_set_name_const(msg, name);
+	} else {
+		msg = msgb_alloc(pool->size, name);
+		if (!msg)
+			return NULL;
+		if (!msgb_pool_ctx) {
+			msgb_pool_ctx = talloc_named_const(talloc_parent(msg), 0,
+							   "msgb pools");
+			if (!msgb_pool_ctx) {
+				msgb_free(msg);
+				return NULL;
+			}
+			talloc_set_destructor(msgb_pool_ctx,
+					      msgb_pool_ctx_destructor);
+		}
+		talloc_steal(msgb_pool_ctx, msg);
+	}
+	talloc_set_destructor(msg, msgb_pool_destructor);
+
+	pool->stats.allocs++;
+	pool->stats.in_use++;
+	if (pool->stats.in_use > pool->stats.in_use_peak)
+		pool->stats.in_use_peak = pool->stats.in_use;
+
+	return msg;
+}
+
+struct msgb *gprs_msgb_alloc_headroom(unsigned int size, unsigned int headroom,
+				      const char *name)
+{
+	struct msgb *msg;
+
+	OSMO_ASSERT(size >= headroom);
+
+	msg = gprs_msgb_alloc(size, name);
+	if (msg)
+		msgb_reserve(msg, headroom);
+	return msg;
+}
+
+unsigned int gprs_msgb_pools_num(void)
+{
+	return ARRAY_SIZE(msgb_pools);
+}
+
+const struct gprs_msgb_pool *gprs_msgb_pool_get(unsigned int idx)
+{
+	if (idx >= ARRAY_SIZE(msgb_pools))
+		return NULL;
+	return &msgb_pools[idx];
+}
+
+/* Give all cached msgbs back to the system, and the pool context as well
+ * if no pooled msgb is in use */
+void gprs_msgb_pools_flush(void)
+{
+	unsigned int i;
+
+	msgb_pools_free_cached();
+
+	for (i = 0; i < ARRAY_SIZE(msgb_pools); i++) {
+		if (msgb_pools[i].stats.in_use)
+			return;
+	}
+	TALLOC_FREE(msgb_pool_ctx);
+}
@@ -0,0 +1,113 @@
+/* Typed object pools for frequently allocated SGSN objects */
+
+/* (C) 2026 by sysmocom s.f.m.c. GmbH <info@sysmocom.de>
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <string.h>
+
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/utils.h>
+
+#include <osmocom/sgsn/gprs_obj_pool.h>
+
+static LLIST_HEAD(gprs_obj_pool_list);
+
+struct llist_head *gprs_obj_pools(void)
+{
+	return &gprs_obj_pool_list;
+}
+
+/* Return a zeroed object, it is a talloc chunk below ctx and can carry
+ * talloc children like any other object. Release it with
+ * gprs_obj_pool_free(), never with talloc_free(). */
+void *gprs_obj_pool_alloc(struct gprs_obj_pool *pool, const void *ctx)
+{
+	struct llist_head *entry;
+	void *obj;
+
+	OSMO_ASSERT(pool->obj_size >= sizeof(struct llist_head));
+
+	if (!pool->registered) {
+		llist_add_tail(&pool->list, &gprs_obj_pool_list);
+		pool->registered = true;
+	}
+
+	if (!llist_empty(&pool->free_list)) {
+		entry = pool->free_list.next;
+		llist_del(entry);
+		pool->stats.cached--;
+		pool->stats.hits++;
+
+		obj = entry;
+		talloc_steal(ctx, obj);
+		memset(obj, 0, pool->obj_size);
+	} else {
+		obj = talloc_zero_size(ctx, pool->obj_size);
+		if (!obj)
+			return NULL;
+		talloc_set_name_const(obj, pool->name);
+	}
+
+	pool->stats.allocs++;
+	pool->stats.in_use++;
+	if (pool->stats.in_use > pool->stats.in_use_peak)
+		pool->stats.in_use_peak = pool->stats.in_use;
+
+	return obj;
+}
+
+/* Release an object obtained from gprs_obj_pool_alloc(). Its talloc
+ * children are freed right away, the object itself is kept for reuse
+ * unless the pool already caches max_cached objects. */
+void gprs_obj_pool_free(struct gprs_obj_pool *pool, void *obj)
+{
+	if (!obj)
+		return;
+
+	OSMO_ASSERT(pool->stats.in_use > 0);
+	pool->stats.in_use--;
+
+	if (pool->stats.cached >= pool->max_cached) {
+		talloc_free(obj);
+		return;
+	}
+
+	talloc_free_children(obj);
+	llist_add(obj, &pool->free_list);
+	pool->stats.cached++;
+}
+
+/* Give all cached objects back to the system */
+void gprs_obj_pool_flush(struct gprs_obj_pool *pool)
+{
+	struct llist_head *entry, *tmp;
+
+	llist_for_each_safe(entry, tmp, &pool->free_list) {
+		llist_del(entry);
+		talloc_free(entry);
+	}
+	pool->stats.cached = 0;
+}
+
+void gprs_obj_pools_flush(void)
+{
+	struct gprs_obj_pool *pool;
+
+	llist_for_each_entry(pool, &gprs_obj_pool_list, list)
+		gprs_obj_pool_flush(pool);
+}
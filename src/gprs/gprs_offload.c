@@ -0,0 +1,286 @@
+/* Worker threads for per-frame computations off the main loop */
+
+/* (C) 2026 by sysmocom s.f.m.c. GmbH <info@sysmocom.de>
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+
+#include <osmocom/core/select.h>
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/utils.h>
+
+#include <osmocom/sgsn/debug.h>
+#include <osmocom/sgsn/gprs_offload.h>
+#include <osmocom/sgsn/gprs_spsc_ring.h>
+
+/* Each worker has its own pair of rings, jobs are posted to the worker
+ * selected by their key and come back in the same order. The workers
+ * signal completions through one eventfd that is part of the main
+ * loop. */
+struct offload_worker {
+	pthread_t thread;
+	/* eventfd, wakes the worker up when there are new jobs */
+	int wake_fd;
+	bool stop;
+
+	/* main thread -> worker */
+	struct gprs_spsc_ring todo;
+	void *todo_slots[GPRS_OFFLOAD_QUEUE_LEN];
+	/* worker -> main thread */
+	struct gprs_spsc_ring done;
+	void *done_slots[GPRS_OFFLOAD_QUEUE_LEN];
+
+	/* posted and not yet completed, only used by the main thread. As
+	 * long as it stays below the ring size neither ring can fill up. */
+	unsigned int in_flight;
+};
+
+/* in_flight is limited to GPRS_OFFLOAD_QUEUE_LEN, so a push onto either
+ * ring never finds it full */
+osmo_static_assert(GPRS_OFFLOAD_QUEUE_LEN <=
+		   ARRAY_SIZE(((struct offload_worker *)0)->todo_slots),
+		   offload_todo_ring_size);
+osmo_static_assert(GPRS_OFFLOAD_QUEUE_LEN <=
+		   ARRAY_SIZE(((struct offload_worker *)0)->done_slots),
+		   offload_done_ring_size);
+
+static struct {
+	struct offload_worker *workers;
+	unsigned int num_workers;
+	struct osmo_fd done_ofd;
+} offload = {
+	.done_ofd = { .fd = -1 },
+};
+
+struct gprs_offload_stats gprs_offload_stats;
+
+/* Tell the main thread that there are completed jobs. This runs on the
+ * workers, which must not log. The eventfd is non-blocking and only fails
+ * with EAGAIN once its counter is saturated, the main thread is woken up
+ * already then. */
+static void offload_signal_done(void)
+{
+	uint64_t val = 1;
+
+	if (write(offload.done_ofd.fd, &val, sizeof(val)) < 0)
+		return;
+}
+
+static void *offload_worker_main(void *data)
+{
+	struct offload_worker *w = data;
+	struct gprs_offload_job *job;
+	uint64_t val;
+	bool any, stop, pushed;
+
+	while (1) {
+		/* read before draining, so that all jobs posted before the
+		 * stop request are run */
+		stop = __atomic_load_n(&w->stop, __ATOMIC_ACQUIRE);
+		any = false;
+		while ((job = gprs_spsc_ring_pop(&w->todo))) {
+			if (job->work)
+				job->work(job);
+			/* Can't fail, see in_flight. This thread may not log,
+			 * so should it ever, wait for the main thread to make
+			 * room instead of losing the job. */
+			pushed = gprs_spsc_ring_push(&w->done, job);
+			while (!pushed) {
+				offload_signal_done();
+				sched_yield();
+				pushed = gprs_spsc_ring_push(&w->done, job);
+			}
+			any = true;
+		}
+		if (any)
+			offload_signal_done();
+
+		if (stop)
+			break;
+		/* sleep until the next job is posted, an interrupted read
+		 * only costs another round */
+		if (read(w->wake_fd, &val, sizeof(val)) < 0)
+			continue;
+	}
+
+	return NULL;
+}
+
+/* Run the done() callbacks of all completed jobs, in order per worker */
+static void offload_drain(void)
+{
+	struct gprs_offload_job *job;
+	unsigned int i;
+
+	for (i = 0; i < offload.num_workers; i++) {
+		struct offload_worker *w = &offload.workers[i];
+
+		while ((job = gprs_spsc_ring_pop(&w->done))) {
+			w->in_flight--;
+			gprs_offload_stats.completed++;
+			job->done(job);
+		}
+	}
+}
+
+static int offload_done_cb(struct osmo_fd *ofd, unsigned int what)
+{
+	uint64_t val;
+
+	if (read(ofd->fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		return -errno;
+
+	offload_drain();
+	return 0;
+}
+
+static void offload_worker_stop(struct offload_worker *w)
+{
+	uint64_t val = 1;
+
+	__atomic_store_n(&w->stop, true, __ATOMIC_RELEASE);
+	if (write(w->wake_fd, &val, sizeof(val)) < 0)
+		LOGP(DGPRS, LOGL_ERROR, "Cannot wake offload worker: %s\n",
+		     strerror(errno));
+	pthread_join(w->thread, NULL);
+	close(w->wake_fd);
+}
+
+/* Start the given number of worker threads, 0 to run everything on the
+ * main thread */
+int gprs_offload_start(void *ctx, unsigned int num_workers)
+{
+	unsigned int i;
+	int rc;
+
+	OSMO_ASSERT(offload.num_workers == 0);
+	if (num_workers == 0)
+		return 0;
+	if (num_workers > GPRS_OFFLOAD_MAX_WORKERS)
+		return -EINVAL;
+
+	offload.workers = talloc_zero_array(ctx, struct offload_worker,
+					    num_workers);
+	if (!offload.workers)
+		return -ENOMEM;
+
+	offload.done_ofd.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (offload.done_ofd.fd < 0) {
+		rc = -errno;
+		goto free_workers;
+	}
+	offload.done_ofd.when = BSC_FD_READ;
+	offload.done_ofd.cb = offload_done_cb;
+	rc = osmo_fd_register(&offload.done_ofd);
+	if (rc < 0)
+		goto close_done;
+
+	for (i = 0; i < num_workers; i++) {
+		struct offload_worker *w = &offload.workers[i];
+
+		gprs_spsc_ring_init(&w->todo, w->todo_slots,
+				    ARRAY_SIZE(w->todo_slots));
+		gprs_spsc_ring_init(&w->done, w->done_slots,
+				    ARRAY_SIZE(w->done_slots));
+		w->wake_fd = eventfd(0, EFD_CLOEXEC);
+		if (w->wake_fd < 0) {
+			rc = -errno;
+			break;
+		}
+		rc = -pthread_create(&w->thread, NULL, offload_worker_main, w);
+		if (rc < 0) {
+			close(w->wake_fd);
+			break;
+		}
+		offload.num_workers++;
+	}
+	if (offload.num_workers < num_workers) {
+		LOGP(DGPRS, LOGL_ERROR, "Cannot start offload worker: %s\n",
+		     strerror(-rc));
+		gprs_offload_stop();
+		return rc;
+	}
+
+	LOGP(DGPRS, LOGL_NOTICE, "Started %u offload workers\n", num_workers);
+	return 0;
+
+close_done:
+	close(offload.done_ofd.fd);
+	offload.done_ofd.fd = -1;
+free_workers:
+	TALLOC_FREE(offload.workers);
+	return rc;
+}
+
+/* Stop all workers. The jobs they had queued are completed first. */
+void gprs_offload_stop(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < offload.num_workers; i++)
+		offload_worker_stop(&offload.workers[i]);
+	offload_drain();
+
+	if (offload.done_ofd.fd >= 0) {
+		osmo_fd_unregister(&offload.done_ofd);
+		close(offload.done_ofd.fd);
+		offload.done_ofd.fd = -1;
+	}
+	offload.num_workers = 0;
+	TALLOC_FREE(offload.workers);
+}
+
+unsigned int gprs_offload_workers(void)
+{
+	return offload.num_workers;
+}
+
+/* Queue a job on the worker selected by the key. Jobs with the same key
+ * complete in the order they were posted. Returns -EBUSY if the queue of
+ * that worker is full, the job has not been posted then. */
+int gprs_offload_post(struct gprs_offload_job *job, uint32_t key)
+{
+	struct offload_worker *w;
+	uint64_t val = 1;
+
+	OSMO_ASSERT(offload.num_workers > 0);
+
+	w = &offload.workers[key % offload.num_workers];
+	if (w->in_flight >= GPRS_OFFLOAD_QUEUE_LEN) {
+		gprs_offload_stats.queue_full++;
+		return -EBUSY;
+	}
+
+	if (!gprs_spsc_ring_push(&w->todo, job)) {
+		gprs_offload_stats.queue_full++;
+		return -EBUSY;
+	}
+	w->in_flight++;
+	gprs_offload_stats.posted++;
+
+	if (write(w->wake_fd, &val, sizeof(val)) < 0)
+		LOGP(DGPRS, LOGL_ERROR, "Cannot wake offload worker: %s\n",
+		     strerror(errno));
+	return 0;
+}
@@ -43,6 +43,7 @@
 #include <osmocom/sgsn/signal.h>
 #include <osmocom/sgsn/gprs_gmm_attach.h>
 #include <osmocom/sgsn/gprs_llc.h>
+#include <osmocom/sgsn/gprs_obj_pool.h>
 
 #include <pdp.h>
 
@@ -56,6 +57,12 @@
 
 #define GPRS_LLME_CHECK_TICK 30
 
+/* Number of released MM/PDP contexts kept for reuse */
+#define SGSN_CTX_POOL_MAX 1024
+
+/* A policer bucket always has room for an N-PDU of maximum size */
+#define SGSN_POLICER_MIN_BURST 1600
+
 extern struct sgsn_instance *sgsn;
 extern void *tall_sgsn_ctx;
 
@@ -64,6 +71,16 @@ LLIST_HEAD(sgsn_ggsn_ctxts);
 LLIST_HEAD(sgsn_apn_ctxts);
 LLIST_HEAD(sgsn_pdp_ctxts);
 
+/* Gb MM contexts indexed by gb.tlli and gb.tlli_new */
+static struct gprs_id_hash sgsn_mm_tlli_hash;
+/* MM contexts indexed by p_tmsi and p_tmsi_old */
+static struct gprs_id_hash sgsn_mm_ptmsi_hash;
+
+static struct gprs_obj_pool sgsn_mm_ctx_pool =
+	GPRS_OBJ_POOL_INIT(sgsn_mm_ctx_pool, struct sgsn_mm_ctx, SGSN_CTX_POOL_MAX);
+static struct gprs_obj_pool sgsn_pdp_ctx_pool =
+	GPRS_OBJ_POOL_INIT(sgsn_pdp_ctx_pool, struct sgsn_pdp_ctx, SGSN_CTX_POOL_MAX);
+
 static const struct rate_ctr_desc mmctx_ctr_description[] = {
 	{ "sign:packets:in",	"Signalling Messages ( In)" },
 	{ "sign:packets:out",	"Signalling Messages (Out)" },
@@ -91,6 +108,12 @@ static const struct rate_ctr_desc pdpctx_ctr_description[] = {
 	{ "udata:packets:out",	"User Data  Messages (Out)" },
 	{ "udata:bytes:in",	"User Data  Bytes    ( In)" },
 	{ "udata:bytes:out",	"User Data  Bytes    (Out)" },
+	{ "dl_queue:queued",	"DL N-PDUs buffered       " },
+	{ "dl_queue:flushed",	"DL N-PDUs sent from queue" },
+	{ "dl_queue:expired",	"DL N-PDUs expired        " },
+	{ "dl_queue:dropped",	"DL N-PDUs queue overflow " },
+	{ "policer:dropped:in",	"UL N-PDUs over max bitrate" },
+	{ "policer:dropped:out", "DL N-PDUs over max bitrate" },
 };
 
 static const struct rate_ctr_group_desc pdpctx_ctrg_desc = {
@@ -158,22 +181,51 @@ struct sgsn_mm_ctx *sgsn_mm_ctx_by_ue_ctx(const void *uectx)
 struct sgsn_mm_ctx *sgsn_mm_ctx_by_tlli(uint32_t tlli,
 					const struct gprs_ra_id *raid)
 {
-	struct sgsn_mm_ctx *ctx;
+	struct gprs_id_hnode *node;
 
-	llist_for_each_entry(ctx, &sgsn_mm_ctxts, list) {
-		if ((tlli == ctx->gb.tlli || tlli == ctx->gb.tlli_new) &&
-		    gprs_ra_id_equals(raid, &ctx->ra))
+	gprs_id_hash_for_each(node, &sgsn_mm_tlli_hash, tlli) {
+		struct sgsn_mm_ctx *ctx = node->priv;
+		if (gprs_ra_id_equals(raid, &ctx->ra))
 			return ctx;
 	}
 
 	return NULL;
 }
 
+/* A TLLI of 0 is never used by an MS, it marks an unassigned TLLI */
+void sgsn_mm_ctx_set_tlli(struct sgsn_mm_ctx *ctx, uint32_t tlli)
+{
+	ctx->gb.tlli = tlli;
+	gprs_id_hash_update(&sgsn_mm_tlli_hash, &ctx->gb.tlli_hnode,
+			    tlli, 0, ctx);
+}
+
+void sgsn_mm_ctx_set_tlli_new(struct sgsn_mm_ctx *ctx, uint32_t tlli_new)
+{
+	ctx->gb.tlli_new = tlli_new;
+	gprs_id_hash_update(&sgsn_mm_tlli_hash, &ctx->gb.tlli_new_hnode,
+			    tlli_new, 0, ctx);
+}
+
+/* Attach an LLME to a Gb MM context, maintaining the LLME's back-pointer
+ * that the inactivity check uses to find the owner */
+void sgsn_mm_ctx_set_llme(struct sgsn_mm_ctx *ctx, struct gprs_llc_llme *llme)
+{
+	if (ctx->gb.llme && ctx->gb.llme != llme && ctx->gb.llme->mm == ctx)
+		ctx->gb.llme->mm = NULL;
+
+	ctx->gb.llme = llme;
+	if (llme)
+		llme->mm = ctx;
+}
+
 struct sgsn_mm_ctx *sgsn_mm_ctx_by_tlli_and_ptmsi(uint32_t tlli,
 					const struct gprs_ra_id *raid)
 {
-	struct sgsn_mm_ctx *ctx;
+	struct gprs_id_hnode *node;
+	uint32_t p_tmsi;
 	int tlli_type;
+	int msbs;
 
 	/* TODO: Also check the P_TMSI signature to be safe. That signature
 	 * should be different (at least with a sufficiently high probability)
@@ -184,11 +236,15 @@ struct sgsn_mm_ctx *sgsn_mm_ctx_by_tlli_and_ptmsi(uint32_t tlli,
 	if (tlli_type != TLLI_FOREIGN && tlli_type != TLLI_LOCAL)
 		return NULL;
 
-	llist_for_each_entry(ctx, &sgsn_mm_ctxts, list) {
-		if ((gprs_tmsi2tlli(ctx->p_tmsi, tlli_type) == tlli ||
-		     gprs_tmsi2tlli(ctx->p_tmsi_old, tlli_type) == tlli) &&
-		    gprs_ra_id_equals(raid, &ctx->ra))
-			return ctx;
+	/* The TLLI doesn't carry the two MSBs of the P-TMSI, so try all
+	 * four P-TMSIs the TLLI can have been derived from */
+	for (msbs = 0; msbs < 4; msbs++) {
+		p_tmsi = (tlli & 0x3fffffff) | ((uint32_t) msbs << 30);
+		gprs_id_hash_for_each(node, &sgsn_mm_ptmsi_hash, p_tmsi) {
+			struct sgsn_mm_ctx *ctx = node->priv;
+			if (gprs_ra_id_equals(raid, &ctx->ra))
+				return ctx;
+		}
 	}
 
 	return NULL;
@@ -196,14 +252,28 @@ struct sgsn_mm_ctx *sgsn_mm_ctx_by_tlli_and_ptmsi(uint32_t tlli,
 
 struct sgsn_mm_ctx *sgsn_mm_ctx_by_ptmsi(uint32_t p_tmsi)
 {
-	struct sgsn_mm_ctx *ctx;
+	struct gprs_id_hnode *node;
 
-	llist_for_each_entry(ctx, &sgsn_mm_ctxts, list) {
-		if (p_tmsi == ctx->p_tmsi ||
-		    (ctx->p_tmsi_old && ctx->p_tmsi_old == p_tmsi))
-			return ctx;
-	}
-	return NULL;
+	node = gprs_id_hash_first(&sgsn_mm_ptmsi_hash, p_tmsi);
+	if (!node)
+		return NULL;
+	return node->priv;
+}
+
+/* A P-TMSI of 0 marks an unassigned P-TMSI, see the p_tmsi_old handling
+ * in gprs_gmm.c */
+void sgsn_mm_ctx_set_ptmsi(struct sgsn_mm_ctx *ctx, uint32_t p_tmsi)
+{
+	ctx->p_tmsi = p_tmsi;
+	gprs_id_hash_update(&sgsn_mm_ptmsi_hash, &ctx->p_tmsi_hnode,
+			    p_tmsi, 0, ctx);
+}
+
+void sgsn_mm_ctx_set_ptmsi_old(struct sgsn_mm_ctx *ctx, uint32_t p_tmsi_old)
+{
+	ctx->p_tmsi_old = p_tmsi_old;
+	gprs_id_hash_update(&sgsn_mm_ptmsi_hash, &ctx->p_tmsi_old_hnode,
+			    p_tmsi_old, 0, ctx);
 }
 
 struct sgsn_mm_ctx *sgsn_mm_ctx_by_imsi(const char *imsi)
@@ -224,13 +294,12 @@ struct sgsn_mm_ctx *sgsn_mm_ctx_alloc_gb(uint32_t tlli,
 {
 	struct sgsn_mm_ctx *ctx;
 
-	ctx = talloc_zero(tall_sgsn_ctx, struct sgsn_mm_ctx);
+	ctx = gprs_obj_pool_alloc(&sgsn_mm_ctx_pool, tall_sgsn_ctx);
 	if (!ctx)
 		return NULL;
 
 	memcpy(&ctx->ra, raid, sizeof(ctx->ra));
 	ctx->ran_type = MM_CTX_T_GERAN_Gb;
-	ctx->gb.tlli = tlli;
 	ctx->gmm_state = GMM_DEREGISTERED;
 	ctx->pmm_state = MM_IDLE;
 	ctx->auth_triplet.key_seq = GSM_KEY_SEQ_INVAL;
@@ -240,13 +309,14 @@ struct sgsn_mm_ctx *sgsn_mm_ctx_alloc_gb(uint32_t tlli,
 	ctx->ctrg = rate_ctr_group_alloc(ctx, &mmctx_ctrg_desc, tlli);
 	if (!ctx->ctrg) {
 		LOGMMCTXP(LOGL_ERROR, ctx, "Cannot allocate counter group\n");
-		talloc_free(ctx);
+		gprs_obj_pool_free(&sgsn_mm_ctx_pool, ctx);
 		return NULL;
 	}
 	ctx->gmm_att_req.fsm = osmo_fsm_inst_alloc(&gmm_attach_req_fsm, ctx, ctx, LOGL_DEBUG, "gb_gmm_req");
 	INIT_LLIST_HEAD(&ctx->pdp_list);
 
 	llist_add(&ctx->list, &sgsn_mm_ctxts);
+	sgsn_mm_ctx_set_tlli(ctx, tlli);
 
 	return ctx;
 }
@@ -258,7 +328,7 @@ struct sgsn_mm_ctx *sgsn_mm_ctx_alloc_iu(void *uectx)
 	struct sgsn_mm_ctx *ctx;
 	struct ranap_ue_conn_ctx *ue_ctx = uectx;
 
-	ctx = talloc_zero(tall_sgsn_ctx, struct sgsn_mm_ctx);
+	ctx = gprs_obj_pool_alloc(&sgsn_mm_ctx_pool, tall_sgsn_ctx);
 	if (!ctx)
 		return NULL;
 
@@ -273,7 +343,7 @@ struct sgsn_mm_ctx *sgsn_mm_ctx_alloc_iu(void *uectx)
 	if (!ctx->ctrg) {
 		LOGMMCTXP(LOGL_ERROR, ctx, "Cannot allocate counter group for %s.%u\n",
 			  mmctx_ctrg_desc.group_name_prefix, ue_ctx->conn_id);
-		talloc_free(ctx);
+		gprs_obj_pool_free(&sgsn_mm_ctx_pool, ctx);
 		return NULL;
 	}
 	ctx->gmm_att_req.fsm = osmo_fsm_inst_alloc(&gmm_attach_req_fsm, ctx, ctx, LOGL_DEBUG, "gb_gmm_req");
@@ -300,6 +370,12 @@ static void sgsn_mm_ctx_free(struct sgsn_mm_ctx *mm)
 
 	/* Unlink from global list of MM contexts */
 	llist_del(&mm->list);
+	gprs_id_hash_del(&sgsn_mm_tlli_hash, &mm->gb.tlli_hnode);
+	gprs_id_hash_del(&sgsn_mm_tlli_hash, &mm->gb.tlli_new_hnode);
+	gprs_id_hash_del(&sgsn_mm_ptmsi_hash, &mm->p_tmsi_hnode);
+	gprs_id_hash_del(&sgsn_mm_ptmsi_hash, &mm->p_tmsi_old_hnode);
+	if (mm->gb.llme && mm->gb.llme->mm == mm)
+		mm->gb.llme->mm = NULL;
 
 	/* Free all PDP contexts */
 	llist_for_each_entry_safe(pdp, pdp2, &mm->pdp_list, list)
@@ -307,7 +383,7 @@ static void sgsn_mm_ctx_free(struct sgsn_mm_ctx *mm)
 
 	rate_ctr_group_free(mm->ctrg);
 
-	talloc_free(mm);
+	gprs_obj_pool_free(&sgsn_mm_ctx_pool, mm);
 }
 
 void sgsn_mm_ctx_cleanup_free(struct sgsn_mm_ctx *mm)
@@ -371,26 +447,69 @@ void sgsn_mm_ctx_cleanup_free(struct sgsn_mm_ctx *mm)
 struct sgsn_pdp_ctx *sgsn_pdp_ctx_by_nsapi(const struct sgsn_mm_ctx *mm,
 					   uint8_t nsapi)
 {
-	struct sgsn_pdp_ctx *pdp;
-
-	llist_for_each_entry(pdp, &mm->pdp_list, list) {
-		if (pdp->nsapi == nsapi)
-			return pdp;
-	}
-	return NULL;
+	if (nsapi >= ARRAY_SIZE(mm->pdp_by_nsapi))
+		return NULL;
+	return mm->pdp_by_nsapi[nsapi];
 }
 
 /* look up PDP context by MM context and transaction ID */
 struct sgsn_pdp_ctx *sgsn_pdp_ctx_by_tid(const struct sgsn_mm_ctx *mm,
 					 uint8_t tid)
 {
-	struct sgsn_pdp_ctx *pdp;
+	if (tid >= ARRAY_SIZE(mm->pdp_by_ti))
+		return NULL;
+	return mm->pdp_by_ti[tid];
+}
+
+/* Drop pdp from the TI table, falling back to another context that uses
+ * the same TI (e.g. one that has just been allocated and has no TI
+ * assigned yet) like the former list walk did */
+static void mm_ctx_unmap_ti(struct sgsn_mm_ctx *mm, struct sgsn_pdp_ctx *pdp)
+{
+	struct sgsn_pdp_ctx *other;
+
+	if (mm->pdp_by_ti[pdp->ti] != pdp)
+		return;
 
-	llist_for_each_entry(pdp, &mm->pdp_list, list) {
-		if (pdp->ti == tid)
-			return pdp;
+	mm->pdp_by_ti[pdp->ti] = NULL;
+	llist_for_each_entry(other, &mm->pdp_list, list) {
+		if (other != pdp && other->ti == pdp->ti) {
+			mm->pdp_by_ti[pdp->ti] = other;
+			break;
+		}
 	}
-	return NULL;
+}
+
+void sgsn_mm_ctx_add_pdp(struct sgsn_mm_ctx *mm, struct sgsn_pdp_ctx *pdp)
+{
+	OSMO_ASSERT(pdp->nsapi < ARRAY_SIZE(mm->pdp_by_nsapi));
+	OSMO_ASSERT(pdp->ti < ARRAY_SIZE(mm->pdp_by_ti));
+
+	llist_add(&pdp->list, &mm->pdp_list);
+	mm->pdp_by_nsapi[pdp->nsapi] = pdp;
+	mm->pdp_by_ti[pdp->ti] = pdp;
+}
+
+void sgsn_mm_ctx_remove_pdp(struct sgsn_mm_ctx *mm, struct sgsn_pdp_ctx *pdp)
+{
+	/* the pending counts still belong to this MM context */
+	sgsn_pdp_ctx_ctrs_flush(pdp);
+	llist_del(&pdp->list);
+	if (mm->pdp_by_nsapi[pdp->nsapi] == pdp)
+		mm->pdp_by_nsapi[pdp->nsapi] = NULL;
+	mm_ctx_unmap_ti(mm, pdp);
+}
+
+/* Update the transaction identifier, keeping the TI table current */
+void sgsn_pdp_ctx_set_ti(struct sgsn_pdp_ctx *pdp, uint8_t ti)
+{
+	OSMO_ASSERT(ti < NUM_TIS);
+
+	if (pdp->mm) {
+		mm_ctx_unmap_ti(pdp->mm, pdp);
+		pdp->mm->pdp_by_ti[ti] = pdp;
+	}
+	pdp->ti = ti;
 }
 
 /* you don't want to use this directly, call sgsn_create_pdp_ctx() */
@@ -400,24 +519,29 @@ struct sgsn_pdp_ctx *sgsn_pdp_ctx_alloc(struct sgsn_mm_ctx *mm,
 {
 	struct sgsn_pdp_ctx *pdp;
 
+	if (nsapi >= NUM_NSAPIS)
+		return NULL;
+
 	pdp = sgsn_pdp_ctx_by_nsapi(mm, nsapi);
 	if (pdp)
 		return NULL;
 
-	pdp = talloc_zero(tall_sgsn_ctx, struct sgsn_pdp_ctx);
+	pdp = gprs_obj_pool_alloc(&sgsn_pdp_ctx_pool, tall_sgsn_ctx);
 	if (!pdp)
 		return NULL;
 
 	pdp->mm = mm;
 	pdp->ggsn = ggsn;
 	pdp->nsapi = nsapi;
+	INIT_LLIST_HEAD(&pdp->dl_queue);
+	INIT_LLIST_HEAD(&pdp->ud_pending_list);
 	pdp->ctrg = rate_ctr_group_alloc(pdp, &pdpctx_ctrg_desc, nsapi);
 	if (!pdp->ctrg) {
 		LOGPDPCTXP(LOGL_ERROR, pdp, "Error allocation counter group\n");
-		talloc_free(pdp);
+		gprs_obj_pool_free(&sgsn_pdp_ctx_pool, pdp);
 		return NULL;
 	}
-	llist_add(&pdp->list, &mm->pdp_list);
+	sgsn_mm_ctx_add_pdp(mm, pdp);
 	sgsn_ggsn_ctx_add_pdp(pdp->ggsn, pdp);
 	llist_add(&pdp->g_list, &sgsn_pdp_ctxts);
 
@@ -441,8 +565,12 @@ void sgsn_pdp_ctx_terminate(struct sgsn_pdp_ctx *pdp)
 	LOGPDPCTXP(LOGL_INFO, pdp, "Forcing release of PDP context\n");
 
 	if (pdp->mm->ran_type == MM_CTX_T_GERAN_Gb) {
+		struct gprs_llc_lle *lle;
+
+		lle = gprs_llme_lle(pdp->mm->gb.llme, pdp->sapi);
 		/* Force the deactivation of the SNDCP layer */
-		sndcp_sm_deactivate_ind(&pdp->mm->gb.llme->lle[pdp->sapi], pdp->nsapi);
+		if (lle)
+			sndcp_sm_deactivate_ind(lle, pdp->nsapi);
 	}
 
 	memset(&sig_data, 0, sizeof(sig_data));
@@ -468,9 +596,11 @@ void sgsn_pdp_ctx_free(struct sgsn_pdp_ctx *pdp)
 	sig_data.pdp = pdp;
 	osmo_signal_dispatch(SS_SGSN, S_SGSN_PDP_FREE, &sig_data);
 
+	sgsn_pdp_dl_queue_purge(pdp);
+	sgsn_pdp_ctx_ctrs_flush(pdp);
 	rate_ctr_group_free(pdp->ctrg);
 	if (pdp->mm)
-		llist_del(&pdp->list);
+		sgsn_mm_ctx_remove_pdp(pdp->mm, pdp);
 	if (pdp->ggsn)
 		sgsn_ggsn_ctx_remove_pdp(pdp->ggsn, pdp);
 	llist_del(&pdp->g_list);
@@ -487,7 +617,170 @@ void sgsn_pdp_ctx_free(struct sgsn_pdp_ctx *pdp)
 		lib->priv = NULL;
 	}
 
-	talloc_free(pdp);
+	gprs_obj_pool_free(&sgsn_pdp_ctx_pool, pdp);
+}
+
+/* PDP contexts with user data counts pending, and the timer that adds
+ * them to the rate counters */
+static LLIST_HEAD(pdp_ctrs_pending);
+static struct osmo_timer_list pdp_ctrs_timer;
+
+static void pdp_ctrs_timer_cb(void *data)
+{
+	sgsn_pdp_ctxs_ctrs_flush();
+}
+
+/* Called on the first count after a flush */
+void sgsn_pdp_ctx_ctrs_pending(struct sgsn_pdp_ctx *pdp)
+{
+	llist_add_tail(&pdp->ud_pending_list, &pdp_ctrs_pending);
+	if (!osmo_timer_pending(&pdp_ctrs_timer)) {
+		osmo_timer_setup(&pdp_ctrs_timer, pdp_ctrs_timer_cb, NULL);
+		osmo_timer_schedule(&pdp_ctrs_timer, 0,
+				    SGSN_PDP_CTRS_FLUSH_MS * 1000);
+	}
+}
+
+/* Add the pending user data counts to the rate counters, to be called
+ * before they are read */
+void sgsn_pdp_ctx_ctrs_flush(struct sgsn_pdp_ctx *pdp)
+{
+	struct rate_ctr *ctr = pdp->ctrg->ctr;
+
+	if (llist_empty(&pdp->ud_pending_list))
+		return;
+	llist_del_init(&pdp->ud_pending_list);
+	if (llist_empty(&pdp_ctrs_pending))
+		osmo_timer_del(&pdp_ctrs_timer);
+
+	rate_ctr_add(&ctr[PDP_CTR_PKTS_UDATA_IN], pdp->ud_pending.pkts_in);
+	rate_ctr_add(&ctr[PDP_CTR_BYTES_UDATA_IN], pdp->ud_pending.bytes_in);
+	rate_ctr_add(&ctr[PDP_CTR_PKTS_UDATA_OUT], pdp->ud_pending.pkts_out);
+	rate_ctr_add(&ctr[PDP_CTR_BYTES_UDATA_OUT], pdp->ud_pending.bytes_out);
+
+	if (pdp->mm) {
+		ctr = pdp->mm->ctrg->ctr;
+		rate_ctr_add(&ctr[GMM_CTR_PKTS_UDATA_IN], pdp->ud_pending.pkts_in);
+		rate_ctr_add(&ctr[GMM_CTR_BYTES_UDATA_IN], pdp->ud_pending.bytes_in);
+		rate_ctr_add(&ctr[GMM_CTR_PKTS_UDATA_OUT], pdp->ud_pending.pkts_out);
+		rate_ctr_add(&ctr[GMM_CTR_BYTES_UDATA_OUT], pdp->ud_pending.bytes_out);
+	}
+
+	memset(&pdp->ud_pending, 0, sizeof(pdp->ud_pending));
+}
+
+void sgsn_pdp_ctxs_ctrs_flush(void)
+{
+	struct sgsn_pdp_ctx *pdp, *pdp2;
+
+	llist_for_each_entry_safe(pdp, pdp2, &pdp_ctrs_pending, ud_pending_list)
+		sgsn_pdp_ctx_ctrs_flush(pdp);
+}
+
+static uint64_t policer_now_us(void)
+{
+	struct timespec now;
+
+	osmo_clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static uint32_t policer_burst(const struct sgsn_pdp_policer *pol)
+{
+	uint64_t burst = (uint64_t)pol->rate * sgsn->cfg.qos_policing.burst / 1000;
+
+	return OSMO_MAX(burst, SGSN_POLICER_MIN_BURST);
+}
+
+static void policer_init(struct sgsn_pdp_policer *pol, uint32_t rate)
+{
+	pol->rate = rate;
+	pol->tokens = policer_burst(pol);
+	pol->last_us = policer_now_us();
+}
+
+/* Maximum bitrate in kbit/s of octet 8 or 9 of a QoS profile, with the
+ * extension of octet 15 or 17, 3GPP TS 24.008 10.5.6.5. Returns 0 if no
+ * limit is given. Rates above 256 Mbit/s are not limited either. */
+static uint32_t qos_max_bitrate(uint8_t mbr, uint8_t ext)
+{
+	if (mbr == 0xfe && ext) {
+		if (ext <= 0x4a)
+			return 8600 + ext * 100;
+		if (ext <= 0xba)
+			return 16000 + (ext - 0x4a) * 1000;
+		if (ext <= 0xfa)
+			return 128000 + (ext - 0xba) * 2000;
+		return 0;
+	}
+
+	/* 0x00 is "subscribed", 0xff is 0 kbit/s */
+	if (mbr == 0x00 || mbr == 0xff)
+		return 0;
+	if (mbr < 0x40)
+		return mbr;
+	if (mbr < 0x80)
+		return 64 + (mbr - 0x40) * 8;
+	return 576 + (mbr - 0x80) * 64;
+}
+
+/* Set up the policers from a QoS profile as used by GTP, with the
+ * Allocation/Retention Priority in front of octet 3 of 3GPP TS 24.008
+ * 10.5.6.5. Pre-R99 profiles only have the peak throughput. */
+void sgsn_pdp_policer_set(struct sgsn_pdp_ctx *pdp, const uint8_t *qos,
+			  unsigned int qos_len)
+{
+	uint32_t ul = 0, dl = 0;
+	unsigned int peak;
+
+	if (qos_len >= 8) {
+		ul = qos_max_bitrate(qos[6], qos_len >= 16 ? qos[15] : 0) * 125;
+		dl = qos_max_bitrate(qos[7], qos_len >= 14 ? qos[13] : 0) * 125;
+	} else if (qos_len >= 3) {
+		/* class 1 is 1000 octet/s, each class doubles it */
+		peak = qos[2] >> 4;
+		if (peak >= 1 && peak <= 9)
+			ul = dl = 1000 << (peak - 1);
+	}
+
+	LOGPDPCTXP(LOGL_INFO, pdp, "Maximum bitrate UL %u, DL %u octet/s\n",
+		   ul, dl);
+	policer_init(&pdp->policer_ul, ul);
+	policer_init(&pdp->policer_dl, dl);
+}
+
+/* Whether an N-PDU of len octets is within the maximum bitrate. If so, it
+ * is taken from the bucket. */
+bool sgsn_pdp_policer_conform(struct sgsn_pdp_policer *pol, unsigned int len)
+{
+	uint64_t now, elapsed, refill;
+	uint32_t burst;
+
+	if (!pol->rate || !sgsn->cfg.qos_policing.enable)
+		return true;
+
+	now = policer_now_us();
+	burst = policer_burst(pol);
+	elapsed = now - pol->last_us;
+	/* no bucket takes longer than a minute to fill */
+	if (elapsed >= 60 * 1000000ULL)
+		refill = burst;
+	else
+		refill = elapsed * pol->rate / 1000000;
+
+	if (pol->tokens + refill >= burst) {
+		pol->tokens = burst;
+		pol->last_us = now;
+	} else if (refill) {
+		pol->tokens += refill;
+		/* keep the fraction of an octet that is not refilled yet */
+		pol->last_us += refill * 1000000 / pol->rate;
+	}
+
+	if (len > pol->tokens)
+		return false;
+	pol->tokens -= len;
+	return true;
 }
 
 void sgsn_ggsn_ctx_check_echo_timer(struct sgsn_ggsn_ctx *ggc)
@@ -669,7 +962,6 @@ struct apn_ctx *sgsn_apn_ctx_find_alloc(const char *name, const char *imsi_prefi
 
 uint32_t sgsn_alloc_ptmsi(void)
 {
-	struct sgsn_mm_ctx *mm;
 	uint32_t ptmsi = 0xdeadbeef;
 	int max_retries = 100, rc = 0;
 
@@ -702,12 +994,12 @@ restart:
 		goto restart;
 	}
 
-	llist_for_each_entry(mm, &sgsn_mm_ctxts, list) {
-		if (mm->p_tmsi == ptmsi) {
-			if (!max_retries--)
-				goto failed;
-			goto restart;
-		}
+	/* Don't hand out a P-TMSI that is (still) in use, be it as the
+	 * current or as the old, not yet released one */
+	if (sgsn_mm_ctx_by_ptmsi(ptmsi)) {
+		if (!max_retries--)
+			goto failed;
+		goto restart;
 	}
 
 	return ptmsi;
@@ -931,13 +1223,11 @@ struct sgsn_ggsn_ctx *sgsn_mm_ctx_find_ggsn_ctx(struct sgsn_mm_ctx *mmctx,
 
 static void sgsn_llme_cleanup_free(struct gprs_llc_llme *llme)
 {
-	struct sgsn_mm_ctx *mmctx = NULL;
+	struct sgsn_mm_ctx *mmctx = llme->mm;
 
-	llist_for_each_entry(mmctx, &sgsn_mm_ctxts, list) {
-		if (llme == mmctx->gb.llme) {
-			gsm0408_gprs_access_cancelled(mmctx, SGSN_ERROR_CAUSE_NONE);
-			return;
-		}
+	if (mmctx && mmctx->gb.llme == llme) {
+		gsm0408_gprs_access_cancelled(mmctx, SGSN_ERROR_CAUSE_NONE);
+		return;
 	}
 
 	/* No MM context found */
@@ -962,18 +1252,20 @@ static void sgsn_llme_check_cb(void *data_)
 	LOGP(DGPRS, LOGL_DEBUG,
 	     "Checking for inactive LLMEs, time = %u\n", (unsigned)now);
 
-	llist_for_each_entry_safe(llme, llme_tmp, &gprs_llc_llmes, list) {
-		if (llme->age_timestamp == GPRS_LLME_RESET_AGE)
-			llme->age_timestamp = now;
+	gprs_llme_age_update(now);
 
+	/* The idle list is ordered by age, so only the expired LLMEs at its
+	 * head need to be looked at */
+	llist_for_each_entry_safe(llme, llme_tmp, &gprs_llc_llmes_idle, age_list) {
 		age = now - llme->age_timestamp;
 
-		if (age > max_age || age < 0) {
-			LOGP(DGPRS, LOGL_INFO,
-			     "Inactivity timeout for TLLI 0x%08x, age %d\n",
-			     llme->tlli, (int)age);
-			sgsn_llme_cleanup_free(llme);
-		}
+		if (age <= max_age && age >= 0)
+			break;
+
+		LOGP(DGPRS, LOGL_INFO,
+		     "Inactivity timeout for TLLI 0x%08x, age %d\n",
+		     llme->tlli, (int)age);
+		sgsn_llme_cleanup_free(llme);
 	}
 
 	osmo_timer_schedule(&sgsn->llme_timer, GPRS_LLME_CHECK_TICK, 0);
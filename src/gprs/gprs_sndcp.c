@@ -23,8 +23,10 @@
 #include <errno.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <netinet/in.h>
 
 #include <osmocom/core/msgb.h>
+#include <osmocom/core/bits.h>
 #include <osmocom/core/linuxlist.h>
 #include <osmocom/core/timer.h>
 #include <osmocom/core/talloc.h>
@@ -39,6 +41,8 @@
 #include <osmocom/sgsn/gprs_sndcp_pcomp.h>
 #include <osmocom/sgsn/gprs_sndcp_dcomp.h>
 #include <osmocom/sgsn/gprs_sndcp_comp.h>
+#include <osmocom/sgsn/gprs_obj_pool.h>
+#include <osmocom/sgsn/gprs_msgb_pool.h>
 
 #define DEBUG_IP_PACKETS 0	/* 0=Disabled, 1=Enabled */
 
@@ -189,6 +193,12 @@ struct sndcp_udata_hdr {
 
 static void *tall_sndcp_ctx;
 
+/* Number of released SNDCP entities kept for reuse */
+#define SNE_POOL_MAX 1024
+
+static struct gprs_obj_pool sne_pool =
+	GPRS_OBJ_POOL_INIT(sne_pool, struct gprs_sndcp_entity, SNE_POOL_MAX);
+
 /* A fragment queue entry, containing one framgent of a N-PDU */
 struct defrag_queue_entry {
 	struct llist_head list;
@@ -200,8 +210,6 @@ struct defrag_queue_entry {
 	uint8_t *data;
 };
 
-LLIST_HEAD(gprs_sndcp_entities);
-
 /* Check if any compression parameters are set in the sgsn configuration */
 static inline int any_pcomp_or_dcomp_active(struct sgsn_instance *sgsn) {
 	if (sgsn->cfg.pcomp_rfc1144.active || sgsn->cfg.pcomp_rfc1144.passive ||
@@ -211,6 +219,51 @@ static inline int any_pcomp_or_dcomp_active(struct sgsn_instance *sgsn) {
 		return false;
 }
 
+/* The compression entity lists of an LLME are only allocated when the
+ * first entity is added, until then the LLME uses this empty list */
+static LLIST_HEAD(no_comp_entities);
+
+static struct llist_head *comp_entities(struct llist_head *list)
+{
+	return list ? list : &no_comp_entities;
+}
+
+static struct llist_head *comp_entities_alloc(struct gprs_llc_llme *llme,
+					      struct llist_head **list)
+{
+	if (!*list)
+		*list = gprs_sndcp_comp_alloc(llme);
+	return *list;
+}
+
+/* Update the NSAPIs that use compression after the entities changed */
+static void comp_entities_update_nsapis(struct gprs_llc_llme *llme)
+{
+	struct llist_head *lists[] = { llme->comp.proto, llme->comp.data };
+	struct gprs_sndcp_comp *comp_entity;
+	uint16_t nsapis = 0;
+	unsigned int i, j;
+
+	for (i = 0; i < ARRAY_SIZE(lists); i++) {
+		if (!lists[i])
+			continue;
+		llist_for_each_entry(comp_entity, lists[i], list) {
+			for (j = 0; j < comp_entity->nsapi_len; j++)
+				nsapis |= 1 << comp_entity->nsapi[j];
+		}
+	}
+
+	llme->comp.nsapis = nsapis;
+}
+
+/* Check if a compression entity was negotiated for the NSAPI */
+static bool comp_active(const struct gprs_llc_llme *llme, uint8_t nsapi)
+{
+	if (!any_pcomp_or_dcomp_active(sgsn))
+		return false;
+	return llme->comp.nsapis & (1 << nsapi);
+}
+
 /* Enqueue a fragment into the defragment queue */
 static int defrag_enqueue(struct gprs_sndcp_entity *sne, uint8_t seg_nr,
 			  uint8_t *data, uint32_t data_len)
@@ -280,11 +333,12 @@ static int defrag_segments(struct gprs_sndcp_entity *sne)
 	int npdu_len;
 	int rc;
 	uint8_t *expnd = NULL;
+	bool decompress;
 
 	LOGP(DSNDCP, LOGL_DEBUG, "TLLI=0x%08x NSAPI=%u: Defragment output PDU %u "
 		"num_seg=%u tot_len=%u\n", sne->lle->llme->tlli, sne->nsapi,
 		sne->defrag.npdu, sne->defrag.highest_seg, sne->defrag.tot_len);
-	msg = msgb_alloc_headroom(sne->defrag.tot_len+256, 128, "SNDCP Defrag");
+	msg = gprs_msgb_alloc_headroom(sne->defrag.tot_len+256, 128, "SNDCP Defrag");
 	if (!msg)
 		return -ENOMEM;
 
@@ -317,13 +371,15 @@ static int defrag_segments(struct gprs_sndcp_entity *sne)
 	/* actually send the N-PDU to the SGSN core code, which then
 	 * hands it off to the correct GTP tunnel + GGSN via gtp_data_req() */
 
-	/* Decompress packet */
+	/* Decompress packet, unless nothing was negotiated or applied */
+	decompress = comp_active(sne->lle->llme, sne->nsapi) &&
+		     (sne->defrag.pcomp || sne->defrag.dcomp);
 #if DEBUG_IP_PACKETS == 1
 	DEBUGP(DSNDCP, "                                                   \n");
 	DEBUGP(DSNDCP, ":::::::::::::::::::::::::::::::::::::::::::::::::::\n");
 	DEBUGP(DSNDCP, "===================================================\n");
 #endif
-	if (any_pcomp_or_dcomp_active(sgsn)) {
+	if (decompress) {
 
 		expnd = talloc_zero_size(msg, npdu_len * MAX_DATADECOMPR_FAC +
 					 MAX_HDRDECOMPR_INCR);
@@ -365,7 +421,7 @@ static int defrag_segments(struct gprs_sndcp_entity *sne)
 	rc = sgsn_rx_sndcp_ud_ind(&sne->ra_id, sne->lle->llme->tlli,
 				  sne->nsapi, msg, npdu_len, expnd);
 
-	if (any_pcomp_or_dcomp_active(sgsn))
+	if (decompress)
 		talloc_free(expnd);
 
 	return rc;
@@ -450,10 +506,12 @@ static struct gprs_sndcp_entity *gprs_sndcp_entity_by_lle(const struct gprs_llc_
 {
 	struct gprs_sndcp_entity *sne;
 
-	llist_for_each_entry(sne, &gprs_sndcp_entities, list) {
-		if (sne->lle == lle && sne->nsapi == nsapi)
-			return sne;
-	}
+	if (nsapi >= ARRAY_SIZE(lle->llme->sne))
+		return NULL;
+
+	sne = lle->llme->sne[nsapi];
+	if (sne && sne->lle == lle)
+		return sne;
 	return NULL;
 }
 
@@ -462,7 +520,10 @@ static struct gprs_sndcp_entity *gprs_sndcp_entity_alloc(struct gprs_llc_lle *ll
 {
 	struct gprs_sndcp_entity *sne;
 
-	sne = talloc_zero(tall_sndcp_ctx, struct gprs_sndcp_entity);
+	if (nsapi >= ARRAY_SIZE(lle->llme->sne) || lle->llme->sne[nsapi])
+		return NULL;
+
+	sne = gprs_obj_pool_alloc(&sne_pool, tall_sndcp_ctx);
 	if (!sne)
 		return NULL;
 
@@ -473,17 +534,31 @@ static struct gprs_sndcp_entity *gprs_sndcp_entity_alloc(struct gprs_llc_lle *ll
 	sne->rx_state = SNDCP_RX_S_FIRST;
 	INIT_LLIST_HEAD(&sne->defrag.frag_list);
 
-	llist_add(&sne->list, &gprs_sndcp_entities);
+	lle->llme->sne[nsapi] = sne;
 
 	return sne;
 }
 
+/* Release an SNDCP entity that is no longer referenced by its LLME */
+void gprs_sndcp_entity_free(struct gprs_sndcp_entity *sne)
+{
+	/* frag queue entries are hierarchically allocated, so no need to
+	 * free them explicitly here */
+	gprs_obj_pool_free(&sne_pool, sne);
+}
+
 /* Entry point for the SNSM-ACTIVATE.indication */
 int sndcp_sm_activate_ind(struct gprs_llc_lle *lle, uint8_t nsapi)
 {
 	LOGP(DSNDCP, LOGL_INFO, "SNSM-ACTIVATE.ind (lle=%p TLLI=%08x, "
 	     "SAPI=%u, NSAPI=%u)\n", lle, lle->llme->tlli, lle->sapi, nsapi);
 
+	if (nsapi >= ARRAY_SIZE(lle->llme->sne)) {
+		LOGP(DSNDCP, LOGL_ERROR, "Trying to ACTIVATE invalid "
+			"NSAPI (TLLI=%08x, NSAPI=%u)\n", lle->llme->tlli, nsapi);
+		return -EINVAL;
+	}
+
 	if (gprs_sndcp_entity_by_lle(lle, nsapi)) {
 		LOGP(DSNDCP, LOGL_ERROR, "Trying to ACTIVATE "
 			"already-existing entity (TLLI=%08x, NSAPI=%u)\n",
@@ -491,6 +566,16 @@ int sndcp_sm_activate_ind(struct gprs_llc_lle *lle, uint8_t nsapi)
 		return -EEXIST;
 	}
 
+	/* The NSAPI table is per LLME, the NSAPI may be in use on another
+	 * SAPI */
+	if (lle->llme->sne[nsapi]) {
+		LOGP(DSNDCP, LOGL_ERROR, "Trying to ACTIVATE NSAPI already "
+			"in use on SAPI=%u (TLLI=%08x, SAPI=%u, NSAPI=%u)\n",
+			lle->llme->sne[nsapi]->lle->sapi, lle->llme->tlli,
+			lle->sapi, nsapi);
+		return -EEXIST;
+	}
+
 	if (!gprs_sndcp_entity_alloc(lle, nsapi)) {
 		LOGP(DSNDCP, LOGL_ERROR, "Out of memory during ACTIVATE\n");
 		return -ENOMEM;
@@ -514,10 +599,8 @@ int sndcp_sm_deactivate_ind(struct gprs_llc_lle *lle, uint8_t nsapi)
 		     lle->sapi, nsapi);
 		return -ENOENT;
 	}
-	llist_del(&sne->list);
-	/* frag queue entries are hierarchically allocated, so no need to
-	 * free them explicitly here */
-	talloc_free(sne);
+	lle->llme->sne[nsapi] = NULL;
+	gprs_sndcp_entity_free(sne);
 
 	return 0;
 }
@@ -525,13 +608,124 @@ int sndcp_sm_deactivate_ind(struct gprs_llc_lle *lle, uint8_t nsapi)
 /* Fragmenter state */
 struct sndcp_frag_state {
 	uint8_t frag_nr;
-	struct msgb *msg;	/* original message */
-	uint8_t *next_byte;	/* first byte of next fragment */
+	struct msgb *msg;	/* original message, NULL if not held in a msgb */
+	const uint8_t *next_byte; /* first byte of next fragment */
+	const uint8_t *end;	/* first byte past the N-PDU */
+
+	/* routing of the original N-PDU, copied to each fragment */
+	uint32_t tlli;
+	uint16_t bvci;
+	uint16_t nsei;
 
 	struct gprs_sndcp_entity *sne;
 	void *mmcontext;
+	/* the N-PDU goes to the priority queue of the downlink scheduler */
+	bool prio;
+
+	/* fragments that are ready to be sent as one LLC burst */
+	struct msgb *burst[GPRS_LLC_UI_BURST_MAX];
+	unsigned int burst_len;
 };
 
+struct sndcp_dl_stats sndcp_dl_stats;
+
+/* Allocate a downlink msgb for up to len bytes of SNDCP payload, with room
+ * for the headers and trailers the lower layers add on the way down */
+static struct msgb *sndcp_dl_msgb_alloc(unsigned int len, const char *name)
+{
+	struct msgb *msg;
+
+	msg = gprs_msgb_alloc_headroom(GPRS_LLC_DL_HEADROOM + len +
+				       GPRS_LLC_DL_TAILROOM,
+				       GPRS_LLC_DL_HEADROOM, name);
+	if (msg)
+		sndcp_dl_stats.msgb_allocs++;
+	return msg;
+}
+
+static void sndcp_frag_state_release(struct sndcp_frag_state *fs)
+{
+	unsigned int i;
+
+	for (i = 0; i < fs->burst_len; i++)
+		msgb_free(fs->burst[i]);
+	fs->burst_len = 0;
+	if (fs->msg)
+		msgb_free(fs->msg);
+	fs->msg = NULL;
+}
+
+/* Hand the queued fragments to LLC, which consumes them in any case */
+static int sndcp_frag_flush(struct sndcp_frag_state *fs)
+{
+	struct gprs_llc_lle *lle = fs->sne->lle;
+	unsigned int num = fs->burst_len;
+
+	fs->burst_len = 0;
+	return gprs_llc_tx_ui_burst(fs->burst, num, lle->sapi, 0,
+				    fs->mmcontext, true, fs->prio);
+}
+
+/* Whether a downlink N-PDU is sent ahead of bulk data: small packets, DNS
+ * and TCP segments without payload, like the ACKs of an upload that would
+ * otherwise wait behind a download to the same MS. IPv6 extension headers
+ * are not followed. */
+bool sndcp_dl_prio(const uint8_t *data, unsigned int len)
+{
+	unsigned int hlen, l3_len;
+	const uint8_t *l4;
+	uint8_t proto;
+
+	if (len <= sgsn->cfg.dl_sched.prio_max_len)
+		return true;
+
+	switch (data[0] >> 4) {
+	case 4:
+		if (len < 20)
+			return false;
+		hlen = (data[0] & 0x0f) * 4;
+		/* only the first fragment carries the transport header */
+		if (hlen < 20 || (osmo_load16be(data + 6) & 0x1fff))
+			return false;
+		l3_len = osmo_load16be(data + 2);
+		proto = data[9];
+		break;
+	case 6:
+		if (len < 40)
+			return false;
+		hlen = 40;
+		l3_len = 40 + osmo_load16be(data + 4);
+		proto = data[6];
+		break;
+	default:
+		return false;
+	}
+	if (l3_len > len || l3_len < hlen)
+		return false;
+	l4 = data + hlen;
+
+	switch (proto) {
+	case IPPROTO_TCP:
+		if (l3_len - hlen < 20)
+			return false;
+		return (l4[12] >> 4) * 4 >= l3_len - hlen;
+	case IPPROTO_UDP:
+		if (l3_len - hlen < 8)
+			return false;
+		return osmo_load16be(l4) == 53 || osmo_load16be(l4 + 2) == 53;
+	default:
+		return false;
+	}
+}
+
+/* Largest N-PDU that still fits into a single SN-UNITDATA PDU */
+static unsigned int sndcp_max_unfrag_len(const struct gprs_llc_lle *lle)
+{
+	return lle->params.n201_u - (sizeof(struct sndcp_common_hdr) +
+				     sizeof(struct sndcp_comp_hdr) +
+				     sizeof(struct sndcp_udata_hdr));
+}
+
 /* returns '1' if there are more fragments to send, '0' if none */
 static int sndcp_send_ud_frag(struct sndcp_frag_state *fs,
 			      uint8_t pcomp, uint8_t dcomp)
@@ -547,17 +741,16 @@ static int sndcp_send_ud_frag(struct sndcp_frag_state *fs,
 	uint8_t *data;
 	int rc, more;
 
-	fmsg = msgb_alloc_headroom(fs->sne->lle->params.n201_u+256, 128,
-				   "SNDCP Frag");
+	fmsg = sndcp_dl_msgb_alloc(lle->params.n201_u, "SNDCP Frag");
 	if (!fmsg) {
-		msgb_free(fs->msg);
+		sndcp_frag_state_release(fs);
 		return -ENOMEM;
 	}
 
 	/* make sure lower layers route the fragment like the original */
-	msgb_tlli(fmsg) = msgb_tlli(fs->msg);
-	msgb_bvci(fmsg) = msgb_bvci(fs->msg);
-	msgb_nsei(fmsg) = msgb_nsei(fs->msg);
+	msgb_tlli(fmsg) = fs->tlli;
+	msgb_bvci(fmsg) = fs->bvci;
+	msgb_nsei(fmsg) = fs->nsei;
 
 	/* prepend common SNDCP header */
 	sch = (struct sndcp_common_hdr *) msgb_put(fmsg, sizeof(*sch));
@@ -582,7 +775,7 @@ static int sndcp_send_ud_frag(struct sndcp_frag_state *fs,
 	suh->seg_nr = fs->frag_nr % 0xf;
 
 	/* calculate remaining length to be sent */
-	len = (fs->msg->data + fs->msg->len) - fs->next_byte;
+	len = fs->end - fs->next_byte;
 	/* how much payload can we actually send via LLC? */
 	max_payload_len = lle->params.n201_u - (sizeof(*sch) + sizeof(*suh));
 	if (sch->first)
@@ -594,13 +787,14 @@ static int sndcp_send_ud_frag(struct sndcp_frag_state *fs,
 	/* copy the actual fragment data into our fmsg */
 	data = msgb_put(fmsg, len);
 	memcpy(data, fs->next_byte, len);
+	sndcp_dl_stats.bytes_copied += len;
 
 	/* Increment fragment number and data pointer to next fragment */
 	fs->frag_nr++;
 	fs->next_byte += len;
 
 	/* determine if we have more fragemnts to send */
-	if ((fs->msg->data + fs->msg->len) <= fs->next_byte)
+	if (fs->end <= fs->next_byte)
 		more = 0;
 	else
 		more = 1;
@@ -608,16 +802,22 @@ static int sndcp_send_ud_frag(struct sndcp_frag_state *fs,
 	/* set the MORE bit of the SNDCP header accordingly */
 	sch->more = more;
 
-	rc = gprs_llc_tx_ui(fmsg, lle->sapi, 0, fs->mmcontext, true);
-	/* abort in case of error, do not advance frag_nr / next_byte */
+	/* queue the fragment, the keystreams for ciphering are generated
+	 * for all fragments of a burst together */
+	fs->burst[fs->burst_len++] = fmsg;
+	if (more && fs->burst_len < GPRS_LLC_UI_BURST_MAX)
+		return 1;
+
+	rc = sndcp_frag_flush(fs);
+	/* abort in case of error */
 	if (rc < 0) {
-		msgb_free(fs->msg);
+		sndcp_frag_state_release(fs);
 		return rc;
 	}
 
 	if (!more) {
 		/* we've sent all fragments */
-		msgb_free(fs->msg);
+		sndcp_frag_state_release(fs);
 		memset(fs, 0, sizeof(*fs));
 		/* increment NPDU number for next frame */
 		sne->tx_npdu_nr = (sne->tx_npdu_nr + 1) % 0xfff;
@@ -639,10 +839,14 @@ int sndcp_unitdata_req(struct msgb *msg, struct gprs_llc_lle *lle, uint8_t nsapi
 	struct sndcp_frag_state fs;
 	uint8_t pcomp = 0;
 	uint8_t dcomp = 0;
+	bool prio;
 	int rc;
 
 	/* Identifiers from UP: (TLLI, SAPI) + (BVCI, NSEI) */
 
+	/* Classify before the headers are compressed */
+	prio = sndcp_dl_prio(msg->data, msg->len);
+
 	/* Compress packet */
 #if DEBUG_IP_PACKETS == 1
 	DEBUGP(DSNDCP, "                                                   \n");
@@ -650,11 +854,11 @@ int sndcp_unitdata_req(struct msgb *msg, struct gprs_llc_lle *lle, uint8_t nsapi
 	DEBUGP(DSNDCP, "===================================================\n");
 	debug_ip_packet(msg->data, msg->len, 0, "sndcp_initdata_req()");
 #endif
-	if (any_pcomp_or_dcomp_active(sgsn)) {
+	if (comp_active(lle->llme, nsapi)) {
 
 		/* Apply header compression */
 		rc = gprs_sndcp_pcomp_compress(msg->data, msg->len, &pcomp,
-					       lle->llme->comp.proto, nsapi);
+					       comp_entities(lle->llme->comp.proto), nsapi);
 		if (rc < 0) {
 			LOGP(DSNDCP, LOGL_ERROR,
 			     "TCP/IP Header compression failed!\n");
@@ -668,7 +872,7 @@ int sndcp_unitdata_req(struct msgb *msg, struct gprs_llc_lle *lle, uint8_t nsapi
 
 		/* Apply data compression */
 		rc = gprs_sndcp_dcomp_compress(msg->data, msg->len, &dcomp,
-					       lle->llme->comp.data, nsapi);
+					       comp_entities(lle->llme->comp.data), nsapi);
 		if (rc < 0) {
 			LOGP(DSNDCP, LOGL_ERROR, "Data compression failed!\n");
 			return -EIO;
@@ -693,14 +897,19 @@ int sndcp_unitdata_req(struct msgb *msg, struct gprs_llc_lle *lle, uint8_t nsapi
 	}
 
 	/* Check if we need to fragment this N-PDU into multiple SN-PDUs */
-	if (msg->len > lle->params.n201_u - 
-			(sizeof(*sch) + sizeof(*suh) + sizeof(*scomph))) {
+	if (msg->len > sndcp_max_unfrag_len(lle)) {
 		/* initialize the fragmenter state */
 		fs.msg = msg;
 		fs.frag_nr = 0;
 		fs.next_byte = msg->data;
+		fs.end = msg->data + msg->len;
+		fs.tlli = msgb_tlli(msg);
+		fs.bvci = msgb_bvci(msg);
+		fs.nsei = msgb_nsei(msg);
 		fs.sne = sne;
 		fs.mmcontext = mmcontext;
+		fs.prio = prio;
+		fs.burst_len = 0;
 
 		/* call function to generate and send fragments until all
 		 * of the N-PDU has been sent */
@@ -734,7 +943,60 @@ int sndcp_unitdata_req(struct msgb *msg, struct gprs_llc_lle *lle, uint8_t nsapi
 	sch->type = 1;
 	sch->nsapi = nsapi;
 
-	return gprs_llc_tx_ui(msg, lle->sapi, 0, mmcontext, true);
+	return gprs_llc_tx_ui_burst(&msg, 1, lle->sapi, 0, mmcontext, true,
+				    prio);
+}
+
+/* Request transmission of a N-PDU that is not held in a msgb yet, like the
+ * payload of a GTP-U packet that is still owned by libgtp. The payload is
+ * copied exactly once: straight into the SN-PDU fragments if it needs to be
+ * fragmented, otherwise into a single msgb that has room for all headers
+ * of the lower layers. Compression works in place on the whole N-PDU, so
+ * it always takes the msgb path. */
+int sndcp_unitdata_req_data(const uint8_t *data, unsigned int len,
+			    struct gprs_llc_lle *lle, uint8_t nsapi,
+			    void *mmcontext, uint32_t tlli, uint16_t nsei,
+			    uint16_t bvci)
+{
+	struct gprs_sndcp_entity *sne;
+	struct sndcp_frag_state fs;
+	struct msgb *msg;
+
+	sndcp_dl_stats.npdus++;
+
+	sne = gprs_sndcp_entity_by_lle(lle, nsapi);
+	if (sne && len > sndcp_max_unfrag_len(lle)
+	    && !comp_active(lle->llme, nsapi)) {
+		fs.msg = NULL;
+		fs.frag_nr = 0;
+		fs.next_byte = data;
+		fs.end = data + len;
+		fs.tlli = tlli;
+		fs.bvci = bvci;
+		fs.nsei = nsei;
+		fs.sne = sne;
+		fs.mmcontext = mmcontext;
+		fs.prio = sndcp_dl_prio(data, len);
+		fs.burst_len = 0;
+
+		while (1) {
+			int rc = sndcp_send_ud_frag(&fs, 0, 0);
+			if (rc <= 0)
+				return rc;
+		}
+	}
+
+	msg = sndcp_dl_msgb_alloc(len, "GTP->SNDCP");
+	if (!msg)
+		return -ENOMEM;
+	memcpy(msgb_put(msg, len), data, len);
+	sndcp_dl_stats.bytes_copied += len;
+
+	msgb_tlli(msg) = tlli;
+	msgb_bvci(msg) = bvci;
+	msgb_nsei(msg) = nsei;
+
+	return sndcp_unitdata_req(msg, lle, nsapi, mmcontext);
 }
 
 /* Section 5.1.2.17 LL-UNITDATA.ind */
@@ -750,6 +1012,7 @@ int sndcp_llunitdata_ind(struct msgb *msg, struct gprs_llc_lle *lle,
 	int npdu_len;
 	int rc;
 	uint8_t *expnd = NULL;
+	bool decompress;
 
 	sch = (struct sndcp_common_hdr *) hdr;
 	if (sch->first) {
@@ -781,8 +1044,8 @@ int sndcp_llunitdata_ind(struct msgb *msg, struct gprs_llc_lle *lle,
 	if (scomph) {
 		sne->defrag.pcomp = scomph->pcomp;
 		sne->defrag.dcomp = scomph->dcomp;
-		sne->defrag.proto = lle->llme->comp.proto;
-		sne->defrag.data = lle->llme->comp.data;
+		sne->defrag.proto = comp_entities(lle->llme->comp.proto);
+		sne->defrag.data = comp_entities(lle->llme->comp.data);
 	}
 
 	/* any non-first segment is by definition something to defragment
@@ -801,13 +1064,15 @@ int sndcp_llunitdata_ind(struct msgb *msg, struct gprs_llc_lle *lle,
 	/* actually send the N-PDU to the SGSN core code, which then
 	 * hands it off to the correct GTP tunnel + GGSN via gtp_data_req() */
 
-	/* Decompress packet */
+	/* Decompress packet, unless nothing was negotiated or applied */
+	decompress = comp_active(lle->llme, sne->nsapi) &&
+		     (sne->defrag.pcomp || sne->defrag.dcomp);
 #if DEBUG_IP_PACKETS == 1
 	DEBUGP(DSNDCP, "                                                   \n");
 	DEBUGP(DSNDCP, ":::::::::::::::::::::::::::::::::::::::::::::::::::\n");
 	DEBUGP(DSNDCP, "===================================================\n");
 #endif
-	if (any_pcomp_or_dcomp_active(sgsn)) {
+	if (decompress) {
 
 		expnd = talloc_zero_size(msg, npdu_len * MAX_DATADECOMPR_FAC +
 					 MAX_HDRDECOMPR_INCR);
@@ -849,7 +1114,7 @@ int sndcp_llunitdata_ind(struct msgb *msg, struct gprs_llc_lle *lle,
 	rc = sgsn_rx_sndcp_ud_ind(&sne->ra_id, lle->llme->tlli,
 				  sne->nsapi, msg, npdu_len, expnd);
 
-	if (any_pcomp_or_dcomp_active(sgsn))
+	if (decompress)
 		talloc_free(expnd);
 
 	return rc;
@@ -985,10 +1250,13 @@ int sndcp_sn_xid_req(struct gprs_llc_lle *lle, uint8_t nsapi)
 
 	/* Wipe off all compression entities and their states to
 	 * get rid of possible leftovers from a previous session */
-	gprs_sndcp_comp_free(lle->llme->comp.proto);
-	gprs_sndcp_comp_free(lle->llme->comp.data);
-	lle->llme->comp.proto = gprs_sndcp_comp_alloc(lle->llme);
-	lle->llme->comp.data = gprs_sndcp_comp_alloc(lle->llme);
+	if (lle->llme->comp.proto)
+		gprs_sndcp_comp_free(lle->llme->comp.proto);
+	if (lle->llme->comp.data)
+		gprs_sndcp_comp_free(lle->llme->comp.data);
+	lle->llme->comp.proto = NULL;
+	lle->llme->comp.data = NULL;
+	lle->llme->comp.nsapis = 0;
 	talloc_free(lle->xid);
 	lle->xid = NULL;
 
@@ -1027,12 +1295,13 @@ static int handle_pcomp_entities(struct gprs_sndcp_comp_field *comp_field,
 		    && comp_field->rfc1144_params->nsapi_len > 0) {
 			DEBUGP(DSNDCP,
 			       "Accepting RFC1144 header compression...\n");
-			gprs_sndcp_comp_add(lle->llme, lle->llme->comp.proto,
+			gprs_sndcp_comp_add(lle->llme,
+					    comp_entities_alloc(lle->llme, &lle->llme->comp.proto),
 					    comp_field);
 		} else {
 			DEBUGP(DSNDCP,
 			       "Rejecting RFC1144 header compression...\n");
-			gprs_sndcp_comp_delete(lle->llme->comp.proto,
+			gprs_sndcp_comp_delete(comp_entities(lle->llme->comp.proto),
 					       comp_field->entity);
 			comp_field->rfc1144_params->nsapi_len = 0;
 		}
@@ -1042,7 +1311,7 @@ static int handle_pcomp_entities(struct gprs_sndcp_comp_field *comp_field,
 		 * so we set applicable nsapis to zero */
 		DEBUGP(DSNDCP, "Rejecting RFC2507 header compression...\n");
 		comp_field->rfc2507_params->nsapi_len = 0;
-		gprs_sndcp_comp_delete(lle->llme->comp.proto,
+		gprs_sndcp_comp_delete(comp_entities(lle->llme->comp.proto),
 				       comp_field->entity);
 		break;
 	case ROHC:
@@ -1050,7 +1319,7 @@ static int handle_pcomp_entities(struct gprs_sndcp_comp_field *comp_field,
 		 * so we set applicable nsapis to zero */
 		DEBUGP(DSNDCP, "Rejecting ROHC header compression...\n");
 		comp_field->rohc_params->nsapi_len = 0;
-		gprs_sndcp_comp_delete(lle->llme->comp.proto,
+		gprs_sndcp_comp_delete(comp_entities(lle->llme->comp.proto),
 				       comp_field->entity);
 		break;
 	}
@@ -1074,12 +1343,13 @@ static int handle_dcomp_entities(struct gprs_sndcp_comp_field *comp_field,
 		    comp_field->v42bis_params->nsapi_len > 0) {
 			DEBUGP(DSNDCP,
 			       "Accepting V.42bis data compression...\n");
-			gprs_sndcp_comp_add(lle->llme, lle->llme->comp.data,
+			gprs_sndcp_comp_add(lle->llme,
+					    comp_entities_alloc(lle->llme, &lle->llme->comp.data),
 					    comp_field);
 		} else {
 			LOGP(DSNDCP, LOGL_DEBUG,
 			     "Rejecting V.42bis data compression...\n");
-			gprs_sndcp_comp_delete(lle->llme->comp.data,
+			gprs_sndcp_comp_delete(comp_entities(lle->llme->comp.data),
 					       comp_field->entity);
 			comp_field->v42bis_params->nsapi_len = 0;
 		}
@@ -1089,7 +1359,7 @@ static int handle_dcomp_entities(struct gprs_sndcp_comp_field *comp_field,
 		 * so we set applicable nsapis to zero */
 		DEBUGP(DSNDCP, "Rejecting V.44 data compression...\n");
 		comp_field->v44_params->nsapi_len = 0;
-		gprs_sndcp_comp_delete(lle->llme->comp.data,
+		gprs_sndcp_comp_delete(comp_entities(lle->llme->comp.data),
 				       comp_field->entity);
 		break;
 	}
@@ -1147,13 +1417,15 @@ int sndcp_sn_xid_ind(struct gprs_llc_xid_field *xid_field_indication,
 		else if (compclass == SNDCP_XID_DATA_COMPRESSION)
 			rc = handle_dcomp_entities(comp_field, lle);
 		else {
-			gprs_sndcp_comp_delete(lle->llme->comp.proto,
+			gprs_sndcp_comp_delete(comp_entities(lle->llme->comp.proto),
 					       comp_field->entity);
-			gprs_sndcp_comp_delete(lle->llme->comp.data,
+			gprs_sndcp_comp_delete(comp_entities(lle->llme->comp.data),
 					       comp_field->entity);
 			rc = 0;
 		}
 
+		comp_entities_update_nsapis(lle->llme);
+
 		if (rc < 0) {
 			talloc_free(comp_fields);
 			return -EINVAL;
@@ -1244,13 +1516,15 @@ int sndcp_sn_xid_conf(struct gprs_llc_xid_field *xid_field_conf,
 		else if (compclass == SNDCP_XID_DATA_COMPRESSION)
 			rc = handle_dcomp_entities(comp_field, lle);
 		else {
-			gprs_sndcp_comp_delete(lle->llme->comp.proto,
+			gprs_sndcp_comp_delete(comp_entities(lle->llme->comp.proto),
 					       comp_field->entity);
-			gprs_sndcp_comp_delete(lle->llme->comp.data,
+			gprs_sndcp_comp_delete(comp_entities(lle->llme->comp.data),
 					       comp_field->entity);
 			rc = 0;
 		}
 
+		comp_entities_update_nsapis(lle->llme);
+
 		if (rc < 0) {
 			talloc_free(comp_fields_req);
 			talloc_free(comp_fields_conf);
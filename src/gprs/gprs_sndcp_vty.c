@@ -53,11 +53,16 @@ DEFUN(show_sndcp, show_sndcp_cmd,
 	"show sndcp",
 	SHOW_STR "Display information about the SNDCP protocol")
 {
-	struct gprs_sndcp_entity *sne;
+	struct gprs_llc_llme *llme;
+	unsigned int i;
 
 	vty_out(vty, "State of SNDCP Entities%s", VTY_NEWLINE);
-	llist_for_each_entry(sne, &gprs_sndcp_entities, list)
-		vty_dump_sne(vty, sne);
+	llist_for_each_entry(llme, gprs_llme_list(), list) {
+		for (i = 0; i < ARRAY_SIZE(llme->sne); i++) {
+			if (llme->sne[i])
+				vty_dump_sne(vty, llme->sne[i]);
+		}
+	}
 
 	return CMD_SUCCESS;
 }
@@ -0,0 +1,204 @@
+/* Binary ring of per-packet trace records */
+
+/* (C) 2026 by sysmocom s.f.m.c. GmbH <info@sysmocom.de>
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Debug logging formats and hexdumps every frame, which is far too slow
+ * to leave on under load. Instead, the LLC and SNDCP paths store a fixed
+ * size record per packet here, to be looked at with "show sgsn
+ * packet-trace" or written to a file and decoded offline with
+ * osmo-sgsn-trace-decode. */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/timer.h>
+#include <osmocom/core/utils.h>
+
+#include <osmocom/sgsn/gprs_trace.h>
+
+osmo_static_assert(sizeof(struct gprs_trace_rec) == 24, gprs_trace_rec_size);
+
+const struct value_string gprs_trace_point_names[] = {
+	{ GPRS_TRACE_LLC_UL,	"LLC-UL" },
+	{ GPRS_TRACE_LLC_DL,	"LLC-DL" },
+	{ GPRS_TRACE_SNDCP_UL,	"SNDCP-UL" },
+	{ GPRS_TRACE_SNDCP_DL,	"SNDCP-DL" },
+	{ 0, NULL }
+};
+
+const struct value_string gprs_trace_verdict_names[] = {
+	{ GPRS_TRACE_V_OK,	"ok" },
+	{ GPRS_TRACE_V_INVALID,	"invalid" },
+	{ GPRS_TRACE_V_NO_CTX,	"no-context" },
+	{ GPRS_TRACE_V_CIPHER,	"cipher" },
+	{ GPRS_TRACE_V_FCS,	"bad-fcs" },
+	{ GPRS_TRACE_V_DUP,	"duplicate" },
+	{ GPRS_TRACE_V_POLICED,	"policed" },
+	{ GPRS_TRACE_V_QUEUED,	"queued" },
+	{ GPRS_TRACE_V_DROPPED,	"dropped" },
+	{ 0, NULL }
+};
+
+struct gprs_trace_ring gprs_trace_ring;
+
+/* (Re-)allocate the ring for num_recs records, rounded up to a power of
+ * two, or switch tracing off with 0. Records traced so far are lost. */
+int gprs_trace_init(void *ctx, unsigned int num_recs)
+{
+	struct gprs_trace_rec *recs;
+	unsigned int size = 1;
+
+	talloc_free(gprs_trace_ring.recs);
+	memset(&gprs_trace_ring, 0, sizeof(gprs_trace_ring));
+	if (!num_recs)
+		return 0;
+
+	while (size < num_recs)
+		size <<= 1;
+	recs = talloc_zero_array(ctx, struct gprs_trace_rec, size);
+	if (!recs)
+		return -ENOMEM;
+	talloc_set_name_const(recs, "packet trace");
+
+	gprs_trace_ring.mask = size - 1;
+	gprs_trace_ring.recs = recs;
+	return 0;
+}
+
+void _gprs_trace_pkt(uint8_t point, uint8_t verdict, uint32_t tlli,
+		     uint8_t sapi, uint8_t nsapi, uint16_t nu, unsigned int len)
+{
+	struct gprs_trace_rec *rec;
+	struct timespec ts;
+	uint32_t seq;
+
+	seq = __atomic_add_fetch(&gprs_trace_ring.head, 1, __ATOMIC_RELAXED);
+	rec = &gprs_trace_ring.recs[seq & gprs_trace_ring.mask];
+
+	/* readers skip the record until the new seq is visible */
+	__atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	osmo_clock_gettime(CLOCK_REALTIME, &ts);
+	rec->tlli = tlli;
+	rec->time_us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	rec->len = OSMO_MIN(len, UINT16_MAX);
+	rec->nu = nu;
+	rec->point = point;
+	rec->verdict = verdict;
+	rec->sapi = sapi;
+	rec->nsapi = nsapi;
+
+	/* seq 0 after 2^32 records marks the record as being written
+	 * forever, it is lost */
+	__atomic_store_n(&rec->seq, seq, __ATOMIC_RELEASE);
+}
+
+/* Copy up to max of the newest records to out, oldest first. Records that
+ * are overwritten during the copy are left out. */
+unsigned int gprs_trace_snapshot(struct gprs_trace_rec *out, unsigned int max)
+{
+	const struct gprs_trace_rec *rec;
+	unsigned int num = 0, n;
+	uint32_t head, seq;
+
+	if (!gprs_trace_ring.recs)
+		return 0;
+
+	head = __atomic_load_n(&gprs_trace_ring.head, __ATOMIC_ACQUIRE);
+	n = OSMO_MIN(head, gprs_trace_ring.mask + 1);
+	n = OSMO_MIN(n, max);
+
+	for (seq = head - n + 1; seq != head + 1; seq++) {
+		rec = &gprs_trace_ring.recs[seq & gprs_trace_ring.mask];
+		if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != seq)
+			continue;
+		out[num] = *rec;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&rec->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+		num++;
+	}
+
+	return num;
+}
+
+/* Write a snapshot of the whole ring to path, returns the number of
+ * records written or a negative error */
+int gprs_trace_write(const char *path)
+{
+	struct gprs_trace_file_hdr hdr;
+	struct gprs_trace_rec *recs;
+	FILE *f;
+	int rc;
+
+	if (!gprs_trace_ring.recs)
+		return -ENODEV;
+
+	recs = talloc_array(NULL, struct gprs_trace_rec,
+			    gprs_trace_ring.mask + 1);
+	if (!recs)
+		return -ENOMEM;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = GPRS_TRACE_FILE_MAGIC;
+	hdr.version = GPRS_TRACE_FILE_VERSION;
+	hdr.rec_size = sizeof(struct gprs_trace_rec);
+	hdr.num = gprs_trace_snapshot(recs, gprs_trace_ring.mask + 1);
+
+	f = fopen(path, "w");
+	if (!f) {
+		rc = -errno;
+		talloc_free(recs);
+		return rc;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    fwrite(recs, sizeof(*recs), hdr.num, f) != hdr.num)
+		rc = -EIO;
+	else
+		rc = hdr.num;
+	if (fclose(f) != 0 && rc >= 0)
+		rc = -errno;
+
+	talloc_free(recs);
+	return rc;
+}
+
+/* Describe a record without its time stamp, as snprintf() does */
+int gprs_trace_rec_str(char *buf, size_t buf_len,
+		       const struct gprs_trace_rec *rec)
+{
+	char sapi[16] = "", nsapi[16] = "", nu[16] = "";
+
+	if (rec->sapi != GPRS_TRACE_NO_ID)
+		snprintf(sapi, sizeof(sapi), " SAPI=%u", rec->sapi);
+	if (rec->nsapi != GPRS_TRACE_NO_ID)
+		snprintf(nsapi, sizeof(nsapi), " NSAPI=%u", rec->nsapi);
+	if (rec->nu != GPRS_TRACE_NO_NU)
+		snprintf(nu, sizeof(nu), " N(U)=%u", rec->nu);
+
+	return snprintf(buf, buf_len, "#%u %s TLLI=%08x%s%s%s len=%u %s",
+			rec->seq,
+			get_value_string(gprs_trace_point_names, rec->point),
+			rec->tlli, sapi, nsapi, nu, rec->len,
+			get_value_string(gprs_trace_verdict_names, rec->verdict));
+}
@@ -0,0 +1,118 @@
+/* Offline decoder for packet trace snapshots of osmo-sgsn */
+
+/* (C) 2026 by sysmocom s.f.m.c. GmbH <info@sysmocom.de>
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Prints the records of a file written by "packet-trace snapshot FILE",
+ * one per line, with the time stamp in UTC and optionally only those of
+ * one TLLI */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include <osmocom/core/utils.h>
+
+#include <osmocom/sgsn/gprs_trace.h>
+
+static void print_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-t TLLI] FILE\n"
+		"  -t TLLI   only show records of this TLLI (hex)\n", prog);
+}
+
+static void print_rec(const struct gprs_trace_rec *rec)
+{
+	char buf[128], tbuf[32];
+	time_t sec = rec->time_us / 1000000;
+	struct tm tm;
+
+	gmtime_r(&sec, &tm);
+	strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", &tm);
+	gprs_trace_rec_str(buf, sizeof(buf), rec);
+	printf("%s.%06u %s\n", tbuf, (unsigned int)(rec->time_us % 1000000),
+	       buf);
+}
+
+int main(int argc, char **argv)
+{
+	struct gprs_trace_file_hdr hdr;
+	struct gprs_trace_rec rec;
+	bool filter = false;
+	uint32_t tlli = 0;
+	unsigned int i;
+	FILE *f;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "ht:")) != -1) {
+		switch (opt) {
+		case 't':
+			tlli = strtoul(optarg, NULL, 16);
+			filter = true;
+			break;
+		case 'h':
+		default:
+			print_usage(argv[0]);
+			exit(opt == 'h' ? 0 : 1);
+		}
+	}
+	if (optind != argc - 1) {
+		print_usage(argv[0]);
+		exit(1);
+	}
+
+	f = fopen(argv[optind], "r");
+	if (!f) {
+		perror(argv[optind]);
+		exit(1);
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1) {
+		fprintf(stderr, "%s: truncated header\n", argv[optind]);
+		exit(1);
+	}
+	if (hdr.magic != GPRS_TRACE_FILE_MAGIC) {
+		fprintf(stderr, "%s: not a packet trace%s\n", argv[optind],
+			hdr.magic == __builtin_bswap32(GPRS_TRACE_FILE_MAGIC) ?
+			" of this byte order" : "");
+		exit(1);
+	}
+	if (hdr.version != GPRS_TRACE_FILE_VERSION ||
+	    hdr.rec_size != sizeof(rec)) {
+		fprintf(stderr, "%s: unsupported version %u, record size %u\n",
+			argv[optind], hdr.version, hdr.rec_size);
+		exit(1);
+	}
+
+	for (i = 0; i < hdr.num; i++) {
+		if (fread(&rec, sizeof(rec), 1, f) != 1) {
+			fprintf(stderr, "%s: truncated after %u of %u records\n",
+				argv[optind], i, hdr.num);
+			exit(1);
+		}
+		if (filter && rec.tlli != tlli)
+			continue;
+		print_rec(&rec);
+	}
+
+	fclose(f);
+	return 0;
+}
@@ -39,6 +39,7 @@
 #include <osmocom/core/talloc.h>
 #include <osmocom/core/select.h>
 #include <osmocom/core/rate_ctr.h>
+#include <osmocom/core/timer.h>
 #include <osmocom/gprs/gprs_bssgp.h>
 #include <osmocom/gsm/protocol/gsm_04_08_gprs.h>
 
@@ -50,6 +51,8 @@
 #include <osmocom/sgsn/gprs_gmm.h>
 #include <osmocom/sgsn/gprs_subscriber.h>
 #include <osmocom/sgsn/gprs_sndcp.h>
+#include <osmocom/sgsn/gprs_msgb_pool.h>
+#include <osmocom/sgsn/gprs_trace.h>
 
 #ifdef BUILD_IU
 #include <osmocom/ranap/iu_client.h>
@@ -375,7 +378,9 @@ static int send_act_pdp_cont_acc(struct sgsn_pdp_ctx *pctx)
 
 	if (pctx->mm->ran_type == MM_CTX_T_GERAN_Gb) {
 		/* Send SNDCP XID to MS */
-		lle = &pctx->mm->gb.llme->lle[pctx->sapi];
+		lle = gprs_llme_lle(pctx->mm->gb.llme, pctx->sapi);
+		if (!lle)
+			return -ENOMEM;
 		rc = sndcp_sn_xid_req(lle,pctx->nsapi);
 		if (rc < 0)
 			return rc;
@@ -388,6 +393,7 @@ static int send_act_pdp_cont_acc(struct sgsn_pdp_ctx *pctx)
 static int create_pdp_conf(struct pdp_t *pdp, void *cbp, int cause)
 {
 	struct sgsn_pdp_ctx *pctx = cbp;
+	struct gprs_llc_lle *lle;
 	uint8_t reject_cause = 0;
 
 	LOGPDPCTXP(LOGL_INFO, pctx, "Received CREATE PDP CTX CONF, cause=%d(%s)\n",
@@ -417,9 +423,19 @@ static int create_pdp_conf(struct pdp_t *pdp, void *cbp, int cause)
 		goto reject;
 	}
 
+	/* Police the user data by what the GGSN has granted */
+	sgsn_pdp_policer_set(pctx, pdp->qos_neg.v, pdp->qos_neg.l);
+
 	if (pctx->mm->ran_type == MM_CTX_T_GERAN_Gb) {
+		lle = gprs_llme_lle(pctx->mm->gb.llme, pctx->sapi);
+		if (!lle) {
+			LOGPDPCTXP(LOGL_ERROR, pctx, "Cannot allocate LLE for "
+				   "SAPI %u\n", pctx->sapi);
+			reject_cause = GSM_CAUSE_INSUFF_RSRC;
+			goto reject;
+		}
 		/* Activate the SNDCP layer */
-		sndcp_sm_activate_ind(&pctx->mm->gb.llme->lle[pctx->sapi], pctx->nsapi);
+		sndcp_sm_activate_ind(lle, pctx->nsapi);
 		return send_act_pdp_cont_acc(pctx);
 	} else if (pctx->mm->ran_type == MM_CTX_T_UTRAN_Iu) {
 #ifdef BUILD_IU
@@ -541,6 +557,7 @@ static int delete_pdp_conf(struct pdp_t *pdp, void *cbp, int cause)
 {
 	struct sgsn_signal_data sig_data;
 	struct sgsn_pdp_ctx *pctx = cbp;
+	struct gprs_llc_lle *lle;
 	int rc = 0;
 
 	LOGPDPCTXP(LOGL_INFO, pctx, "Received DELETE PDP CTX CONF, cause=%d(%s)\n",
@@ -552,8 +569,10 @@ static int delete_pdp_conf(struct pdp_t *pdp, void *cbp, int cause)
 
 	if (pctx->mm) {
 		if (pctx->mm->ran_type == MM_CTX_T_GERAN_Gb) {
+			lle = gprs_llme_lle(pctx->mm->gb.llme, pctx->sapi);
 			/* Deactivate the SNDCP layer */
-			sndcp_sm_deactivate_ind(&pctx->mm->gb.llme->lle[pctx->sapi], pctx->nsapi);
+			if (lle)
+				sndcp_sm_deactivate_ind(lle, pctx->nsapi);
 		} else {
 #ifdef BUILD_IU
 			/* Deactivate radio bearer */
@@ -673,14 +692,187 @@ static int cb_extheader_ind(struct sockaddr_in *peer)
 	return 0;
 }
 
+static void pdp_count_dl_udata(struct sgsn_pdp_ctx *pdp, unsigned int len)
+{
+	sgsn_pdp_ctx_count_ud_out(pdp, len);
+
+	/* It is easier to have a global count */
+	pdp->cdr_bytes_out += len;
+}
+
+/* A downlink N-PDU waiting in the queue of its PDP context, allocated as
+ * talloc child of the msgb holding the N-PDU */
+struct dl_queue_entry {
+	struct llist_head list;
+	struct msgb *msg;
+	time_t enqueued;
+};
+
+static time_t dl_queue_now(void)
+{
+	struct timespec now_tp;
+	int rc;
+
+	rc = osmo_clock_gettime(CLOCK_MONOTONIC, &now_tp);
+	OSMO_ASSERT(rc >= 0);
+	return now_tp.tv_sec;
+}
+
+static void dl_queue_drop_head(struct sgsn_pdp_ctx *pdp, int ctr)
+{
+	struct dl_queue_entry *qe;
+
+	qe = llist_entry(pdp->dl_queue.next, struct dl_queue_entry, list);
+	llist_del(&qe->list);
+	pdp->dl_queue_len--;
+	pdp->dl_queue_bytes -= msgb_length(qe->msg);
+	rate_ctr_inc(&pdp->ctrg->ctr[ctr]);
+	msgb_free(qe->msg);
+}
+
+/* The queue is in arrival order, so expired N-PDUs are found at its head */
+static void dl_queue_expire(struct sgsn_pdp_ctx *pdp, time_t now)
+{
+	struct dl_queue_entry *qe;
+
+	while (!llist_empty(&pdp->dl_queue)) {
+		qe = llist_entry(pdp->dl_queue.next, struct dl_queue_entry, list);
+		if (now - qe->enqueued < sgsn->cfg.dl_queue.max_age)
+			break;
+		dl_queue_drop_head(pdp, PDP_CTR_DL_EXPIRED);
+	}
+}
+
+/* Buffer a downlink N-PDU until the MS can be reached again. If the queue
+ * is full, the oldest N-PDUs are dropped to make room for the new one. */
+int sgsn_pdp_dl_queue_add(struct sgsn_pdp_ctx *pdp, const uint8_t *data,
+			  unsigned int len)
+{
+	const unsigned int max_pkts = sgsn->cfg.dl_queue.max_pkts;
+	const unsigned int max_bytes = sgsn->cfg.dl_queue.max_bytes;
+	time_t now = dl_queue_now();
+	struct dl_queue_entry *qe;
+	struct msgb *msg;
+
+	dl_queue_expire(pdp, now);
+
+	if (max_pkts == 0 || len > max_bytes) {
+		rate_ctr_inc(&pdp->ctrg->ctr[PDP_CTR_DL_DROPPED]);
+		return -ENOSPC;
+	}
+
+	while (pdp->dl_queue_len >= max_pkts ||
+	       pdp->dl_queue_bytes + len > max_bytes)
+		dl_queue_drop_head(pdp, PDP_CTR_DL_DROPPED);
+
+	msg = gprs_msgb_alloc_headroom(GPRS_LLC_DL_HEADROOM + len +
+				       GPRS_LLC_DL_TAILROOM,
+				       GPRS_LLC_DL_HEADROOM, "GTP->SNDCP queued");
+	if (!msg)
+		return -ENOMEM;
+	qe = talloc_zero(msg, struct dl_queue_entry);
+	if (!qe) {
+		msgb_free(msg);
+		return -ENOMEM;
+	}
+	memcpy(msgb_put(msg, len), data, len);
+	qe->msg = msg;
+	qe->enqueued = now;
+
+	llist_add_tail(&qe->list, &pdp->dl_queue);
+	pdp->dl_queue_len++;
+	pdp->dl_queue_bytes += len;
+	rate_ctr_inc(&pdp->ctrg->ctr[PDP_CTR_DL_QUEUED]);
+
+	return 0;
+}
+
+/* Send the buffered N-PDUs of a PDP context in the order they arrived,
+ * N-PDUs that have been waiting for too long are dropped */
+int sgsn_pdp_dl_queue_flush(struct sgsn_pdp_ctx *pdp)
+{
+	struct sgsn_mm_ctx *mm = pdp->mm;
+	struct dl_queue_entry *qe;
+	struct gprs_llc_lle *lle;
+	struct msgb *msg;
+	int rc = 0;
+
+	if (llist_empty(&pdp->dl_queue))
+		return 0;
+
+	dl_queue_expire(pdp, dl_queue_now());
+
+	if (!mm || mm->ran_type != MM_CTX_T_GERAN_Gb) {
+		sgsn_pdp_dl_queue_purge(pdp);
+		return 0;
+	}
+
+	lle = gprs_llme_lle(mm->gb.llme, pdp->sapi);
+	if (!lle) {
+		sgsn_pdp_dl_queue_purge(pdp);
+		return -ENOMEM;
+	}
+
+	LOGPDPCTXP(LOGL_INFO, pdp, "Sending %u buffered DL N-PDUs\n",
+		   pdp->dl_queue_len);
+
+	while (!llist_empty(&pdp->dl_queue)) {
+		qe = llist_entry(pdp->dl_queue.next, struct dl_queue_entry, list);
+		msg = qe->msg;
+		llist_del(&qe->list);
+		talloc_free(qe);
+		pdp->dl_queue_len--;
+		pdp->dl_queue_bytes -= msgb_length(msg);
+
+		msgb_tlli(msg) = mm->gb.tlli;
+		msgb_bvci(msg) = mm->gb.bvci;
+		msgb_nsei(msg) = mm->gb.nsei;
+
+		rate_ctr_inc(&pdp->ctrg->ctr[PDP_CTR_DL_FLUSHED]);
+		pdp_count_dl_udata(pdp, msgb_length(msg));
+
+		rc = sndcp_unitdata_req(msg, lle, pdp->nsapi, mm);
+	}
+
+	return rc;
+}
+
+/* Drop all buffered N-PDUs, e.g. when the PDP context goes away */
+void sgsn_pdp_dl_queue_purge(struct sgsn_pdp_ctx *pdp)
+{
+	struct dl_queue_entry *qe, *qe2;
+
+	llist_for_each_entry_safe(qe, qe2, &pdp->dl_queue, list) {
+		llist_del(&qe->list);
+		msgb_free(qe->msg);
+	}
+	pdp->dl_queue_len = 0;
+	pdp->dl_queue_bytes = 0;
+}
+
+/* The MS can be reached again, send what was buffered for all NSAPIs */
+void sgsn_mm_ctx_dl_queue_flush(struct sgsn_mm_ctx *mm)
+{
+	struct sgsn_pdp_ctx *pdp, *pdp2;
+
+	llist_for_each_entry_safe(pdp, pdp2, &mm->pdp_list, list)
+		sgsn_pdp_dl_queue_flush(pdp);
+}
+
+static void sgsn_trace_dl(const struct sgsn_pdp_ctx *pdp, unsigned int len,
+			  enum gprs_trace_verdict verdict)
+{
+	gprs_trace_pkt(GPRS_TRACE_SNDCP_DL, verdict, pdp->mm->gb.tlli,
+		       pdp->sapi, pdp->nsapi, GPRS_TRACE_NO_NU, len);
+}
+
 /* Called whenever we receive a DATA packet */
 static int cb_data_ind(struct pdp_t *lib, void *packet, unsigned int len)
 {
 	struct bssgp_paging_info pinfo;
 	struct sgsn_pdp_ctx *pdp;
+	struct gprs_llc_lle *lle;
 	struct sgsn_mm_ctx *mm;
-	struct msgb *msg;
-	uint8_t *ud;
 
 	pdp = lib->priv;
 	if (!pdp) {
@@ -711,48 +903,61 @@ static int cb_data_ind(struct pdp_t *lib, void *packet, unsigned int len)
 #endif
 	}
 
-	msg = msgb_alloc_headroom(len+256, 128, "GTP->SNDCP");
-	ud = msgb_put(msg, len);
-	memcpy(ud, packet, len);
-
-	msgb_tlli(msg) = mm->gb.tlli;
-	msgb_bvci(msg) = mm->gb.bvci;
-	msgb_nsei(msg) = mm->gb.nsei;
+	if (!sgsn_pdp_policer_conform(&pdp->policer_dl, len)) {
+		rate_ctr_inc(&pdp->ctrg->ctr[PDP_CTR_DL_POLICED]);
+		sgsn_trace_dl(pdp, len, GPRS_TRACE_V_POLICED);
+		return -ENOBUFS;
+	}
 
 	switch (mm->gmm_state) {
 	case GMM_REGISTERED_SUSPENDED:
-		/* initiate PS PAGING procedure */
-		memset(&pinfo, 0, sizeof(pinfo));
-		pinfo.mode = BSSGP_PAGING_PS;
-		pinfo.scope = BSSGP_PAGING_BVCI;
-		pinfo.bvci = mm->gb.bvci;
-		pinfo.imsi = mm->imsi;
-		pinfo.ptmsi = &mm->p_tmsi;
-		pinfo.drx_params = mm->drx_parms;
-		pinfo.qos[0] = 0; // FIXME
-		bssgp_tx_paging(mm->gb.nsei, 0, &pinfo);
-		rate_ctr_inc(&mm->ctrg->ctr[GMM_CTR_PAGING_PS]);
-		/* FIXME: queue the packet we received from GTP */
-		break;
+		/* initiate PS PAGING procedure, unless N-PDUs are already
+		 * waiting for the MS */
+		if (llist_empty(&pdp->dl_queue)) {
+			memset(&pinfo, 0, sizeof(pinfo));
+			pinfo.mode = BSSGP_PAGING_PS;
+			pinfo.scope = BSSGP_PAGING_BVCI;
+			pinfo.bvci = mm->gb.bvci;
+			pinfo.imsi = mm->imsi;
+			pinfo.ptmsi = &mm->p_tmsi;
+			pinfo.drx_params = mm->drx_parms;
+			pinfo.qos[0] = 0; // FIXME
+			bssgp_tx_paging(mm->gb.nsei, 0, &pinfo);
+			rate_ctr_inc(&mm->ctrg->ctr[GMM_CTR_PAGING_PS]);
+		}
+		/* hold the N-PDU back until the MS resumes */
+		sgsn_trace_dl(pdp, len, GPRS_TRACE_V_QUEUED);
+		return sgsn_pdp_dl_queue_add(pdp, packet, len);
 	case GMM_REGISTERED_NORMAL:
 		break;
 	default:
 		LOGP(DGPRS, LOGL_ERROR, "GTP DATA IND for TLLI %08X in state "
 			"%u\n", mm->gb.tlli, mm->gmm_state);
-		msgb_free(msg);
+		sgsn_trace_dl(pdp, len, GPRS_TRACE_V_DROPPED);
 		return -1;
 	}
 
-	rate_ctr_inc(&pdp->ctrg->ctr[PDP_CTR_PKTS_UDATA_OUT]);
-	rate_ctr_add(&pdp->ctrg->ctr[PDP_CTR_BYTES_UDATA_OUT], len);
-	rate_ctr_inc(&mm->ctrg->ctr[GMM_CTR_PKTS_UDATA_OUT]);
-	rate_ctr_add(&mm->ctrg->ctr[GMM_CTR_BYTES_UDATA_OUT], len);
+	lle = gprs_llme_lle(mm->gb.llme, pdp->sapi);
+	if (!lle) {
+		sgsn_trace_dl(pdp, len, GPRS_TRACE_V_DROPPED);
+		return -ENOMEM;
+	}
 
-	/* It is easier to have a global count */
-	pdp->cdr_bytes_out += len;
+	pdp_count_dl_udata(pdp, len);
+	sgsn_trace_dl(pdp, len, GPRS_TRACE_V_OK);
 
-	return sndcp_unitdata_req(msg, &mm->gb.llme->lle[pdp->sapi],
-				  pdp->nsapi, mm);
+	/* The packet buffer belongs to libgtp, SNDCP copies it once into
+	 * msgbs that already have room for all lower layer headers */
+	return sndcp_unitdata_req_data(packet, len, lle,
+				       pdp->nsapi, mm, mm->gb.tlli,
+				       mm->gb.nsei, mm->gb.bvci);
+}
+
+static void sgsn_trace_ul(uint32_t tlli, uint8_t nsapi, unsigned int len,
+			  enum gprs_trace_verdict verdict)
+{
+	gprs_trace_pkt(GPRS_TRACE_SNDCP_UL, verdict, tlli, GPRS_TRACE_NO_ID,
+		       nsapi, GPRS_TRACE_NO_NU, len);
 }
 
 /* Called by SNDCP when it has received/re-assembled a N-PDU */
@@ -767,6 +972,7 @@ int sgsn_rx_sndcp_ud_ind(struct gprs_ra_id *ra_id, int32_t tlli, uint8_t nsapi,
 	if (!mmctx) {
 		LOGP(DGPRS, LOGL_ERROR,
 			"Cannot find MM CTX for TLLI %08x\n", tlli);
+		sgsn_trace_ul(tlli, nsapi, npdu_len, GPRS_TRACE_V_NO_CTX);
 		return -EIO;
 	}
 	/* look-up the PDP context for this message */
@@ -774,17 +980,23 @@ int sgsn_rx_sndcp_ud_ind(struct gprs_ra_id *ra_id, int32_t tlli, uint8_t nsapi,
 	if (!pdp) {
 		LOGP(DGPRS, LOGL_ERROR, "Cannot find PDP CTX for "
 			"TLLI=%08x, NSAPI=%u\n", tlli, nsapi);
+		sgsn_trace_ul(tlli, nsapi, npdu_len, GPRS_TRACE_V_NO_CTX);
 		return -EIO;
 	}
 	if (!pdp->lib) {
 		LOGP(DGPRS, LOGL_ERROR, "PDP CTX without libgtp\n");
+		sgsn_trace_ul(tlli, nsapi, npdu_len, GPRS_TRACE_V_NO_CTX);
 		return -EIO;
 	}
 
-	rate_ctr_inc(&pdp->ctrg->ctr[PDP_CTR_PKTS_UDATA_IN]);
-	rate_ctr_add(&pdp->ctrg->ctr[PDP_CTR_BYTES_UDATA_IN], npdu_len);
-	rate_ctr_inc(&mmctx->ctrg->ctr[GMM_CTR_PKTS_UDATA_IN]);
-	rate_ctr_add(&mmctx->ctrg->ctr[GMM_CTR_BYTES_UDATA_IN], npdu_len);
+	if (!sgsn_pdp_policer_conform(&pdp->policer_ul, npdu_len)) {
+		rate_ctr_inc(&pdp->ctrg->ctr[PDP_CTR_UL_POLICED]);
+		sgsn_trace_ul(tlli, nsapi, npdu_len, GPRS_TRACE_V_POLICED);
+		return -ENOBUFS;
+	}
+	sgsn_trace_ul(tlli, nsapi, npdu_len, GPRS_TRACE_V_OK);
+
+	sgsn_pdp_ctx_count_ud_in(pdp, npdu_len);
 
 	/* It is easier to have a global count */
 	pdp->cdr_bytes_in += npdu_len;
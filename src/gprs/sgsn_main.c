@@ -57,6 +57,8 @@
 #include <osmocom/sgsn/sgsn.h>
 #include <osmocom/sgsn/gprs_llc.h>
 #include <osmocom/sgsn/gprs_gmm.h>
+#include <osmocom/sgsn/gprs_offload.h>
+#include <osmocom/sgsn/gprs_trace.h>
 
 #include <osmocom/ctrl/control_if.h>
 #include <osmocom/ctrl/ports.h>
@@ -442,6 +444,20 @@ int main(int argc, char **argv)
 		exit(2);
 	}
 
+	rc = gprs_offload_start(tall_sgsn_ctx, sgsn->cfg.offload_workers);
+	if (rc < 0) {
+		LOGP(DGPRS, LOGL_FATAL, "Cannot start %u offload workers: %s\n",
+		     sgsn->cfg.offload_workers, strerror(-rc));
+		exit(1);
+	}
+
+	rc = gprs_trace_init(tall_sgsn_ctx, sgsn->cfg.trace_records);
+	if (rc < 0) {
+		LOGP(DGPRS, LOGL_FATAL, "Cannot allocate %u packet trace records\n",
+		     sgsn->cfg.trace_records);
+		exit(1);
+	}
+
 	/* start telnet after reading config for vty_get_bind_addr() */
 	rc = telnet_init_dynif(tall_sgsn_ctx, NULL,
 			       vty_get_bind_addr(), OSMO_VTY_PORT_SGSN);
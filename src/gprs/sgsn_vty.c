@@ -24,6 +24,7 @@
 #include <arpa/inet.h>
 #include <time.h>
 #include <inttypes.h>
+#include <string.h>
 
 #include <osmocom/core/talloc.h>
 #include <osmocom/core/utils.h>
@@ -37,6 +38,11 @@
 #include <osmocom/sgsn/gprs_gmm.h>
 #include <osmocom/sgsn/gprs_sgsn.h>
 #include <osmocom/sgsn/vty.h>
+#include <osmocom/sgsn/gprs_obj_pool.h>
+#include <osmocom/sgsn/gprs_msgb_pool.h>
+#include <osmocom/sgsn/gprs_offload.h>
+#include <osmocom/sgsn/gprs_dl_sched.h>
+#include <osmocom/sgsn/gprs_trace.h>
 #include <osmocom/gsupclient/gsup_client.h>
 
 #include <osmocom/vty/command.h>
@@ -88,6 +94,17 @@ const struct value_string sgsn_auth_pol_strs[] = {
 #define GSM0408_T3395_SECS	8	/* wait for DEACT PDP CTX ACK */
 #define GSM0408_T3397_SECS	8	/* wait for DEACT AA PDP CTX ACK */
 
+/* Downlink N-PDUs buffered per PDP context while the MS is suspended */
+#define SGSN_DL_QUEUE_MAX_PKTS	32
+#define SGSN_DL_QUEUE_MAX_BYTES	65536
+#define SGSN_DL_QUEUE_MAX_AGE	10	/* seconds */
+#define SGSN_DL_SCHED_QUANTUM	1600
+#define SGSN_DL_SCHED_MAX_BYTES	32768
+#define SGSN_DL_SCHED_PRIO_MAX_LEN	128
+#define SGSN_DL_SCHED_CODEL_TARGET	200	/* ms */
+#define SGSN_DL_SCHED_CODEL_INTERVAL	2000	/* ms */
+#define SGSN_QOS_POLICING_BURST	1000	/* ms */
+
 #define DECLARE_TIMER(number, doc) \
     DEFUN(cfg_sgsn_T##number,					\
       cfg_sgsn_T##number##_cmd,					\
@@ -264,6 +281,31 @@ static int config_write_sgsn(struct vty *vty)
 	vty_out(vty, " timer t3395 %d%s", g_cfg->timers.T3395, VTY_NEWLINE);
 	vty_out(vty, " timer t3397 %d%s", g_cfg->timers.T3397, VTY_NEWLINE);
 
+	vty_out(vty, " downlink-queue max-packets %u%s",
+		g_cfg->dl_queue.max_pkts, VTY_NEWLINE);
+	vty_out(vty, " downlink-queue max-bytes %u%s",
+		g_cfg->dl_queue.max_bytes, VTY_NEWLINE);
+	vty_out(vty, " downlink-queue max-age %u%s",
+		g_cfg->dl_queue.max_age, VTY_NEWLINE);
+	vty_out(vty, " offload-workers %u%s",
+		g_cfg->offload_workers, VTY_NEWLINE);
+	vty_out(vty, " packet-trace records %u%s",
+		g_cfg->trace_records, VTY_NEWLINE);
+	vty_out(vty, " downlink-scheduler quantum %u%s",
+		g_cfg->dl_sched.quantum, VTY_NEWLINE);
+	vty_out(vty, " downlink-scheduler max-bytes %u%s",
+		g_cfg->dl_sched.max_bytes, VTY_NEWLINE);
+	vty_out(vty, " downlink-scheduler priority max-length %u%s",
+		g_cfg->dl_sched.prio_max_len, VTY_NEWLINE);
+	vty_out(vty, " downlink-scheduler codel target %u%s",
+		g_cfg->dl_sched.codel_target, VTY_NEWLINE);
+	vty_out(vty, " downlink-scheduler codel interval %u%s",
+		g_cfg->dl_sched.codel_interval, VTY_NEWLINE);
+	vty_out(vty, " %sqos-policing%s",
+		g_cfg->qos_policing.enable ? "" : "no ", VTY_NEWLINE);
+	vty_out(vty, " qos-policing burst %u%s",
+		g_cfg->qos_policing.burst, VTY_NEWLINE);
+
 	if (g_cfg->pcomp_rfc1144.active) {
 		vty_out(vty, " compression rfc1144 active slots %d%s",
 			g_cfg->pcomp_rfc1144.s01 + 1, VTY_NEWLINE);
@@ -520,13 +562,19 @@ static void vty_dump_pdp(struct vty *vty, const char *pfx,
 		vty_out(vty, "Data(%s / TEID: 0x%08x)%s",
 			sgsn_gtp_ntoa(&pdp->lib->gsnru), pdp->lib->teid_gn, VTY_NEWLINE);
 	}
+	if (pdp->policer_ul.rate || pdp->policer_dl.rate)
+		vty_out(vty, "%s  Maximum bitrate UL: %u, DL: %u octet/s%s", pfx,
+			pdp->policer_ul.rate, pdp->policer_dl.rate, VTY_NEWLINE);
 
+	sgsn_pdp_ctx_ctrs_flush(pdp);
 	vty_out_rate_ctr_group(vty, " ", pdp->ctrg);
 }
 
 static void vty_dump_mmctx(struct vty *vty, const char *pfx,
 			   struct sgsn_mm_ctx *mm, int pdp)
 {
+	struct sgsn_pdp_ctx *pdp_ctx;
+
 	vty_out(vty, "%sMM Context for IMSI %s, IMEI %s, P-TMSI %08x%s",
 		pfx, mm->imsi, mm->imei, mm->p_tmsi, VTY_NEWLINE);
 	vty_out(vty, "%s  MSISDN: %s, TLLI: %08x%s HLR: %s",
@@ -535,6 +583,8 @@ static void vty_dump_mmctx(struct vty *vty, const char *pfx,
 		pfx, get_value_string(gprs_mm_st_strs, mm->gmm_state),
 		osmo_rai_name(&mm->ra), mm->gb.cell_id, VTY_NEWLINE);
 
+	llist_for_each_entry(pdp_ctx, &mm->pdp_list, list)
+		sgsn_pdp_ctx_ctrs_flush(pdp_ctx);
 	vty_out_rate_ctr_group(vty, " ", mm->ctrg);
 
 	if (pdp) {
@@ -564,6 +614,129 @@ DEFUN(show_sgsn, show_sgsn_cmd, "show sgsn",
 	return CMD_SUCCESS;
 }
 
+DEFUN(show_sgsn_pools, show_sgsn_pools_cmd, "show sgsn pools",
+      SHOW_STR "Display information about the SGSN\n"
+      "Display the object pool statistics\n")
+{
+	struct gprs_obj_pool *pool;
+	const struct gprs_msgb_pool *mpool;
+	unsigned int i;
+
+	llist_for_each_entry(pool, gprs_obj_pools(), list) {
+		vty_out(vty, "  %s: %u in use (peak %u), %u of max %u cached, "
+			"%llu allocations, %llu from cache%s",
+			pool->name, pool->stats.in_use, pool->stats.in_use_peak,
+			pool->stats.cached, pool->max_cached,
+			pool->stats.allocs, pool->stats.hits, VTY_NEWLINE);
+	}
+
+	for (i = 0; i < gprs_msgb_pools_num(); i++) {
+		mpool = gprs_msgb_pool_get(i);
+		vty_out(vty, "  %s: %u in use (peak %u), %u of max %u cached, "
+			"%llu allocations, %llu from cache (%llu%%)%s",
+			mpool->name, mpool->stats.in_use, mpool->stats.in_use_peak,
+			mpool->stats.cached, mpool->max_cached,
+			mpool->stats.allocs, mpool->stats.hits,
+			mpool->stats.allocs ?
+				mpool->stats.hits * 100 / mpool->stats.allocs : 0,
+			VTY_NEWLINE);
+	}
+	vty_out(vty, "  msgb oversize: %llu allocations%s",
+		gprs_msgb_pool_oversize, VTY_NEWLINE);
+
+	return CMD_SUCCESS;
+}
+
+DEFUN(show_sgsn_dl_sched, show_sgsn_dl_sched_cmd,
+      "show sgsn downlink-scheduler",
+      SHOW_STR "Display information about the SGSN\n"
+      "Display the downlink queues per BVC\n")
+{
+	struct bssgp_bvc_ctx *bctx;
+	struct gprs_dl_bvc *bvc;
+
+	llist_for_each_entry(bvc, &gprs_dl_bvcs, list) {
+		vty_out(vty, "  NSEI %u BVCI %u: %u MS (%u waiting), "
+			"%u frames / %u bytes queued%s",
+			bvc->nsei, bvc->bvci, bvc->num_ms, bvc->num_active,
+			bvc->stats.queued_frames, bvc->stats.queued_bytes,
+			VTY_NEWLINE);
+		bctx = btsctx_by_bvci_nsei(bvc->bvci, bvc->nsei);
+		if (bctx && bctx->fc)
+			vty_out(vty, "    BSSGP: bucket %u of %u bytes at %u "
+				"bytes/s, %u frames held back%s",
+				bctx->fc->bucket_counter,
+				bctx->fc->bucket_size_max,
+				bctx->fc->bucket_leak_rate,
+				bctx->fc->queue_depth, VTY_NEWLINE);
+		vty_out(vty, "    %llu frames / %llu bytes sent, %llu of them "
+			"after queueing, %llu dropped%s",
+			bvc->stats.sent_frames, bvc->stats.sent_bytes,
+			bvc->stats.deferred, bvc->stats.dropped, VTY_NEWLINE);
+		vty_out(vty, "    %u MS with priority frames waiting, %llu "
+			"priority frames sent, %llu bulk frames dropped by "
+			"CoDel%s", bvc->num_prio_active, bvc->stats.prio,
+			bvc->stats.codel_dropped, VTY_NEWLINE);
+	}
+
+	return CMD_SUCCESS;
+}
+
+#define PACKET_TRACE_STR "Per-packet trace ring\n"
+
+DEFUN(show_sgsn_packet_trace, show_sgsn_packet_trace_cmd,
+      "show sgsn packet-trace [<1-4096>]",
+      SHOW_STR "Display information about the SGSN\n"
+      PACKET_TRACE_STR "Number of the newest records to show (default 32)\n")
+{
+	unsigned int max = argc > 0 ? atoi(argv[0]) : 32;
+	struct gprs_trace_rec *recs;
+	char buf[128], tbuf[16];
+	unsigned int i, num;
+	struct tm tm;
+	time_t sec;
+
+	if (!gprs_trace_ring.recs) {
+		vty_out(vty, "%% Packet tracing is off%s", VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+
+	recs = talloc_array(tall_sgsn_ctx, struct gprs_trace_rec, max);
+	if (!recs)
+		return CMD_WARNING;
+	num = gprs_trace_snapshot(recs, max);
+
+	for (i = 0; i < num; i++) {
+		sec = recs[i].time_us / 1000000;
+		gmtime_r(&sec, &tm);
+		strftime(tbuf, sizeof(tbuf), "%H:%M:%S", &tm);
+		gprs_trace_rec_str(buf, sizeof(buf), &recs[i]);
+		vty_out(vty, "  %s.%06u %s%s", tbuf,
+			(unsigned int)(recs[i].time_us % 1000000), buf,
+			VTY_NEWLINE);
+	}
+
+	talloc_free(recs);
+	return CMD_SUCCESS;
+}
+
+DEFUN(packet_trace_snapshot, packet_trace_snapshot_cmd,
+      "packet-trace snapshot FILE",
+      PACKET_TRACE_STR
+      "Write the records in the ring to a file, for osmo-sgsn-trace-decode\n"
+      "Name of the file\n")
+{
+	int rc = gprs_trace_write(argv[0]);
+
+	if (rc < 0) {
+		vty_out(vty, "%% Unable to write the packet trace to %s: %s%s",
+			argv[0], strerror(-rc), VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+	vty_out(vty, "%d records written to %s%s", rc, argv[0], VTY_NEWLINE);
+	return CMD_SUCCESS;
+}
+
 #define MMCTX_STR "MM Context\n"
 #define INCLUDE_PDP_STR "Include PDP Context Information\n"
 
@@ -1271,6 +1444,160 @@ DEFUN(cfg_cdr_interval, cfg_cdr_interval_cmd,
 	return CMD_SUCCESS;
 }
 
+#define DL_QUEUE_STR "Buffering of downlink N-PDUs while the MS is suspended\n"
+DEFUN(cfg_dl_queue_max_pkts, cfg_dl_queue_max_pkts_cmd,
+	"downlink-queue max-packets <0-4096>",
+	DL_QUEUE_STR
+	"Maximum number of N-PDUs buffered per PDP context\n"
+	"Number of N-PDUs, 0 disables buffering\n")
+{
+	g_cfg->dl_queue.max_pkts = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_dl_queue_max_bytes, cfg_dl_queue_max_bytes_cmd,
+	"downlink-queue max-bytes <1500-1048576>",
+	DL_QUEUE_STR
+	"Maximum number of bytes buffered per PDP context\n"
+	"Number of bytes\n")
+{
+	g_cfg->dl_queue.max_bytes = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_dl_queue_max_age, cfg_dl_queue_max_age_cmd,
+	"downlink-queue max-age <1-3600>",
+	DL_QUEUE_STR
+	"Drop buffered N-PDUs that could not be sent in time\n"
+	"Maximum age in seconds\n")
+{
+	g_cfg->dl_queue.max_age = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+#define DL_SCHED_STR "Pacing of downlink LLC frames by BSSGP flow control\n"
+DEFUN(cfg_dl_sched_quantum, cfg_dl_sched_quantum_cmd,
+	"downlink-scheduler quantum <64-16384>",
+	DL_SCHED_STR
+	"Bytes an MS may send per round while others are waiting\n"
+	"Number of bytes\n")
+{
+	g_cfg->dl_sched.quantum = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_dl_sched_max_bytes, cfg_dl_sched_max_bytes_cmd,
+	"downlink-scheduler max-bytes <1600-1048576>",
+	DL_SCHED_STR
+	"Maximum number of bytes queued per MS\n"
+	"Number of bytes\n")
+{
+	g_cfg->dl_sched.max_bytes = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_dl_sched_prio_max_len, cfg_dl_sched_prio_max_len_cmd,
+	"downlink-scheduler priority max-length <0-1500>",
+	DL_SCHED_STR
+	"Classification of N-PDUs that are sent ahead of bulk data\n"
+	"Maximum length of an N-PDU to be sent with priority, pure TCP ACKs "
+	"and DNS have priority regardless\n"
+	"Number of bytes\n")
+{
+	g_cfg->dl_sched.prio_max_len = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+#define CODEL_STR "Active queue management of the bulk queue (CoDel)\n"
+DEFUN(cfg_dl_sched_codel_target, cfg_dl_sched_codel_target_cmd,
+	"downlink-scheduler codel target <0-10000>",
+	DL_SCHED_STR CODEL_STR
+	"Queueing delay that is accepted as standing queue\n"
+	"Delay in milliseconds, 0 to disable CoDel\n")
+{
+	g_cfg->dl_sched.codel_target = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_dl_sched_codel_interval, cfg_dl_sched_codel_interval_cmd,
+	"downlink-scheduler codel interval <10-60000>",
+	DL_SCHED_STR CODEL_STR
+	"Time the delay has to stay above the target before dropping\n"
+	"Interval in milliseconds\n")
+{
+	g_cfg->dl_sched.codel_interval = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+#define QOS_POLICING_STR "Drop user data above the maximum bitrate of the negotiated QoS\n"
+DEFUN(cfg_qos_policing, cfg_qos_policing_cmd,
+	"qos-policing",
+	QOS_POLICING_STR)
+{
+	g_cfg->qos_policing.enable = true;
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_no_qos_policing, cfg_no_qos_policing_cmd,
+	"no qos-policing",
+	NO_STR QOS_POLICING_STR)
+{
+	g_cfg->qos_policing.enable = false;
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_qos_policing_burst, cfg_qos_policing_burst_cmd,
+	"qos-policing burst <10-60000>",
+	QOS_POLICING_STR
+	"Size of the token bucket, as time at the maximum bitrate\n"
+	"Time in milliseconds\n")
+{
+	g_cfg->qos_policing.burst = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_offload_workers, cfg_offload_workers_cmd,
+	"offload-workers <0-16>",
+	"Generate GEA ciphering keystreams on worker threads\n"
+	"Number of worker threads, 0 to do it in the main loop\n")
+{
+	g_cfg->offload_workers = atoi(argv[0]);
+
+	/* on startup, the pool is started after reading the config */
+	if (vty->type == VTY_FILE)
+		return CMD_SUCCESS;
+
+	gprs_offload_stop();
+	if (gprs_offload_start(tall_sgsn_ctx, g_cfg->offload_workers) < 0) {
+		vty_out(vty, "%% Unable to start %u offload workers%s",
+			g_cfg->offload_workers, VTY_NEWLINE);
+		g_cfg->offload_workers = 0;
+		return CMD_WARNING;
+	}
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_packet_trace_records, cfg_packet_trace_records_cmd,
+	"packet-trace records <0-1048576>",
+	PACKET_TRACE_STR
+	"Size of the ring, rounded up to a power of two\n"
+	"Number of records, 0 to switch tracing off\n")
+{
+	g_cfg->trace_records = atoi(argv[0]);
+
+	/* on startup, the ring is allocated after reading the config */
+	if (vty->type == VTY_FILE)
+		return CMD_SUCCESS;
+
+	if (gprs_trace_init(tall_sgsn_ctx, g_cfg->trace_records) < 0) {
+		vty_out(vty, "%% Unable to allocate %u packet trace records%s",
+			g_cfg->trace_records, VTY_NEWLINE);
+		g_cfg->trace_records = 0;
+		return CMD_WARNING;
+	}
+	return CMD_SUCCESS;
+}
+
 #define COMPRESSION_STR "Configure compression\n"
 DEFUN(cfg_no_comp_rfc1144, cfg_no_comp_rfc1144_cmd,
       "no compression rfc1144",
@@ -1364,6 +1691,9 @@ int sgsn_vty_init(struct sgsn_config *cfg)
 	g_cfg = cfg;
 
 	install_element_ve(&show_sgsn_cmd);
+	install_element_ve(&show_sgsn_pools_cmd);
+	install_element_ve(&show_sgsn_dl_sched_cmd);
+	install_element_ve(&show_sgsn_packet_trace_cmd);
 	//install_element_ve(&show_mmctx_tlli_cmd);
 	install_element_ve(&show_mmctx_imsi_cmd);
 	install_element_ve(&show_mmctx_all_cmd);
@@ -1377,6 +1707,7 @@ int sgsn_vty_init(struct sgsn_config *cfg)
 	install_element(ENABLE_NODE, &update_subscr_update_location_result_cmd);
 	install_element(ENABLE_NODE, &update_subscr_update_auth_info_cmd);
 	install_element(ENABLE_NODE, &reset_sgsn_state_cmd);
+	install_element(ENABLE_NODE, &packet_trace_snapshot_cmd);
 
 	install_element(CONFIG_NODE, &cfg_sgsn_cmd);
 	install_node(&sgsn_node, config_write_sgsn);
@@ -1426,6 +1757,19 @@ int sgsn_vty_init(struct sgsn_config *cfg)
 	install_element(SGSN_NODE, &cfg_no_comp_v42bis_cmd);
 	install_element(SGSN_NODE, &cfg_comp_v42bis_cmd);
 	install_element(SGSN_NODE, &cfg_comp_v42bisp_cmd);
+	install_element(SGSN_NODE, &cfg_dl_queue_max_pkts_cmd);
+	install_element(SGSN_NODE, &cfg_dl_queue_max_bytes_cmd);
+	install_element(SGSN_NODE, &cfg_dl_queue_max_age_cmd);
+	install_element(SGSN_NODE, &cfg_offload_workers_cmd);
+	install_element(SGSN_NODE, &cfg_packet_trace_records_cmd);
+	install_element(SGSN_NODE, &cfg_qos_policing_cmd);
+	install_element(SGSN_NODE, &cfg_no_qos_policing_cmd);
+	install_element(SGSN_NODE, &cfg_qos_policing_burst_cmd);
+	install_element(SGSN_NODE, &cfg_dl_sched_quantum_cmd);
+	install_element(SGSN_NODE, &cfg_dl_sched_max_bytes_cmd);
+	install_element(SGSN_NODE, &cfg_dl_sched_prio_max_len_cmd);
+	install_element(SGSN_NODE, &cfg_dl_sched_codel_target_cmd);
+	install_element(SGSN_NODE, &cfg_dl_sched_codel_interval_cmd);
 
 #ifdef BUILD_IU
 	ranap_iu_vty_init(SGSN_NODE, &g_cfg->iu.rab_assign_addr_enc);
@@ -1453,6 +1797,16 @@ int sgsn_parse_config(const char *config_file)
 	g_cfg->timers.T3395 = GSM0408_T3395_SECS;
 	g_cfg->timers.T3397 = GSM0408_T3397_SECS;
 
+	g_cfg->dl_queue.max_pkts = SGSN_DL_QUEUE_MAX_PKTS;
+	g_cfg->dl_queue.max_bytes = SGSN_DL_QUEUE_MAX_BYTES;
+	g_cfg->dl_queue.max_age = SGSN_DL_QUEUE_MAX_AGE;
+	g_cfg->dl_sched.quantum = SGSN_DL_SCHED_QUANTUM;
+	g_cfg->dl_sched.max_bytes = SGSN_DL_SCHED_MAX_BYTES;
+	g_cfg->dl_sched.prio_max_len = SGSN_DL_SCHED_PRIO_MAX_LEN;
+	g_cfg->dl_sched.codel_target = SGSN_DL_SCHED_CODEL_TARGET;
+	g_cfg->dl_sched.codel_interval = SGSN_DL_SCHED_CODEL_INTERVAL;
+	g_cfg->qos_policing.burst = SGSN_QOS_POLICING_BURST;
+
 	rc = vty_read_config_file(config_file, NULL);
 	if (rc < 0) {
 		fprintf(stderr, "Failed to parse the config file: '%s'\n", config_file);
@@ -0,0 +1,73 @@
+/* Benchmark the LLC CRC-24 implementations, not run by the testsuite */
+
+/* (C) 2026 by sysmocom s.f.m.c. GmbH <info@sysmocom.de>
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <osmocom/sgsn/crc24.h>
+
+#include <osmocom/core/utils.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static uint8_t buf[1500];
+
+static uint64_t elapsed_ns(const struct timespec *start,
+			   const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000000ULL +
+		end->tv_nsec - start->tv_nsec;
+}
+
+static void bench(const char *name,
+		  uint32_t (*fn)(uint32_t, const uint8_t *, unsigned int),
+		  unsigned int len)
+{
+	const unsigned int rounds = 200000;
+	struct timespec start, end;
+	uint32_t fcs = INIT_CRC24;
+	unsigned int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < rounds; i++)
+		fcs = fn(fcs, buf, len);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	printf("%-8s %4u bytes: %6llu ns per frame (%06x)\n", name, len,
+	       (unsigned long long)(elapsed_ns(&start, &end) / rounds), fcs);
+}
+
+int main(int argc, char **argv)
+{
+	const unsigned int sizes[] = { 500, 1500 };
+	unsigned int i;
+
+	srand(42);
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = rand();
+
+	printf("PCLMULQDQ %savailable\n", crc24_have_pclmul() ? "" : "not ");
+
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		bench("bytewise", crc24_calc_bytewise, sizes[i]);
+		bench("slice8", crc24_calc_slice8, sizes[i]);
+		bench("pclmul", crc24_calc_pclmul, sizes[i]);
+	}
+
+	return 0;
+}
@@ -0,0 +1,80 @@
+/* Test the LLC CRC-24 implementations against each other */
+
+/* (C) 2026 by sysmocom s.f.m.c. GmbH <info@sysmocom.de>
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <osmocom/sgsn/crc24.h>
+
+#include <osmocom/core/utils.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_LEN 1600
+
+static uint8_t buf[MAX_LEN + 8];
+
+static void test_known_fcs(void)
+{
+	static const uint8_t check[] = "123456789";
+	uint32_t fcs;
+
+	printf("Testing CRC-24 of a known message\n");
+
+	fcs = crc24_calc(INIT_CRC24, (uint8_t *)check, 9);
+	printf("  CRC-24 of \"123456789\" = %06x\n", fcs);
+	OSMO_ASSERT(fcs == crc24_calc_bytewise(INIT_CRC24, check, 9));
+}
+
+/* All variants have to agree for every length and alignment, including
+ * lengths around the 8 and 64 byte boundaries of the block algorithms */
+static void test_variants(void)
+{
+	unsigned int len, off;
+
+	printf("Testing CRC-24 variants\n");
+
+	for (len = 0; len <= MAX_LEN; len++) {
+		for (off = 0; off < 8; off++) {
+			uint32_t ref = crc24_calc_bytewise(INIT_CRC24, buf + off, len);
+
+			OSMO_ASSERT(crc24_calc_slice8(INIT_CRC24, buf + off, len) == ref);
+			OSMO_ASSERT(crc24_calc_pclmul(INIT_CRC24, buf + off, len) == ref);
+			OSMO_ASSERT(crc24_calc(INIT_CRC24, buf + off, len) == ref);
+		}
+	}
+
+	/* a CRC can be continued over split buffers */
+	OSMO_ASSERT(crc24_calc(crc24_calc(INIT_CRC24, buf, 700), buf + 700, 800) ==
+		    crc24_calc_bytewise(INIT_CRC24, buf, 1500));
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int i;
+
+	srand(42);
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = rand();
+
+	test_known_fcs();
+	test_variants();
+
+	printf("Done\n");
+	return 0;
+}
@@ -0,0 +1,218 @@
+/* Benchmarks of the SGSN packet path, not run by the testsuite */
+
+/* (C) 2026 by sysmocom s.f.m.c. GmbH <info@sysmocom.de>
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <osmocom/sgsn/gprs_llc.h>
+#include <osmocom/sgsn/gprs_sgsn.h>
+#include <osmocom/sgsn/sgsn.h>
+#include <osmocom/sgsn/debug.h>
+
+#include <osmocom/gprs/gprs_bssgp.h>
+
+#include <osmocom/core/application.h>
+#include <osmocom/core/msgb.h>
+#include <osmocom/core/utils.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+void *tall_sgsn_ctx;
+static struct sgsn_instance sgsn_inst = {
+	.config_file = "osmo_sgsn.cfg",
+	.cfg = {
+		.gtp_statedir = "./",
+		.auth_policy = SGSN_AUTH_POLICY_CLOSED,
+	},
+};
+struct sgsn_instance *sgsn = &sgsn_inst;
+
+/* override, downlink frames are only counted */
+static unsigned int dl_frames;
+int bssgp_tx_dl_ud(struct msgb *msg, uint16_t pdu_lifetime,
+		   struct bssgp_dl_ud_par *dup)
+{
+	dl_frames++;
+	msgb_free(msg);
+	return 0;
+}
+
+static uint64_t elapsed_ns(const struct timespec *start,
+			   const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000000ULL +
+		end->tv_nsec - start->tv_nsec;
+}
+
+/* The lookup cost shall not depend on the number of MM contexts */
+static void bench_mm_ctx_lookup(void)
+{
+	const unsigned int sizes[] = { 1000, 10000, 100000 };
+	const unsigned int num_lookups = 1000000;
+	struct gprs_ra_id raid = { 0, };
+	unsigned int i, j;
+
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		const unsigned int num = sizes[i];
+		struct sgsn_mm_ctx *ctxs;
+		struct timespec start, end;
+
+		/* Only the TLLI index is exercised, so there is no need
+		 * for the full MM context set-up */
+		ctxs = talloc_zero_array(tall_sgsn_ctx, struct sgsn_mm_ctx, num);
+		OSMO_ASSERT(ctxs);
+		for (j = 0; j < num; j++) {
+			ctxs[j].ra = raid;
+			sgsn_mm_ctx_set_tlli(&ctxs[j],
+				gprs_tmsi2tlli(0xc0000000 + j, TLLI_FOREIGN));
+			sgsn_mm_ctx_set_tlli_new(&ctxs[j],
+				gprs_tmsi2tlli(0xc0000000 + j, TLLI_LOCAL));
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (j = 0; j < num_lookups; j++) {
+			struct sgsn_mm_ctx *ctx = &ctxs[j % num];
+			uint32_t tlli = (j & 1) ? ctx->gb.tlli_new : ctx->gb.tlli;
+
+			OSMO_ASSERT(sgsn_mm_ctx_by_tlli(tlli, &raid) == ctx);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		printf("MM context lookup by TLLI, %6u contexts: %4llu ns per lookup\n",
+		       num, (unsigned long long)(elapsed_ns(&start, &end) / num_lookups));
+
+		for (j = 0; j < num; j++) {
+			sgsn_mm_ctx_set_tlli(&ctxs[j], 0);
+			sgsn_mm_ctx_set_tlli_new(&ctxs[j], 0);
+		}
+		talloc_free(ctxs);
+	}
+}
+
+/* Logging is switched off, so there is no need to describe the categories */
+static struct msgb *llc_ui_msg(uint32_t tlli, const uint8_t *payload,
+				unsigned int len)
+{
+	struct msgb *msg = msgb_alloc_headroom(len + 128, 64, "LLC UI bench");
+
+	msgb_tlli(msg) = tlli;
+	memcpy(msgb_put(msg, len), payload, len);
+	return msg;
+}
+
+/* Cost per downlink UI frame with and without ciphering, including the
+ * FCS and the keystream generation, for single frames and for bursts */
+static void bench_llc_cipher(void)
+{
+	const unsigned int sizes[] = { 500, 1500 };
+	const enum gprs_ciph_algo algos[] = { GPRS_ALGO_GEA0, GPRS_ALGO_GEA3 };
+	const unsigned int num_pkts = 10000;
+	struct msgb *burst[GPRS_LLC_UI_BURST_MAX];
+	uint8_t payload[1500];
+	struct gprs_llc_lle *lle;
+	unsigned int i, j, k;
+	uint32_t tlli;
+
+	tlli = gprs_tmsi2tlli(0x456, TLLI_LOCAL);
+	lle = gprs_lle_get_or_create(tlli, 3);
+	OSMO_ASSERT(lle);
+	lle->params.n201_u = 1520;
+	lle->llme->iov_ui = 0x12345678;
+	for (i = 0; i < sizeof(lle->llme->kc); i++)
+		lle->llme->kc[i] = i * 17;
+	for (i = 0; i < sizeof(payload); i++)
+		payload[i] = i * 7;
+
+	for (k = 0; k < ARRAY_SIZE(algos); k++) {
+		lle->llme->algo = algos[k];
+		for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+			struct timespec start, end;
+
+			dl_frames = 0;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			for (j = 0; j < num_pkts; j++)
+				gprs_llc_tx_ui(llc_ui_msg(tlli, payload, sizes[i]),
+					       3, 0, NULL, true);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			OSMO_ASSERT(dl_frames == num_pkts);
+
+			printf("LLC UI %s %4u bytes: %5llu ns per frame\n",
+			       get_value_string(gprs_cipher_names, algos[k]),
+			       sizes[i],
+			       (unsigned long long)(elapsed_ns(&start, &end) / num_pkts));
+		}
+
+		for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+			struct timespec start, end;
+
+			dl_frames = 0;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			for (j = 0; j < num_pkts / GPRS_LLC_UI_BURST_MAX; j++) {
+				unsigned int l;
+
+				for (l = 0; l < GPRS_LLC_UI_BURST_MAX; l++)
+					burst[l] = llc_ui_msg(tlli, payload, sizes[i]);
+				gprs_llc_tx_ui_burst(burst, GPRS_LLC_UI_BURST_MAX,
+						     3, 0, NULL, true, false);
+			}
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			OSMO_ASSERT(dl_frames == j * GPRS_LLC_UI_BURST_MAX);
+
+			printf("LLC UI %s %4u bytes in bursts of %u: %5llu ns per frame\n",
+			       get_value_string(gprs_cipher_names, algos[k]),
+			       sizes[i], GPRS_LLC_UI_BURST_MAX,
+			       (unsigned long long)(elapsed_ns(&start, &end) / dl_frames));
+		}
+	}
+
+	gprs_llgmm_unassign(lle->llme);
+}
+
+static struct log_info_cat gprs_categories[Debug_LastEntry];
+
+static struct log_info info = {
+	.cat = gprs_categories,
+	.num_cat = ARRAY_SIZE(gprs_categories),
+};
+
+int main(int argc, char **argv)
+{
+	void *osmo_sgsn_ctx;
+
+	osmo_sgsn_ctx = talloc_named_const(NULL, 0, "osmo_sgsn");
+	osmo_init_logging2(osmo_sgsn_ctx, &info);
+	log_set_all_filter(osmo_stderr_target, 0);
+	tall_sgsn_ctx = talloc_named_const(osmo_sgsn_ctx, 0, "sgsn");
+	msgb_talloc_ctx_init(osmo_sgsn_ctx, 0);
+
+	sgsn_rate_ctr_init();
+
+	bench_mm_ctx_lookup();
+	bench_llc_cipher();
+
+	return 0;
+}
+
+
+/* stubs */
+struct osmo_prim_hdr;
+int bssgp_prim_cb(struct osmo_prim_hdr *oph, void *ctx)
+{
+	abort();
+}
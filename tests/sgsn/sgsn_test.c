@@ -28,6 +28,12 @@
 #include <osmocom/gsupclient/gsup_client.h>
 #include <osmocom/sgsn/gprs_utils.h>
 #include <osmocom/sgsn/gprs_gb_parse.h>
+#include <osmocom/sgsn/gprs_obj_pool.h>
+#include <osmocom/sgsn/gprs_msgb_pool.h>
+#include <osmocom/sgsn/gprs_offload.h>
+#include <osmocom/sgsn/gprs_dl_sched.h>
+#include <osmocom/sgsn/gprs_sndcp.h>
+#include <osmocom/sgsn/gprs_trace.h>
 
 #include <osmocom/gprs/gprs_bssgp.h>
 
@@ -36,9 +42,16 @@
 #include <osmocom/core/application.h>
 #include <osmocom/core/msgb.h>
 #include <osmocom/core/rate_ctr.h>
+#include <osmocom/core/select.h>
+#include <osmocom/core/timer.h>
 #include <osmocom/core/utils.h>
 
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 void *tall_sgsn_ctx;
 static struct sgsn_instance sgsn_inst = {
@@ -77,12 +90,76 @@ static uint32_t get_new_ptmsi(const struct gprs_gb_parse_context *parse_ctx)
 	return new_ptmsi;
 }
 
+static void *msgb_ctx;
+
+/* Frames sent while this is set are kept on it instead of being parsed */
+static struct llist_head *dl_kept_frames;
+
+/* Frames sent while this is set are counted in dl_captured instead of
+ * being parsed, and the last one is kept if dl_capture_keep is set */
+static bool dl_capture = false;
+static bool dl_capture_keep;
+static unsigned int dl_captured;
+/* N(U) of the last UI frame captured, and whether all of them came in
+ * order */
+static int dl_capture_nu = -1;
+static bool dl_capture_nu_ordered = true;
+/* TLLIs of the frames captured, if a log is given */
+static uint32_t *dl_capture_tllis;
+static unsigned int dl_capture_tllis_max;
+/* Frames pass the flow control of their BVC first, like in libosmogb */
+static bool dl_capture_fc;
+
+/* Count a captured frame, and optionally keep it as the last one without
+ * parsing it */
+static int dl_capture_rx(struct msgb *msg)
+{
+	int nu = ((msg->data[1] & 0x07) << 6) | (msg->data[2] >> 2);
+
+	if (dl_capture_nu >= 0 && nu != (dl_capture_nu + 1) % 512)
+		dl_capture_nu_ordered = false;
+	dl_capture_nu = nu;
+	if (dl_captured < dl_capture_tllis_max)
+		dl_capture_tllis[dl_captured] = msgb_tlli(msg);
+	dl_captured++;
+	if (dl_capture_keep) {
+		reset_last_msg();
+		last_msg = msg;
+	} else
+		msgb_free(msg);
+	return 0;
+}
+
+/* Output of the BVC flow control while dl_capture_fc is set */
+static int dl_capture_fc_out(struct bssgp_flow_control *fc, struct msgb *msg,
+			     uint32_t llc_pdu_len, void *priv)
+{
+	return dl_capture_rx(msg);
+}
+
 /* override */
 int bssgp_tx_dl_ud(struct msgb *msg, uint16_t pdu_lifetime,
 		   struct bssgp_dl_ud_par *dup)
 {
+	struct bssgp_bvc_ctx *bctx;
 	int rc;
 
+	if (dl_kept_frames) {
+		llist_add_tail(&msg->list, dl_kept_frames);
+		return 0;
+	}
+
+	if (dl_capture) {
+		if (!dl_capture_fc)
+			return dl_capture_rx(msg);
+		bctx = btsctx_by_bvci_nsei(msgb_bvci(msg), msgb_nsei(msg));
+		if (!bctx) {
+			msgb_free(msg);
+			return -ENODEV;
+		}
+		return bssgp_fc_in(bctx->fc, msg, msgb_length(msg), NULL);
+	}
+
 	reset_last_msg();
 
 	last_msg = msg;
@@ -192,7 +269,7 @@ static struct sgsn_mm_ctx *alloc_mm_ctx(uint32_t tlli, struct gprs_ra_id *raid)
 	lle = gprs_lle_get_or_create(tlli, 3);
 	ctx = sgsn_mm_ctx_alloc_gb(tlli, raid);
 	ctx->gmm_state = GMM_REGISTERED_NORMAL;
-	ctx->gb.llme = lle->llme;
+	sgsn_mm_ctx_set_llme(ctx, lle->llme);
 
 	ictx = sgsn_mm_ctx_by_tlli(tlli, raid);
 	OSMO_ASSERT(ictx == ctx);
@@ -1575,6 +1652,1069 @@ static void test_ggsn_selection(void)
 	cleanup_test();
 }
 
+/* Gb MM contexts are found through the TLLI index by their current and
+ * their new TLLI, only within their routeing area, and no longer by a TLLI
+ * they have given up */
+static void test_mm_ctx_lookup_index(void)
+{
+	const unsigned int num = 1000;
+	struct gprs_ra_id raid = { 0, };
+	struct gprs_ra_id other_raid = { .lac = 1 };
+	struct sgsn_mm_ctx *ctxs;
+	unsigned int i, found;
+
+	printf("Testing MM context lookup by TLLI\n");
+
+	/* Only the TLLI index is exercised, so there is no need for the
+	 * full MM context set-up */
+	ctxs = talloc_zero_array(tall_sgsn_ctx, struct sgsn_mm_ctx, num);
+	OSMO_ASSERT(ctxs);
+	for (i = 0; i < num; i++) {
+		ctxs[i].ra = raid;
+		sgsn_mm_ctx_set_tlli(&ctxs[i],
+			gprs_tmsi2tlli(0xc0000000 + i, TLLI_FOREIGN));
+		sgsn_mm_ctx_set_tlli_new(&ctxs[i],
+			gprs_tmsi2tlli(0xc0000000 + i, TLLI_LOCAL));
+	}
+
+	for (i = 0, found = 0; i < num; i++) {
+		OSMO_ASSERT(sgsn_mm_ctx_by_tlli(ctxs[i].gb.tlli, &other_raid) == NULL);
+		found += sgsn_mm_ctx_by_tlli(ctxs[i].gb.tlli, &raid) == &ctxs[i]
+			&& sgsn_mm_ctx_by_tlli(ctxs[i].gb.tlli_new, &raid) == &ctxs[i];
+	}
+	printf("  - %u of %u found by both TLLIs\n", found, num);
+
+	/* Every other MS completes a RA update and moves to its new TLLI */
+	for (i = 0; i < num; i += 2) {
+		sgsn_mm_ctx_set_tlli(&ctxs[i], ctxs[i].gb.tlli_new);
+		sgsn_mm_ctx_set_tlli_new(&ctxs[i], 0);
+	}
+	for (i = 0, found = 0; i < num; i++) {
+		uint32_t old_tlli = gprs_tmsi2tlli(0xc0000000 + i, TLLI_FOREIGN);
+
+		found += sgsn_mm_ctx_by_tlli(old_tlli, &raid) != NULL;
+		OSMO_ASSERT(sgsn_mm_ctx_by_tlli(
+			gprs_tmsi2tlli(0xc0000000 + i, TLLI_LOCAL), &raid) == &ctxs[i]);
+	}
+	printf("  - %u of %u still found by their old TLLI\n", found, num);
+
+	for (i = 0; i < num; i++) {
+		sgsn_mm_ctx_set_tlli(&ctxs[i], 0);
+		sgsn_mm_ctx_set_tlli_new(&ctxs[i], 0);
+	}
+	OSMO_ASSERT(sgsn_mm_ctx_by_tlli(gprs_tmsi2tlli(0xc0000000, TLLI_LOCAL),
+					&raid) == NULL);
+	talloc_free(ctxs);
+
+	cleanup_test();
+}
+
+struct pool_test_obj {
+	struct llist_head list;
+	uint32_t value;
+};
+
+static struct gprs_obj_pool test_pool =
+	GPRS_OBJ_POOL_INIT(test_pool, struct pool_test_obj, 1);
+
+static void test_obj_pool(void)
+{
+	struct pool_test_obj *a, *b, *c;
+	int old_blocks = talloc_total_blocks(tall_sgsn_ctx);
+
+	printf("Testing object pools\n");
+
+	a = gprs_obj_pool_alloc(&test_pool, tall_sgsn_ctx);
+	b = gprs_obj_pool_alloc(&test_pool, tall_sgsn_ctx);
+	OSMO_ASSERT(a && b && a != b);
+	a->value = 0x1234;
+	talloc_strdup(a, "child");
+	OSMO_ASSERT(test_pool.stats.in_use == 2);
+
+	/* Only one object is cached, children are freed right away */
+	gprs_obj_pool_free(&test_pool, a);
+	gprs_obj_pool_free(&test_pool, b);
+	OSMO_ASSERT(test_pool.stats.in_use == 0);
+	OSMO_ASSERT(test_pool.stats.cached == 1);
+	OSMO_ASSERT(talloc_total_blocks(tall_sgsn_ctx) == old_blocks + 1);
+
+	/* The cached object is handed out zeroed */
+	c = gprs_obj_pool_alloc(&test_pool, tall_sgsn_ctx);
+	OSMO_ASSERT(c == a);
+	OSMO_ASSERT(c->value == 0);
+	OSMO_ASSERT(test_pool.stats.cached == 0);
+	OSMO_ASSERT(test_pool.stats.hits == 1);
+	OSMO_ASSERT(test_pool.stats.allocs == 3);
+	OSMO_ASSERT(test_pool.stats.in_use_peak == 2);
+
+	gprs_obj_pool_free(&test_pool, c);
+	gprs_obj_pool_flush(&test_pool);
+	OSMO_ASSERT(talloc_total_blocks(tall_sgsn_ctx) == old_blocks);
+
+	cleanup_test();
+}
+
+static void test_msgb_pool(void)
+{
+	const struct gprs_msgb_pool *small = gprs_msgb_pool_get(0);
+	const struct gprs_msgb_pool *large = gprs_msgb_pool_get(2);
+	const uint16_t sizes[] = { 100, 1500, 4096, 5000 };
+	struct msgb *msgs[129];
+	struct msgb *a, *b;
+	unsigned long long oversize = gprs_msgb_pool_oversize;
+	unsigned long long hits;
+	unsigned int i;
+	int old_blocks;
+
+	printf("Testing msgb pools\n");
+
+	gprs_msgb_pools_flush();
+
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		a = gprs_msgb_alloc(sizes[i], "msgb pool test");
+		OSMO_ASSERT(a && msgb_tailroom(a) >= sizes[i]);
+		printf("  - %u bytes: %u byte buffer\n", sizes[i], a->data_len);
+		msgb_free(a);
+	}
+	OSMO_ASSERT(gprs_msgb_pool_oversize == oversize + 1);
+	gprs_msgb_pools_flush();
+
+	a = gprs_msgb_alloc_headroom(200, 64, "msgb pool test");
+	OSMO_ASSERT(a);
+	old_blocks = talloc_total_blocks(msgb_ctx);
+	memset(msgb_put(a, 100), 0x2a, 100);
+	msgb_tlli(a) = 0x1234;
+	talloc_strdup(a, "child");
+
+	/* A freed msgb is kept without its children and handed out again
+	 * as good as new */
+	hits = small->stats.hits;
+	msgb_free(a);
+	OSMO_ASSERT(small->stats.cached == 1);
+	OSMO_ASSERT(talloc_total_blocks(msgb_ctx) == old_blocks);
+	b = gprs_msgb_alloc(10, "msgb pool reuse");
+	OSMO_ASSERT(b == a);
+	OSMO_ASSERT(small->stats.hits == hits + 1);
+	OSMO_ASSERT(small->stats.cached == 0);
+	OSMO_ASSERT(msgb_length(b) == 0 && msgb_headroom(b) == 0);
+	OSMO_ASSERT(msgb_tailroom(b) == small->size);
+	OSMO_ASSERT(msgb_tlli(b) == 0);
+	OSMO_ASSERT(!strcmp(talloc_get_name(b), "msgb pool reuse"));
+	msgb_free(b);
+
+	/* Beyond max_cached msgbs are really freed */
+	for (i = 0; i < ARRAY_SIZE(msgs); i++)
+		msgs[i] = gprs_msgb_alloc(4000, "msgb pool test");
+	OSMO_ASSERT(large->stats.in_use == ARRAY_SIZE(msgs));
+	for (i = 0; i < ARRAY_SIZE(msgs); i++)
+		msgb_free(msgs[i]);
+	printf("  - %zu freed, %u cached\n", ARRAY_SIZE(msgs),
+	       large->stats.cached);
+	OSMO_ASSERT(large->stats.in_use == 0);
+
+	/* Without any msgb in use the pool context goes as well */
+	gprs_msgb_pools_flush();
+	OSMO_ASSERT(small->stats.cached == 0 && large->stats.cached == 0);
+	OSMO_ASSERT(talloc_total_blocks(msgb_ctx) == old_blocks - 2);
+
+	/* Freeing the pool context, like freeing its parent at shutdown,
+	 * releases the msgbs in use and the cached ones */
+	old_blocks = talloc_total_blocks(msgb_ctx);
+	a = gprs_msgb_alloc(10, "msgb pool test");
+	b = gprs_msgb_alloc(10, "msgb pool test");
+	OSMO_ASSERT(a && b);
+	msgb_free(b);
+	OSMO_ASSERT(small->stats.cached == 1);
+	OSMO_ASSERT(talloc_free(talloc_parent(a)) == 0);
+	OSMO_ASSERT(small->stats.in_use == 0 && small->stats.cached == 0);
+	OSMO_ASSERT(talloc_total_blocks(msgb_ctx) == old_blocks);
+
+	OSMO_ASSERT(!gprs_msgb_alloc(UINT16_MAX + 1, "msgb pool test"));
+
+	cleanup_test();
+}
+
+/* After a restart the SGSN gets routing area updates from MSs it does not
+ * know, and answers each of them with an XID reset and a reject. Keep all
+ * frames of such a burst to check the memory they take up, an XID reset
+ * of a few bytes shall not occupy more than the smallest msgb. */
+static void test_llc_ctrl_alloc(void)
+{
+	const unsigned int num_ms = 64;
+	struct gprs_ra_id raid = { 0, };
+	struct gprs_llc_lle *lle;
+	struct msgb *msg, *msg2;
+	unsigned int num_xid = 0, xid_buf_len = 0, i;
+	size_t old_size, peak;
+	uint32_t tlli;
+	LLIST_HEAD(frames);
+
+	/* DTAP - Routing Area Update Request */
+	static const unsigned char dtap_ra_upd_req[] = {
+		0x08, 0x08, 0x10, 0x11, 0x22, 0x33, 0x40, 0x50,
+		0x60, 0x1d, 0x19, 0x13, 0x42, 0x33, 0x57, 0x2b,
+		0xf7, 0xc8, 0x48, 0x02, 0x13, 0x48, 0x50, 0xc8,
+		0x48, 0x02, 0x14, 0x48, 0x50, 0xc8, 0x48, 0x02,
+		0x17, 0x49, 0x10, 0xc8, 0x48, 0x02, 0x00, 0x19,
+		0x8b, 0xb2, 0x92, 0x17, 0x16, 0x27, 0x07, 0x04,
+		0x31, 0x02, 0xe5, 0xe0, 0x32, 0x02, 0x20, 0x00
+	};
+
+	printf("Testing LLC control frame allocations\n");
+
+	/* cached msgbs would hide the allocations */
+	gprs_msgb_pools_flush();
+	old_size = talloc_total_size(msgb_ctx);
+
+	dl_kept_frames = &frames;
+	for (i = 0; i < num_ms; i++) {
+		tlli = gprs_tmsi2tlli(0xc0000100 + i, TLLI_FOREIGN);
+		lle = gprs_lle_get_or_create(tlli, 3);
+		send_0408_message(lle->llme, tlli, &raid,
+				  dtap_ra_upd_req, sizeof(dtap_ra_upd_req));
+	}
+	dl_kept_frames = NULL;
+	peak = talloc_total_size(msgb_ctx) - old_size;
+	OSMO_ASSERT(count(gprs_llme_list()) == 0);
+
+	llist_for_each_entry_safe(msg, msg2, &frames, list) {
+		if ((msg->data[1] & 0xe0) == 0xe0 &&
+		    (msg->data[1] & 0x0f) == GPRS_LLC_U_XID) {
+			num_xid++;
+			xid_buf_len += msg->data_len;
+		}
+		llist_del(&msg->list);
+		msgb_free(msg);
+	}
+	OSMO_ASSERT(num_xid == num_ms);
+	printf("  - %u XID resets in %u byte buffers\n", num_xid,
+	       xid_buf_len / num_xid);
+
+	/* The reject of each MS still comes in a GSM48_ALLOC_SIZE msgb */
+	fprintf(stderr, "Burst of %u MSs: %zu bytes of msgbs per MS\n",
+		num_ms, peak / num_ms);
+	OSMO_ASSERT(peak <= num_ms * (GSM48_ALLOC_SIZE + 1024));
+
+	cleanup_test();
+}
+
+/* Count buffer allocations and payload copies on the downlink path from
+ * GTP-U to BSSGP, every payload byte shall be copied only once */
+static void test_dl_zero_copy(void)
+{
+	const unsigned int sizes[] = { 100, 500, 1500 };
+	const unsigned int num_pkts = 100;
+	uint8_t payload[1500];
+	struct gprs_llc_lle *lle;
+	unsigned int i, j;
+	uint32_t tlli;
+
+	printf("Testing downlink copies\n");
+
+	tlli = gprs_tmsi2tlli(0x345, TLLI_LOCAL);
+	lle = gprs_lle_get_or_create(tlli, 3);
+	OSMO_ASSERT(lle);
+	OSMO_ASSERT(sndcp_sm_activate_ind(lle, 5) == 0);
+	memset(payload, 0x2a, sizeof(payload));
+
+	dl_capture = true;
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		const unsigned int len = sizes[i];
+
+		memset(&sndcp_dl_stats, 0, sizeof(sndcp_dl_stats));
+		dl_captured = 0;
+
+		for (j = 0; j < num_pkts; j++)
+			OSMO_ASSERT(sndcp_unitdata_req_data(payload, len, lle, 5,
+							    NULL, tlli, 1, 2) == 0);
+
+		OSMO_ASSERT(sndcp_dl_stats.npdus == num_pkts);
+		OSMO_ASSERT(sndcp_dl_stats.msgb_allocs == dl_captured);
+		OSMO_ASSERT(sndcp_dl_stats.bytes_copied == (unsigned long long)len * num_pkts);
+		printf("  - %u bytes: %llu msgbs, %llu bytes copied per packet\n",
+		       len, sndcp_dl_stats.msgb_allocs / num_pkts,
+		       sndcp_dl_stats.bytes_copied / num_pkts);
+	}
+	dl_capture = false;
+
+	gprs_llgmm_unassign(lle->llme);
+	OSMO_ASSERT(count(gprs_llme_list()) == 0);
+
+	cleanup_test();
+}
+
+static struct msgb *llc_ui_msg(uint32_t tlli, const uint8_t *payload,
+				unsigned int len)
+{
+	struct msgb *msg = msgb_alloc_headroom(len + 128, 64, "LLC UI test");
+
+	msgb_tlli(msg) = tlli;
+	memcpy(msgb_put(msg, len), payload, len);
+	return msg;
+}
+
+/* Set up the LLE of SAPI 3 for tlli with GEA3 and a fixed key, and fill
+ * payload with a pattern */
+static struct gprs_llc_lle *llc_gea3_lle(uint32_t tlli, uint8_t *payload,
+					 unsigned int len)
+{
+	struct gprs_llc_lle *lle = gprs_lle_get_or_create(tlli, 3);
+	unsigned int i;
+
+	OSMO_ASSERT(lle);
+	lle->params.n201_u = 1520;
+	lle->llme->algo = GPRS_ALGO_GEA3;
+	lle->llme->iov_ui = 0x12345678;
+	for (i = 0; i < sizeof(lle->llme->kc); i++)
+		lle->llme->kc[i] = i * 17;
+	for (i = 0; i < len; i++)
+		payload[i] = i * 7;
+	return lle;
+}
+
+/* Compare a frame ciphered by gprs_llc_tx_ui() with one that is ciphered
+ * here with a separately computed FCS and keystream */
+static bool llc_ui_ciphered_ok(const struct gprs_llc_lle *lle, uint16_t nu,
+			       uint32_t oc, const uint8_t *payload,
+			       unsigned int len, const struct msgb *msg)
+{
+	uint8_t frame[1506], ks[1503];
+	uint32_t fcs;
+	unsigned int i;
+
+	/* Plain frame with the E bit set, then encrypt the information
+	 * field + FCS */
+	frame[0] = lle->sapi;
+	frame[1] = 0xc0 | (nu >> 6);
+	frame[2] = ((nu << 2) & 0xfc) | 0x03;
+	memcpy(frame + 3, payload, len);
+	fcs = gprs_llc_fcs(frame, len + 3);
+	frame[len + 3] = fcs & 0xff;
+	frame[len + 4] = (fcs >> 8) & 0xff;
+	frame[len + 5] = (fcs >> 16) & 0xff;
+	OSMO_ASSERT(gprs_cipher_run(ks, len + 3, lle->llme->algo,
+		(uint8_t *)lle->llme->kc,
+		gprs_cipher_gen_input_ui(lle->llme->iov_ui, lle->sapi, nu, oc),
+		GPRS_CIPH_SGSN2MS) == 0);
+	for (i = 0; i < len + 3; i++)
+		frame[i + 3] ^= ks[i];
+
+	return msgb_length(msg) == len + 6 &&
+	       memcmp(msgb_data(msg), frame, len + 6) == 0;
+}
+
+/* The FCS is computed and the keystream applied in the same pass over a
+ * UI frame, and the keystreams for a burst of frames are generated
+ * together. Check the result against separately computed FCS and
+ * keystream. */
+static void test_llc_cipher(void)
+{
+	const unsigned int sizes[] = { 500, 1500 };
+	struct msgb *burst[GPRS_LLC_UI_BURST_MAX];
+	uint8_t payload[1500];
+	struct gprs_llc_lle *lle;
+	uint8_t *data;
+	unsigned int i;
+	uint32_t tlli, fcs;
+	uint16_t nu;
+	uint32_t oc;
+
+	printf("Testing LLC ciphering\n");
+
+	tlli = gprs_tmsi2tlli(0x456, TLLI_LOCAL);
+	lle = llc_gea3_lle(tlli, payload, sizeof(payload));
+
+	dl_capture = true;
+	dl_capture_keep = true;
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		const unsigned int len = sizes[i];
+
+		nu = lle->vu_send;
+		oc = lle->oc_ui_send;
+		OSMO_ASSERT(gprs_llc_tx_ui(llc_ui_msg(tlli, payload, len), 3, 0,
+					   NULL, true) == 0);
+		printf("  - %u bytes: ciphertext %s\n", len,
+		       llc_ui_ciphered_ok(lle, nu, oc, payload, len, last_msg) ?
+		       "matches" : "differs");
+	}
+
+	/* Only the last frame of a burst is kept, it has the highest N(U) */
+	for (i = 0; i < GPRS_LLC_UI_BURST_MAX; i++)
+		burst[i] = llc_ui_msg(tlli, payload, 500);
+	nu = (lle->vu_send + GPRS_LLC_UI_BURST_MAX - 1) % 512;
+	oc = lle->oc_ui_send;
+	dl_captured = 0;
+	OSMO_ASSERT(gprs_llc_tx_ui_burst(burst, GPRS_LLC_UI_BURST_MAX, 3, 0,
+					 NULL, true, false) == 0);
+	OSMO_ASSERT(dl_captured == GPRS_LLC_UI_BURST_MAX);
+	printf("  - burst of %u: ciphertext %s\n", GPRS_LLC_UI_BURST_MAX,
+	       llc_ui_ciphered_ok(lle, nu, oc, payload, 500, last_msg) ?
+	       "matches" : "differs");
+
+	/* With GEA0 the information field goes out as it is */
+	lle->llme->algo = GPRS_ALGO_GEA0;
+	OSMO_ASSERT(gprs_llc_tx_ui(llc_ui_msg(tlli, payload, 500), 3, 0,
+				   NULL, true) == 0);
+	data = msgb_data(last_msg);
+	fcs = gprs_llc_fcs(data, 503);
+	printf("  - GEA0: plaintext %s\n",
+	       msgb_length(last_msg) == 506 && !(data[2] & 0x02)
+	       && memcmp(data + 3, payload, 500) == 0
+	       && data[503] == (fcs & 0xff) && data[504] == ((fcs >> 8) & 0xff)
+	       && data[505] == ((fcs >> 16) & 0xff) ? "matches" : "differs");
+	dl_capture_keep = false;
+	reset_last_msg();
+	dl_capture = false;
+
+	gprs_llgmm_unassign(lle->llme);
+	OSMO_ASSERT(count(gprs_llme_list()) == 0);
+
+	cleanup_test();
+}
+
+/* With offload workers, the keystreams are generated on another thread
+ * and the frames are sent once they come back. Frames that are not to be
+ * ciphered wait behind the ones in flight, and frames of an LLME that is
+ * freed meanwhile are dropped. */
+static void test_llc_offload(void)
+{
+	const unsigned int num_bursts = 4;
+	struct msgb *burst[GPRS_LLC_UI_BURST_MAX];
+	uint8_t payload[500];
+	struct gprs_llc_lle *lle;
+	unsigned long long completed;
+	unsigned int i, j;
+	uint32_t tlli;
+	uint16_t nu;
+	uint32_t oc;
+
+	printf("Testing LLC ciphering on offload workers\n");
+
+	OSMO_ASSERT(gprs_offload_start(tall_sgsn_ctx, 2) == 0);
+
+	tlli = gprs_tmsi2tlli(0x789, TLLI_LOCAL);
+	lle = llc_gea3_lle(tlli, payload, sizeof(payload));
+
+	dl_capture = true;
+	dl_capture_keep = true;
+	dl_captured = 0;
+	dl_capture_nu = -1;
+	dl_capture_nu_ordered = true;
+	completed = gprs_offload_stats.completed;
+
+	for (j = 0; j < num_bursts; j++) {
+		for (i = 0; i < GPRS_LLC_UI_BURST_MAX; i++)
+			burst[i] = llc_ui_msg(tlli, payload, sizeof(payload));
+		OSMO_ASSERT(gprs_llc_tx_ui_burst(burst, GPRS_LLC_UI_BURST_MAX,
+						 3, 0, NULL, true, false) == 0);
+	}
+	nu = lle->vu_send;
+	OSMO_ASSERT(gprs_llc_tx_ui(llc_ui_msg(tlli, payload, sizeof(payload)),
+				   3, 0, NULL, false) == 0);
+	/* nothing is sent before the main loop picks up the results */
+	OSMO_ASSERT(dl_captured == 0);
+
+	while (gprs_offload_stats.completed < completed + num_bursts + 1)
+		osmo_select_main(0);
+	printf("  - %u frames sent %s\n", dl_captured,
+	       dl_capture_nu_ordered ? "in order" : "out of order");
+	printf("  - last frame %s\n",
+	       msgb_length(last_msg) == sizeof(payload) + 6 &&
+	       dl_capture_nu == nu && (last_msg->data[2] & 0x02) == 0 ?
+	       "is plain" : "is wrong");
+
+	/* Check a ciphered one, too */
+	nu = lle->vu_send;
+	oc = lle->oc_ui_send;
+	OSMO_ASSERT(gprs_llc_tx_ui(llc_ui_msg(tlli, payload, sizeof(payload)),
+				   3, 0, NULL, true) == 0);
+	while (gprs_offload_stats.completed < completed + num_bursts + 2)
+		osmo_select_main(0);
+	printf("  - ciphertext %s\n",
+	       llc_ui_ciphered_ok(lle, nu, oc, payload, sizeof(payload),
+				  last_msg) ? "matches" : "differs");
+
+	/* The LLME goes away while a burst is in flight */
+	dl_captured = 0;
+	for (i = 0; i < GPRS_LLC_UI_BURST_MAX; i++)
+		burst[i] = llc_ui_msg(tlli, payload, sizeof(payload));
+	OSMO_ASSERT(gprs_llc_tx_ui_burst(burst, GPRS_LLC_UI_BURST_MAX, 3, 0,
+					 NULL, true, false) == 0);
+	gprs_llgmm_unassign(lle->llme);
+	OSMO_ASSERT(count(gprs_llme_list()) == 0);
+	while (gprs_offload_stats.completed < completed + num_bursts + 3)
+		osmo_select_main(0);
+	printf("  - %u frames sent after the LLME was freed\n",
+	       dl_captured);
+
+	dl_capture_keep = false;
+	dl_capture = false;
+	reset_last_msg();
+	gprs_offload_stop();
+
+	cleanup_test();
+}
+
+static void dl_sched_advance_ms(unsigned int ms)
+{
+	unsigned int i;
+
+	for (i = 0; i < ms; i++) {
+		osmo_gettimeofday_override_add(0, 1000);
+		osmo_clock_override_add(CLOCK_MONOTONIC, 0, 1000000);
+		osmo_timers_prepare();
+		osmo_timers_update();
+	}
+}
+
+static struct msgb *dl_sched_msg(uint32_t tlli, uint16_t nsei, uint16_t bvci)
+{
+	static const uint8_t payload[500];
+	struct msgb *msg = llc_ui_msg(tlli, payload, sizeof(payload));
+
+	msgb_nsei(msg) = nsei;
+	msgb_bvci(msg) = bvci;
+	return msg;
+}
+
+static int dl_sched_tx(uint32_t tlli, uint16_t nsei, uint16_t bvci, bool prio)
+{
+	struct msgb *msg = dl_sched_msg(tlli, nsei, bvci);
+
+	return gprs_llc_tx_ui_burst(&msg, 1, 3, 0, NULL, false, prio);
+}
+
+/* Freeze the clocks and set up a BVC with a FLOW-CONTROL-BVC of 2000 bytes
+ * at 10000 bytes/s and no MS limit. The frames leaving its flow control
+ * are captured, with their TLLIs logged to tllis. */
+static struct bssgp_bvc_ctx *dl_sched_setup(uint16_t nsei, uint16_t bvci,
+					    uint32_t *tllis,
+					    unsigned int tllis_max)
+{
+	struct bssgp_bvc_ctx *bctx;
+
+	osmo_gettimeofday_override = true;
+	osmo_gettimeofday_override_time = (struct timeval){ 1000, 0 };
+	osmo_clock_override_enable(CLOCK_MONOTONIC, true);
+
+	sgsn_inst.cfg.dl_sched.quantum = 1000;
+	sgsn_inst.cfg.dl_sched.max_bytes = 4000;
+
+	bctx = btsctx_by_bvci_nsei(bvci, nsei);
+	if (!bctx)
+		bctx = btsctx_alloc(bvci, nsei);
+	OSMO_ASSERT(bctx);
+	bctx->fc->bucket_size_max = 2000;
+	bctx->fc->bucket_leak_rate = 10000;
+	bctx->fc->bucket_counter = 0;
+	bctx->fc->time_last_pdu = osmo_gettimeofday_override_time;
+	bctx->fc->out_cb = dl_capture_fc_out;
+	bctx->bmax_default_ms = 0;
+	bctx->r_default_ms = 0;
+
+	dl_capture = true;
+	dl_capture_fc = true;
+	dl_captured = 0;
+	dl_capture_tllis = tllis;
+	dl_capture_tllis_max = tllis_max;
+	return bctx;
+}
+
+static void dl_sched_teardown(void)
+{
+	dl_capture_tllis = NULL;
+	dl_capture_tllis_max = 0;
+	dl_capture_fc = false;
+	dl_capture = false;
+	osmo_clock_override_enable(CLOCK_MONOTONIC, false);
+	osmo_gettimeofday_override = false;
+}
+
+/* Downlink frames are paced by the buckets of the BVC and the MS, and the
+ * MSs waiting on one BVC take turns by deficit round robin. The BVC bucket
+ * is the one of the BSSGP flow control. */
+static void test_dl_sched(void)
+{
+	const uint16_t nsei = 0x77, bvci = 0x1234;
+	struct bssgp_bvc_ctx *bctx;
+	struct gprs_dl_bvc *bvc;
+	struct gprs_llc_lle *lle_a, *lle_b;
+	uint32_t tlli_a, tlli_b, tllis[16];
+	char order[ARRAY_SIZE(tllis) + 1];
+	unsigned int i;
+
+	printf("Testing downlink scheduler\n");
+
+	bctx = dl_sched_setup(nsei, bvci, tllis, ARRAY_SIZE(tllis));
+
+	tlli_a = gprs_tmsi2tlli(0xa00, TLLI_LOCAL);
+	tlli_b = gprs_tmsi2tlli(0xb00, TLLI_LOCAL);
+	lle_a = gprs_lle_get_or_create(tlli_a, 3);
+	lle_b = gprs_lle_get_or_create(tlli_b, 3);
+
+	/* A fills the BVC bucket with three frames of 506 bytes. BSSGP holds
+	 * back the fourth, the rest waits in the queues of the MSs. */
+	for (i = 0; i < 6; i++)
+		OSMO_ASSERT(dl_sched_tx(tlli_a, nsei, bvci, false) == 0);
+	for (i = 0; i < 6; i++)
+		OSMO_ASSERT(dl_sched_tx(tlli_b, nsei, bvci, false) == 0);
+	printf("  - %u frames sent right away\n", dl_captured);
+
+	dl_sched_advance_ms(1000);
+	OSMO_ASSERT(dl_captured == 12);
+	for (i = 0; i < dl_captured; i++)
+		order[i] = tllis[i] == tlli_a ? 'A' : 'B';
+	order[i] = '\0';
+	printf("  - order of transmission: %s\n", order);
+
+	OSMO_ASSERT(!llist_empty(&gprs_dl_bvcs));
+	bvc = llist_entry(gprs_dl_bvcs.next, struct gprs_dl_bvc, list);
+	printf("  - %llu sent, %llu after queueing, %u still queued\n",
+	       bvc->stats.sent_frames, bvc->stats.deferred,
+	       bvc->stats.queued_frames);
+
+	/* FLOW-CONTROL-BVC: 1000 bytes at 1000 bytes/s per MS. One frame
+	 * goes, the rest is queued up to the limit. */
+	bctx->bmax_default_ms = 1000;
+	bctx->r_default_ms = 1000;
+	dl_captured = 0;
+	for (i = 0; i < 10; i++)
+		dl_sched_tx(tlli_a, nsei, bvci, false);
+	printf("  - %u sent, %u queued, %llu dropped\n", dl_captured,
+	       lle_a->llme->dl->queued_frames, lle_a->llme->dl->dropped);
+
+	/* Nothing is left queued on the old BVC when A moves to one that
+	 * BSSGP does not know, BSSGP rejects the frame */
+	OSMO_ASSERT(dl_sched_tx(tlli_a, nsei, 0x4321, false) == -ENODEV);
+	printf("  - %u queued after moving to an unknown BVC\n",
+	       lle_a->llme->dl->queued_frames);
+
+	/* The queue goes away with the LLME, the BVC with its last MS */
+	gprs_llgmm_unassign(lle_a->llme);
+	printf("  - %llu dropped in total\n", bvc->stats.dropped);
+	gprs_llgmm_unassign(lle_b->llme);
+	OSMO_ASSERT(llist_empty(&gprs_dl_bvcs));
+
+	dl_sched_teardown();
+	cleanup_test();
+}
+
+/* Priority frames are sent before the bulk frames of the BVC, except for
+ * those of their own LLE, and CoDel keeps the bulk queue from building up
+ * a standing delay */
+static void test_dl_sched_prio(void)
+{
+	static const uint8_t gmm_payload[100];
+	const uint16_t nsei = 0x77, bvci = 0x1234;
+	struct bssgp_bvc_ctx *bctx;
+	struct gprs_dl_bvc *bvc;
+	struct gprs_dl_ms *ms_a;
+	struct gprs_llc_lle *lle_a, *lle_b;
+	struct msgb *msg;
+	uint32_t tlli_a, tlli_b, tllis[16];
+	char order[ARRAY_SIZE(tllis) + 1];
+	unsigned int i;
+
+	printf("Testing downlink scheduler priorities\n");
+
+	bctx = dl_sched_setup(nsei, bvci, tllis, ARRAY_SIZE(tllis));
+	sgsn_inst.cfg.dl_sched.codel_target = 0;
+
+	tlli_a = gprs_tmsi2tlli(0xa00, TLLI_LOCAL);
+	tlli_b = gprs_tmsi2tlli(0xb00, TLLI_LOCAL);
+	lle_a = gprs_lle_get_or_create(tlli_a, 3);
+	lle_b = gprs_lle_get_or_create(tlli_b, 3);
+
+	/* A download to A fills the BVC bucket, the priority frames of B
+	 * queued behind it go first. The one of A stays behind the bulk
+	 * frames of its LLE to keep N(U) in order. */
+	for (i = 0; i < 6; i++)
+		OSMO_ASSERT(dl_sched_tx(tlli_a, nsei, bvci, false) == 0);
+	for (i = 0; i < 2; i++)
+		OSMO_ASSERT(dl_sched_tx(tlli_b, nsei, bvci, true) == 0);
+	OSMO_ASSERT(dl_sched_tx(tlli_a, nsei, bvci, true) == 0);
+
+	dl_sched_advance_ms(1000);
+	OSMO_ASSERT(dl_captured == 9);
+	for (i = 0; i < dl_captured; i++)
+		order[i] = tllis[i] == tlli_a ? 'A' : 'B';
+	order[i] = '\0';
+	printf("  - order of transmission: %s\n", order);
+
+	OSMO_ASSERT(!llist_empty(&gprs_dl_bvcs));
+	bvc = llist_entry(gprs_dl_bvcs.next, struct gprs_dl_bvc, list);
+	printf("  - %llu priority frames sent\n", bvc->stats.prio);
+
+	/* FLOW-CONTROL-BVC: 600 bytes at 1000 bytes/s per MS, so only the
+	 * first frame goes out right away. A GMM frame of A then makes room
+	 * for itself in the full queue. */
+	bctx->bmax_default_ms = 600;
+	bctx->r_default_ms = 1000;
+	sgsn_inst.cfg.dl_sched.max_bytes = 3600;
+	dl_capture_tllis = NULL;
+	dl_capture_tllis_max = 0;
+	dl_captured = 0;
+	for (i = 0; i < 8; i++)
+		dl_sched_tx(tlli_a, nsei, bvci, false);
+	msg = llc_ui_msg(tlli_a, gmm_payload, sizeof(gmm_payload));
+	msgb_nsei(msg) = nsei;
+	msgb_bvci(msg) = bvci;
+	OSMO_ASSERT(gprs_llc_tx_ui_burst(&msg, 1, GPRS_SAPI_GMM, 0, NULL,
+					 false, true) == 0);
+	ms_a = lle_a->llme->dl;
+	printf("  - %u sent, %u queued, %llu dropped\n", dl_captured,
+	       ms_a->queued_frames, ms_a->dropped);
+	OSMO_ASSERT(!llist_empty(&ms_a->prio_queue));
+
+	/* CoDel thins out a queue that does not drain within the target */
+	gprs_dl_sched_ms_free(lle_a->llme);
+	sgsn_inst.cfg.dl_sched.max_bytes = 16000;
+	sgsn_inst.cfg.dl_sched.codel_target = 100;
+	sgsn_inst.cfg.dl_sched.codel_interval = 500;
+	dl_captured = 0;
+	for (i = 0; i < 20; i++)
+		OSMO_ASSERT(dl_sched_tx(tlli_a, nsei, bvci, false) == 0);
+	dl_sched_advance_ms(10000);
+	ms_a = lle_a->llme->dl;
+	printf("  - %u sent, %llu dropped by CoDel, %u still queued\n",
+	       dl_captured, bvc->stats.codel_dropped,
+	       ms_a->queued_frames);
+
+	gprs_llgmm_unassign(lle_a->llme);
+	gprs_llgmm_unassign(lle_b->llme);
+	OSMO_ASSERT(llist_empty(&gprs_dl_bvcs));
+
+	sgsn_inst.cfg.dl_sched.codel_target = 0;
+	dl_sched_teardown();
+	cleanup_test();
+}
+
+/* SNDCP classifies small packets, pure TCP ACKs and DNS as priority */
+static void test_sndcp_dl_prio(void)
+{
+	/* IPv4/TCP, ACK without payload */
+	uint8_t ip4_tcp[1400] = {
+		0x45, 0x00, 0x00, 0x28, 0x00, 0x00, 0x40, 0x00,
+		0x40, IPPROTO_TCP, 0x00, 0x00, 10, 0, 0, 1,
+		10, 0, 0, 2,
+		0x00, 0x50, 0xc0, 0x00, 0x00, 0x00, 0x00, 0x01,
+		0x00, 0x00, 0x00, 0x01, 0x50, 0x10, 0xff, 0xff,
+	};
+	/* IPv6/UDP from port 53 */
+	uint8_t ip6_udp[200] = {
+		0x60, 0x00, 0x00, 0x00, 0x00, 0xa0, IPPROTO_UDP, 0x40,
+		[40] = 0x00, 0x35, 0xc0, 0x00, 0x00, 0xa0,
+	};
+	const unsigned int prio_max_len = sgsn_inst.cfg.dl_sched.prio_max_len;
+
+	printf("Testing SNDCP downlink classification\n");
+
+	sgsn_inst.cfg.dl_sched.prio_max_len = 0;
+
+	printf("  - TCP ACK: %d\n", sndcp_dl_prio(ip4_tcp, 40));
+	/* with 1360 bytes of payload */
+	ip4_tcp[2] = 0x05;
+	ip4_tcp[3] = 0x78;
+	printf("  - TCP data: %d\n", sndcp_dl_prio(ip4_tcp, sizeof(ip4_tcp)));
+	printf("  - DNS: %d\n", sndcp_dl_prio(ip6_udp, sizeof(ip6_udp)));
+	/* from port 443 */
+	ip6_udp[41] = 0xbb;
+	ip6_udp[40] = 0x01;
+	printf("  - UDP: %d\n", sndcp_dl_prio(ip6_udp, sizeof(ip6_udp)));
+
+	sgsn_inst.cfg.dl_sched.prio_max_len = 200;
+	printf("  - small UDP: %d\n", sndcp_dl_prio(ip6_udp, sizeof(ip6_udp)));
+
+	sgsn_inst.cfg.dl_sched.prio_max_len = prio_max_len;
+}
+
+/* User data is policed by the maximum bitrates of the negotiated QoS */
+static void test_pdp_policer(void)
+{
+	/* ARP, octets 3 to 15 of 3GPP TS 24.008 10.5.6.5: 64 kbit/s UL,
+	 * 576 kbit/s DL */
+	uint8_t qos[14] = {
+		0x02, 0x23, 0x71, 0x1f, 0x93, 0x96, 0x40, 0x80,
+		0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	};
+	/* Peak throughput class 4 */
+	const uint8_t qos_r97[] = { 0x02, 0x23, 0x41, 0x1f };
+	struct gprs_ra_id raid = { 0, };
+	struct sgsn_mm_ctx *ctx;
+	struct sgsn_ggsn_ctx *ggc;
+	struct sgsn_pdp_ctx *pdp;
+	unsigned int i, num;
+
+	printf("Testing QoS policing\n");
+
+	osmo_clock_override_enable(CLOCK_MONOTONIC, true);
+	sgsn->cfg.qos_policing.enable = true;
+	sgsn->cfg.qos_policing.burst = 1000;
+
+	ctx = alloc_mm_ctx(gprs_tmsi2tlli(0x789, TLLI_LOCAL), &raid);
+	ggc = sgsn_ggsn_ctx_alloc(1);
+	pdp = sgsn_pdp_ctx_alloc(ctx, ggc, 5);
+	OSMO_ASSERT(pdp);
+
+	sgsn_pdp_policer_set(pdp, qos, 8);
+	printf("  - R99: UL %u, DL %u octet/s\n", pdp->policer_ul.rate,
+	       pdp->policer_dl.rate);
+	/* 16 Mbit/s DL in the extension */
+	qos[7] = 0xfe;
+	qos[13] = 0x4a;
+	sgsn_pdp_policer_set(pdp, qos, sizeof(qos));
+	printf("  - extended: DL %u octet/s\n", pdp->policer_dl.rate);
+	sgsn_pdp_policer_set(pdp, qos_r97, sizeof(qos_r97));
+	printf("  - R97: UL %u, DL %u octet/s\n", pdp->policer_ul.rate,
+	       pdp->policer_dl.rate);
+
+	/* The bucket holds one second at 8000 octet/s */
+	for (i = 0, num = 0; i < 10; i++)
+		num += sgsn_pdp_policer_conform(&pdp->policer_ul, 1000);
+	printf("  - %u of 10 N-PDUs conform\n", num);
+	osmo_clock_override_add(CLOCK_MONOTONIC, 0, 500000000);
+	for (i = 0, num = 0; i < 10; i++)
+		num += sgsn_pdp_policer_conform(&pdp->policer_ul, 1000);
+	printf("  - %u of 10 N-PDUs conform after 500 ms\n", num);
+	sgsn->cfg.qos_policing.enable = false;
+	for (i = 0, num = 0; i < 10; i++)
+		num += sgsn_pdp_policer_conform(&pdp->policer_ul, 1000);
+	printf("  - %u of 10 N-PDUs conform without policing\n", num);
+
+	sgsn_pdp_ctx_free(pdp);
+	sgsn_mm_ctx_cleanup_free(ctx);
+	sgsn_ggsn_ctx_free(ggc);
+	osmo_clock_override_enable(CLOCK_MONOTONIC, false);
+
+	cleanup_test();
+}
+
+/* N-PDUs for a suspended MS are buffered within the configured limits and
+ * sent in order once the MS resumes */
+static void test_dl_queue(void)
+{
+	struct gprs_ra_id raid = { 0, };
+	struct sgsn_mm_ctx *ctx;
+	struct sgsn_ggsn_ctx *ggc;
+	struct sgsn_pdp_ctx *pdp;
+	struct rate_ctr *ctr;
+	uint8_t payload[100];
+	uint32_t tlli;
+	unsigned int i;
+
+	printf("Testing downlink queue\n");
+
+	sgsn->cfg.dl_queue.max_pkts = 3;
+	sgsn->cfg.dl_queue.max_bytes = 1500;
+	sgsn->cfg.dl_queue.max_age = 5;
+	osmo_clock_override_enable(CLOCK_MONOTONIC, true);
+
+	tlli = gprs_tmsi2tlli(0x456, TLLI_LOCAL);
+	ctx = alloc_mm_ctx(tlli, &raid);
+	ctx->gmm_state = GMM_REGISTERED_SUSPENDED;
+	ggc = sgsn_ggsn_ctx_alloc(1);
+	pdp = sgsn_pdp_ctx_alloc(ctx, ggc, 5);
+	OSMO_ASSERT(pdp);
+	pdp->sapi = 3;
+	OSMO_ASSERT(sndcp_sm_activate_ind(gprs_llme_lle(ctx->gb.llme, 3), 5) == 0);
+	ctr = pdp->ctrg->ctr;
+	memset(payload, 0x2a, sizeof(payload));
+
+	/* The oldest N-PDUs make room for new ones */
+	for (i = 0; i < 5; i++)
+		OSMO_ASSERT(sgsn_pdp_dl_queue_add(pdp, payload, sizeof(payload)) == 0);
+	OSMO_ASSERT(pdp->dl_queue_len == 3);
+	OSMO_ASSERT(pdp->dl_queue_bytes == 3 * sizeof(payload));
+	OSMO_ASSERT(ctr[PDP_CTR_DL_QUEUED].current == 5);
+	OSMO_ASSERT(ctr[PDP_CTR_DL_DROPPED].current == 2);
+
+	/* Buffered N-PDUs expire */
+	osmo_clock_override_add(CLOCK_MONOTONIC, 5, 0);
+	OSMO_ASSERT(sgsn_pdp_dl_queue_add(pdp, payload, sizeof(payload)) == 0);
+	OSMO_ASSERT(pdp->dl_queue_len == 1);
+	OSMO_ASSERT(ctr[PDP_CTR_DL_EXPIRED].current == 3);
+
+	/* RESUME sends what is left */
+	OSMO_ASSERT(sgsn_pdp_dl_queue_add(pdp, payload, sizeof(payload)) == 0);
+	dl_capture = true;
+	dl_captured = 0;
+	OSMO_ASSERT(gprs_gmm_rx_resume(&raid, tlli, 0) == 0);
+	dl_capture = false;
+	OSMO_ASSERT(ctx->gmm_state == GMM_REGISTERED_NORMAL);
+	OSMO_ASSERT(dl_captured == 2);
+	OSMO_ASSERT(pdp->dl_queue_len == 0);
+	OSMO_ASSERT(pdp->dl_queue_bytes == 0);
+	OSMO_ASSERT(ctr[PDP_CTR_DL_FLUSHED].current == 2);
+	sgsn_pdp_ctx_ctrs_flush(pdp);
+	OSMO_ASSERT(ctr[PDP_CTR_PKTS_UDATA_OUT].current == 2);
+
+	/* Buffered N-PDUs go away with the PDP context */
+	OSMO_ASSERT(sgsn_pdp_dl_queue_add(pdp, payload, sizeof(payload)) == 0);
+	sgsn_pdp_ctx_free(pdp);
+	sgsn_mm_ctx_cleanup_free(ctx);
+	sgsn_ggsn_ctx_free(ggc);
+
+	osmo_clock_override_enable(CLOCK_MONOTONIC, false);
+	memset(&sgsn->cfg.dl_queue, 0, sizeof(sgsn->cfg.dl_queue));
+
+	cleanup_test();
+}
+
+/* User data counts reach the rate counters of the PDP and MM context
+ * after SGSN_PDP_CTRS_FLUSH_MS, or when the PDP context goes away */
+static void test_pdp_ctrs(void)
+{
+	struct gprs_ra_id raid = { 0, };
+	struct sgsn_mm_ctx *ctx;
+	struct sgsn_ggsn_ctx *ggc;
+	struct sgsn_pdp_ctx *pdp;
+	struct rate_ctr *pdp_ctr, *mm_ctr;
+	unsigned int i;
+
+	printf("Testing PDP context user data counters\n");
+
+	osmo_gettimeofday_override = true;
+	osmo_gettimeofday_override_time = (struct timeval){ 1000, 0 };
+	osmo_clock_override_enable(CLOCK_MONOTONIC, true);
+
+	ctx = alloc_mm_ctx(gprs_tmsi2tlli(0x789, TLLI_LOCAL), &raid);
+	ggc = sgsn_ggsn_ctx_alloc(1);
+	pdp = sgsn_pdp_ctx_alloc(ctx, ggc, 5);
+	OSMO_ASSERT(pdp);
+	pdp_ctr = pdp->ctrg->ctr;
+	mm_ctr = ctx->ctrg->ctr;
+
+	for (i = 0; i < 3; i++)
+		sgsn_pdp_ctx_count_ud_in(pdp, 100);
+	for (i = 0; i < 2; i++)
+		sgsn_pdp_ctx_count_ud_out(pdp, 1000);
+	OSMO_ASSERT(pdp_ctr[PDP_CTR_PKTS_UDATA_IN].current == 0);
+	OSMO_ASSERT(mm_ctr[GMM_CTR_PKTS_UDATA_OUT].current == 0);
+
+	dl_sched_advance_ms(SGSN_PDP_CTRS_FLUSH_MS - 1);
+	OSMO_ASSERT(pdp_ctr[PDP_CTR_PKTS_UDATA_IN].current == 0);
+	dl_sched_advance_ms(1);
+	printf("  - after %u ms: PDP in %u/%u out %u/%u, MM in %u/%u out %u/%u\n",
+	       SGSN_PDP_CTRS_FLUSH_MS,
+	       (unsigned int)pdp_ctr[PDP_CTR_PKTS_UDATA_IN].current,
+	       (unsigned int)pdp_ctr[PDP_CTR_BYTES_UDATA_IN].current,
+	       (unsigned int)pdp_ctr[PDP_CTR_PKTS_UDATA_OUT].current,
+	       (unsigned int)pdp_ctr[PDP_CTR_BYTES_UDATA_OUT].current,
+	       (unsigned int)mm_ctr[GMM_CTR_PKTS_UDATA_IN].current,
+	       (unsigned int)mm_ctr[GMM_CTR_BYTES_UDATA_IN].current,
+	       (unsigned int)mm_ctr[GMM_CTR_PKTS_UDATA_OUT].current,
+	       (unsigned int)mm_ctr[GMM_CTR_BYTES_UDATA_OUT].current);
+
+	/* Counts pending when the PDP context is freed are not lost */
+	sgsn_pdp_ctx_count_ud_in(pdp, 100);
+	sgsn_pdp_ctx_free(pdp);
+	printf("  - after PDP context release: MM in %u/%u\n",
+	       (unsigned int)mm_ctr[GMM_CTR_PKTS_UDATA_IN].current,
+	       (unsigned int)mm_ctr[GMM_CTR_BYTES_UDATA_IN].current);
+
+	sgsn_mm_ctx_cleanup_free(ctx);
+	sgsn_ggsn_ctx_free(ggc);
+
+	osmo_clock_override_enable(CLOCK_MONOTONIC, false);
+	osmo_gettimeofday_override = false;
+
+	cleanup_test();
+}
+
+/* Records of the downlink LLC path and records added directly, across a
+ * wrap of the ring, in a snapshot and in a file */
+static void test_packet_trace(void)
+{
+	struct gprs_trace_rec recs[16], file_recs[16];
+	struct gprs_trace_file_hdr hdr;
+	char path[] = "/tmp/sgsn_test_trace_XXXXXX";
+	struct gprs_llc_lle *lle;
+	uint8_t payload[100];
+	unsigned int i, num;
+	char buf[128];
+	uint32_t tlli;
+	FILE *f;
+	int fd;
+
+	printf("Testing packet trace\n");
+
+	OSMO_ASSERT(gprs_trace_init(tall_sgsn_ctx, 6) == 0);
+	OSMO_ASSERT(gprs_trace_ring.mask == 7);
+
+	tlli = gprs_tmsi2tlli(0x346, TLLI_LOCAL);
+	lle = gprs_lle_get_or_create(tlli, 3);
+	OSMO_ASSERT(sndcp_sm_activate_ind(lle, 5) == 0);
+	memset(payload, 0x2a, sizeof(payload));
+
+	dl_capture = true;
+	for (i = 0; i < 3; i++)
+		OSMO_ASSERT(sndcp_unitdata_req_data(payload, sizeof(payload),
+						    lle, 5, NULL, tlli, 1, 2) == 0);
+	dl_capture = false;
+
+	num = gprs_trace_snapshot(recs, ARRAY_SIZE(recs));
+	OSMO_ASSERT(num == 3);
+	for (i = 0; i < num; i++) {
+		OSMO_ASSERT(recs[i].seq == i + 1);
+		OSMO_ASSERT(recs[i].point == GPRS_TRACE_LLC_DL);
+		OSMO_ASSERT(recs[i].verdict == GPRS_TRACE_V_OK);
+		OSMO_ASSERT(recs[i].tlli == tlli);
+		OSMO_ASSERT(recs[i].sapi == 3);
+		OSMO_ASSERT(recs[i].nu == i);
+		OSMO_ASSERT(recs[i].len > sizeof(payload));
+	}
+	printf("  - %u LLC-DL records, N(U) %u to %u\n", num, recs[0].nu,
+	       recs[num - 1].nu);
+
+	for (i = 0; i < 7; i++)
+		gprs_trace_pkt(GPRS_TRACE_SNDCP_UL,
+			       i % 2 ? GPRS_TRACE_V_POLICED : GPRS_TRACE_V_OK,
+			       0x12345678, GPRS_TRACE_NO_ID, 5, GPRS_TRACE_NO_NU,
+			       100 + i);
+
+	/* The oldest two are overwritten */
+	num = gprs_trace_snapshot(recs, ARRAY_SIZE(recs));
+	printf("  - %u of 10 records in the ring\n", num);
+	OSMO_ASSERT(recs[0].seq == 3 && recs[0].point == GPRS_TRACE_LLC_DL);
+	for (i = 1; i < num; i++) {
+		gprs_trace_rec_str(buf, sizeof(buf), &recs[i]);
+		printf("  %s\n", buf);
+	}
+
+	/* A record that is being written is left out */
+	gprs_trace_ring.recs[5].seq = 0;
+	num = gprs_trace_snapshot(recs, ARRAY_SIZE(recs));
+	printf("  - %u records while one is being written\n", num);
+
+	fd = mkstemp(path);
+	OSMO_ASSERT(fd >= 0);
+	close(fd);
+	OSMO_ASSERT(gprs_trace_write(path) == num);
+	f = fopen(path, "r");
+	OSMO_ASSERT(f);
+	OSMO_ASSERT(fread(&hdr, sizeof(hdr), 1, f) == 1);
+	OSMO_ASSERT(hdr.magic == GPRS_TRACE_FILE_MAGIC);
+	OSMO_ASSERT(hdr.version == GPRS_TRACE_FILE_VERSION);
+	OSMO_ASSERT(hdr.rec_size == sizeof(struct gprs_trace_rec));
+	OSMO_ASSERT(hdr.num == num);
+	OSMO_ASSERT(fread(file_recs, sizeof(file_recs[0]), num, f) == num);
+	OSMO_ASSERT(memcmp(file_recs, recs, num * sizeof(recs[0])) == 0);
+	fclose(f);
+	unlink(path);
+	printf("  - %u records written and read back\n", hdr.num);
+
+	OSMO_ASSERT(gprs_trace_init(tall_sgsn_ctx, 0) == 0);
+	gprs_trace_pkt(GPRS_TRACE_SNDCP_UL, GPRS_TRACE_V_OK, 0x12345678,
+		       GPRS_TRACE_NO_ID, 5, GPRS_TRACE_NO_NU, 100);
+	OSMO_ASSERT(gprs_trace_snapshot(recs, ARRAY_SIZE(recs)) == 0);
+	OSMO_ASSERT(gprs_trace_write(path) == -ENODEV);
+
+	gprs_llgmm_unassign(lle->llme);
+	OSMO_ASSERT(count(gprs_llme_list()) == 0);
+
+	cleanup_test();
+}
+
 static struct log_info_cat gprs_categories[] = {
 	[DMM] = {
 		.name = "DMM",
@@ -1633,7 +2773,6 @@ static struct log_info info = {
 int main(int argc, char **argv)
 {
 	void *osmo_sgsn_ctx;
-	void *msgb_ctx;
 
 	osmo_sgsn_ctx = talloc_named_const(NULL, 0, "osmo_sgsn");
 	osmo_init_logging2(osmo_sgsn_ctx, &info);
@@ -1657,8 +2796,25 @@ int main(int argc, char **argv)
 	test_gmm_cancel();
 	test_apn_matching();
 	test_ggsn_selection();
+	test_mm_ctx_lookup_index();
+	test_obj_pool();
+	test_msgb_pool();
+	test_llc_ctrl_alloc();
+	test_dl_zero_copy();
+	test_llc_cipher();
+	test_llc_offload();
+	test_dl_sched();
+	test_dl_sched_prio();
+	test_sndcp_dl_prio();
+	test_dl_queue();
+	test_pdp_policer();
+	test_packet_trace();
+	test_pdp_ctrs();
 	printf("Done\n");
 
+	/* Released MM/PDP contexts and msgbs are cached for reuse */
+	gprs_obj_pools_flush();
+	gprs_msgb_pools_flush();
 	talloc_report_full(osmo_sgsn_ctx, stderr);
 	OSMO_ASSERT(talloc_total_blocks(msgb_ctx) == 1);
 	OSMO_ASSERT(talloc_total_blocks(tall_sgsn_ctx) == 2);
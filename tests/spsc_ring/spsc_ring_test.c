@@ -0,0 +1,107 @@
+/* Test the lock-free single producer, single consumer ring */
+
+/* (C) 2026 by sysmocom s.f.m.c. GmbH <info@sysmocom.de>
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <osmocom/sgsn/gprs_spsc_ring.h>
+
+#include <osmocom/core/utils.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+
+#define RING_SIZE	64
+#define NUM_ITEMS	1000000
+
+static void test_full_empty(void)
+{
+	void *slots[4];
+	struct gprs_spsc_ring ring;
+	uintptr_t i;
+
+	printf("Testing full and empty ring\n");
+
+	gprs_spsc_ring_init(&ring, slots, ARRAY_SIZE(slots));
+	OSMO_ASSERT(gprs_spsc_ring_pop(&ring) == NULL);
+
+	/* wrap the counters around a few times */
+	for (i = 1; i <= 10; i++) {
+		OSMO_ASSERT(gprs_spsc_ring_push(&ring, (void *)i));
+		OSMO_ASSERT(gprs_spsc_ring_pop(&ring) == (void *)i);
+	}
+
+	for (i = 1; i <= ARRAY_SIZE(slots); i++)
+		OSMO_ASSERT(gprs_spsc_ring_push(&ring, (void *)i));
+	OSMO_ASSERT(!gprs_spsc_ring_push(&ring, (void *)i));
+	printf("  - %u entries queued when full\n", gprs_spsc_ring_count(&ring));
+
+	for (i = 1; i <= ARRAY_SIZE(slots); i++)
+		OSMO_ASSERT(gprs_spsc_ring_pop(&ring) == (void *)i);
+	OSMO_ASSERT(gprs_spsc_ring_pop(&ring) == NULL);
+	OSMO_ASSERT(gprs_spsc_ring_count(&ring) == 0);
+}
+
+static void *producer(void *data)
+{
+	struct gprs_spsc_ring *ring = data;
+	uintptr_t i;
+
+	for (i = 1; i <= NUM_ITEMS; i++) {
+		while (!gprs_spsc_ring_push(ring, (void *)i))
+			sched_yield();
+	}
+	return NULL;
+}
+
+/* Every item has to arrive exactly once and in order */
+static void test_threads(void)
+{
+	void *slots[RING_SIZE];
+	struct gprs_spsc_ring ring;
+	pthread_t thread;
+	uintptr_t expected = 1;
+	void *obj;
+
+	printf("Testing producer and consumer thread\n");
+
+	gprs_spsc_ring_init(&ring, slots, ARRAY_SIZE(slots));
+	OSMO_ASSERT(pthread_create(&thread, NULL, producer, &ring) == 0);
+
+	while (expected <= NUM_ITEMS) {
+		obj = gprs_spsc_ring_pop(&ring);
+		if (!obj) {
+			sched_yield();
+			continue;
+		}
+		OSMO_ASSERT(obj == (void *)expected);
+		expected++;
+	}
+
+	OSMO_ASSERT(pthread_join(thread, NULL) == 0);
+	OSMO_ASSERT(gprs_spsc_ring_pop(&ring) == NULL);
+	printf("  - %lu items received in order\n", (unsigned long)(expected - 1));
+}
+
+int main(int argc, char **argv)
+{
+	test_full_empty();
+	test_threads();
+	printf("Done\n");
+	return 0;
+}
@@ -152,6 +152,7 @@ class TestVTYSGSN(TestVTYBase):
         self.assertTrue(self.vty.verify('show mm-context all', ['']))
         self.assertTrue(self.vty.verify('show mm-context imsi 000001234567', ['No MM context for IMSI 000001234567']))
         self.assertTrue(self.vty.verify('show pdp-context all', ['']))
+        self.assertTrue(self.vty.verify('show sgsn downlink-scheduler', ['']))
 
         res = self.vty.command("show sndcp")
         self.assert_(res.find('State of SNDCP Entities') >= 0)
@@ -159,6 +160,9 @@ class TestVTYSGSN(TestVTYBase):
         res = self.vty.command("show llc")
         self.assert_(res.find('State of LLC Entities') >= 0)
 
+        res = self.vty.command("show llc memory")
+        self.assert_(res.find('LLMEs: 0 of ') >= 0)
+
     def testVtyAuth(self):
         self.vty.enable()
         self.assertTrue(self.vty.verify('configure terminal', ['']))
@@ -266,6 +270,119 @@ class TestVTYSGSN(TestVTYBase):
         self.assert_(res.find(" cdr interval 900") > 0)
         self.assertEquals(res.find(" cdr interval 600"), -1)
 
+    def testVtyDlQueue(self):
+        self.vty.enable()
+        self.assertTrue(self.vty.verify('configure terminal', ['']))
+        self.assertTrue(self.vty.verify('sgsn', ['']))
+        self.assertEquals(self.vty.node(), 'config-sgsn')
+
+        res = self.vty.command("show running-config")
+        self.assert_(res.find(" downlink-queue max-packets 32") > 0)
+        self.assert_(res.find(" downlink-queue max-bytes 65536") > 0)
+        self.assert_(res.find(" downlink-queue max-age 10") > 0)
+
+        self.assertTrue(self.vty.verify("downlink-queue max-packets 0", ['']))
+        self.assertTrue(self.vty.verify("downlink-queue max-age 30", ['']))
+        res = self.vty.command("show running-config")
+        self.assert_(res.find(" downlink-queue max-packets 0") > 0)
+        self.assert_(res.find(" downlink-queue max-age 30") > 0)
+
+    def testVtyOffloadWorkers(self):
+        self.vty.enable()
+        self.assertTrue(self.vty.verify('configure terminal', ['']))
+        self.assertTrue(self.vty.verify('sgsn', ['']))
+        self.assertEquals(self.vty.node(), 'config-sgsn')
+
+        res = self.vty.command("show running-config")
+        self.assert_(res.find(" offload-workers 0") > 0)
+
+        self.assertTrue(self.vty.verify("offload-workers 2", ['']))
+        res = self.vty.command("show running-config")
+        self.assert_(res.find(" offload-workers 2") > 0)
+        self.assertTrue(self.vty.verify("offload-workers 0", ['']))
+
+    def testVtyDlSched(self):
+        self.vty.enable()
+        self.assertTrue(self.vty.verify('configure terminal', ['']))
+        self.assertTrue(self.vty.verify('sgsn', ['']))
+        self.assertEquals(self.vty.node(), 'config-sgsn')
+
+        res = self.vty.command("show running-config")
+        self.assert_(res.find(" downlink-scheduler quantum 1600") > 0)
+        self.assert_(res.find(" downlink-scheduler max-bytes 32768") > 0)
+
+        self.assertTrue(self.vty.verify("downlink-scheduler quantum 3200", ['']))
+        self.assertTrue(self.vty.verify("downlink-scheduler max-bytes 65536", ['']))
+        res = self.vty.command("show running-config")
+        self.assert_(res.find(" downlink-scheduler quantum 3200") > 0)
+        self.assert_(res.find(" downlink-scheduler max-bytes 65536") > 0)
+
+    def testVtyDlSchedPrio(self):
+        self.vty.enable()
+        self.assertTrue(self.vty.verify('configure terminal', ['']))
+        self.assertTrue(self.vty.verify('sgsn', ['']))
+        self.assertEquals(self.vty.node(), 'config-sgsn')
+
+        res = self.vty.command("show running-config")
+        self.assert_(res.find(" downlink-scheduler priority max-length 128") > 0)
+        self.assert_(res.find(" downlink-scheduler codel target 200") > 0)
+        self.assert_(res.find(" downlink-scheduler codel interval 2000") > 0)
+
+        self.assertTrue(self.vty.verify("downlink-scheduler priority max-length 0", ['']))
+        self.assertTrue(self.vty.verify("downlink-scheduler codel target 0", ['']))
+        self.assertTrue(self.vty.verify("downlink-scheduler codel interval 500", ['']))
+        res = self.vty.command("show running-config")
+        self.assert_(res.find(" downlink-scheduler priority max-length 0") > 0)
+        self.assert_(res.find(" downlink-scheduler codel target 0") > 0)
+        self.assert_(res.find(" downlink-scheduler codel interval 500") > 0)
+
+    def testVtyQosPolicing(self):
+        self.vty.enable()
+        self.assertTrue(self.vty.verify('configure terminal', ['']))
+        self.assertTrue(self.vty.verify('sgsn', ['']))
+        self.assertEquals(self.vty.node(), 'config-sgsn')
+
+        res = self.vty.command("show running-config")
+        self.assert_(res.find(" no qos-policing") > 0)
+        self.assert_(res.find(" qos-policing burst 1000") > 0)
+
+        self.assertTrue(self.vty.verify("qos-policing", ['']))
+        self.assertTrue(self.vty.verify("qos-policing burst 250", ['']))
+        res = self.vty.command("show running-config")
+        self.assert_(res.find(" no qos-policing") < 0)
+        self.assert_(res.find(" qos-policing burst 250") > 0)
+        self.assertTrue(self.vty.verify("no qos-policing", ['']))
+
+    def testVtyPacketTrace(self):
+        self.vty.enable()
+        res = self.vty.command("show sgsn packet-trace")
+        self.assert_(res.find("% Packet tracing is off") >= 0)
+
+        self.assertTrue(self.vty.verify('configure terminal', ['']))
+        self.assertTrue(self.vty.verify('sgsn', ['']))
+        self.assertEquals(self.vty.node(), 'config-sgsn')
+
+        res = self.vty.command("show running-config")
+        self.assert_(res.find(" packet-trace records 0") > 0)
+
+        self.assertTrue(self.vty.verify("packet-trace records 1000", ['']))
+        res = self.vty.command("show running-config")
+        self.assert_(res.find(" packet-trace records 1000") > 0)
+        self.vty.command("end")
+        self.assertTrue(self.vty.verify("show sgsn packet-trace 10", ['']))
+
+        self.assertTrue(self.vty.verify('configure terminal', ['']))
+        self.assertTrue(self.vty.verify('sgsn', ['']))
+        self.assertTrue(self.vty.verify("packet-trace records 0", ['']))
+
+    def testVtyPools(self):
+        self.vty.enable()
+        res = self.vty.command("show sgsn pools")
+        self.assert_(res.find("  msgb 256: ") >= 0)
+        self.assert_(res.find("  msgb 2048: ") >= 0)
+        self.assert_(res.find("  msgb 4096: ") >= 0)
+        self.assert_(res.find("  msgb oversize: ") >= 0)
+
 
 def add_gbproxy_test(suite, workdir):
     if not os.path.isfile(os.path.join(workdir, "src/gprs/osmo-gbproxy")):